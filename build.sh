@@ -33,15 +33,60 @@ echo "Linker flags: $LDFLAGS"
 
 
 echo "Compiling..."
+$CXX $CXXFLAGS -c dns_wire.cpp -o dns_wire.o
+$CXX $CXXFLAGS -c zone_file.cpp -o zone_file.o
+$CXX $CXXFLAGS -c qsbr.cpp -o qsbr.o
+$CXX $CXXFLAGS -c latency_histogram.cpp -o latency_histogram.o
+$CXX $CXXFLAGS -c frequency_sketch.cpp -o frequency_sketch.o
+$CXX $CXXFLAGS -c cpu_topology.cpp -o cpu_topology.o
+$CXX $CXXFLAGS -c rate_limiter.cpp -o rate_limiter.o
+$CXX $CXXFLAGS -c query_trace.cpp -o query_trace.o
 $CXX $CXXFLAGS -c dns_server.cpp -o dns_server.o
+$CXX $CXXFLAGS -c uring_engine.cpp -o uring_engine.o
+$CXX $CXXFLAGS -c tcp_server.cpp -o tcp_server.o
+$CXX $CXXFLAGS -c upstream_forwarder.cpp -o upstream_forwarder.o
+$CXX $CXXFLAGS -c metrics_server.cpp -o metrics_server.o
 $CXX $CXXFLAGS -c main.cpp -o main.o
+$CXX $CXXFLAGS -c zone_compiler.cpp -o zone_compiler.o
+$CXX $CXXFLAGS -c dns_bench.cpp -o dns_bench.o
+$CXX $CXXFLAGS -c dns_wire_test.cpp -o dns_wire_test.o
+$CXX $CXXFLAGS -c dns_server_test.cpp -o dns_server_test.o
+
+# cache_sim replays logs on a virtual clock, so it gets its own build of the
+# objects that embed the cache
+$CXX $CXXFLAGS -DCACHE_SIM_CLOCK -c dns_server.cpp -o dns_server_sim.o
+$CXX $CXXFLAGS -DCACHE_SIM_CLOCK -c uring_engine.cpp -o uring_engine_sim.o
+$CXX $CXXFLAGS -DCACHE_SIM_CLOCK -c tcp_server.cpp -o tcp_server_sim.o
+$CXX $CXXFLAGS -DCACHE_SIM_CLOCK -c cache_sim.cpp -o cache_sim.o
 
 echo "Linking..."
-$CXX $LDFLAGS dns_server.o main.o -o ultra_fast_dns_server
+$CXX $LDFLAGS dns_wire.o zone_file.o qsbr.o latency_histogram.o frequency_sketch.o cpu_topology.o rate_limiter.o query_trace.o dns_server.o uring_engine.o tcp_server.o upstream_forwarder.o metrics_server.o main.o -o ultra_fast_dns_server
+$CXX $LDFLAGS dns_wire.o zone_file.o zone_compiler.o -o zone_compiler
+$CXX $LDFLAGS dns_wire.o latency_histogram.o dns_bench.o -o dns_bench
+$CXX $LDFLAGS dns_wire.o dns_wire_test.o -o dns_wire_test
+$CXX $LDFLAGS dns_wire.o zone_file.o qsbr.o latency_histogram.o frequency_sketch.o cpu_topology.o rate_limiter.o query_trace.o dns_server.o uring_engine.o tcp_server.o upstream_forwarder.o metrics_server.o dns_server_test.o -o dns_server_test
+$CXX $LDFLAGS dns_wire.o zone_file.o qsbr.o latency_histogram.o frequency_sketch.o cpu_topology.o rate_limiter.o query_trace.o dns_server_sim.o uring_engine_sim.o tcp_server_sim.o upstream_forwarder.o metrics_server.o cache_sim.o -o cache_sim
+
+# Microbenchmarks need Google Benchmark (libbenchmark-dev); skipped without it
+BINARIES="ultra_fast_dns_server zone_compiler dns_bench cache_sim"
+if echo '#include <benchmark/benchmark.h>' | $CXX -x c++ -E - >/dev/null 2>&1; then
+    echo "Building microbenchmarks..."
+    $CXX $CXXFLAGS -c dns_microbench.cpp -o dns_microbench.o
+    $CXX $LDFLAGS dns_wire.o zone_file.o qsbr.o latency_histogram.o frequency_sketch.o cpu_topology.o rate_limiter.o query_trace.o dns_server.o uring_engine.o tcp_server.o upstream_forwarder.o metrics_server.o dns_microbench.o -lbenchmark -o dns_microbench
+    BINARIES="$BINARIES dns_microbench"
+else
+    echo "Google Benchmark not found - skipping dns_microbench"
+fi
+
+
+echo "Running tests..."
+./dns_wire_test
+./dns_server_test
+rm -f dns_wire_test dns_server_test
 
 
 echo "Stripping debug symbols..."
-strip ultra_fast_dns_server
+strip $BINARIES
 
 
 SIZE=$(du -h ultra_fast_dns_server | cut -f1)
@@ -77,7 +122,7 @@ else
 fi
 
 echo ""
-echo "Build successful! Binary: ultra_fast_dns_server"
+echo "Build successful! Binaries: $BINARIES"
 echo ""
 echo "Usage:"
 echo "  ./ultra_fast_dns_server [port]       # Default port: 5353"
@@ -88,7 +133,8 @@ echo "  dig @localhost -p 5353 test1.local"
 echo "  dig @localhost -p 5353 google.com"
 echo ""
 echo "Performance benchmark:"
-echo "  time for i in {1..1000}; do dig @localhost -p 5353 test1.local >/dev/null; done"
+echo "  ./dns_bench --server 127.0.0.1:5353 --threads 4 --duration 10"
+echo "  ./dns_bench --rate 50000 --mix 40:50:10   # fixed offered load"
 echo ""
 echo "Expected performance:"
 echo "  - Local domains: 20-50μs response time"
@@ -0,0 +1,525 @@
+#include "dns_server.h"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+// Offline capacity planning: replays a captured query log through
+// FastDNSCache, with no sockets and no upstream, for every combination of
+// the configurations given and reports hit ratio, evictions and lock
+// contention for each. Configurations run in parallel, one job per core.
+//
+// The cache is built with CACHE_SIM_CLOCK, so expiry follows the log's own
+// timestamps: an hour of traffic replays in seconds and still expires
+// entries as the live server would have. Inputs:
+//
+//   pcap      classic libpcap (not pcapng); UDP queries to --port over
+//             IPv4 or IPv6 on Ethernet, Linux cooked, loopback or raw links
+//   text      one query per line: [unix-time] name [type] [ttl]
+//             lines without a time are spaced 1/--qps seconds apart
+
+struct Record {
+    int64_t time_us;   // since the first query
+    uint32_t name;     // index into Trace::keys
+    uint32_t ttl;
+    uint16_t qtype;
+};
+
+struct Trace {
+    vector<string> keys;       // lowercased wire-format names
+    vector<uint64_t> hashes;
+    vector<Record> records;
+    unordered_map<string, uint32_t> index;
+    size_t skipped = 0;        // packets or lines that were not a usable query
+
+    void add(string_view key, uint64_t hash, uint16_t qtype, int64_t time_us, uint32_t ttl) {
+        auto it = index.find(string(key));
+        uint32_t name;
+        if (it == index.end()) {
+            name = static_cast<uint32_t>(keys.size());
+            keys.emplace_back(key);
+            hashes.push_back(hash);
+            index.emplace(keys.back(), name);
+        } else {
+            name = it->second;
+        }
+        records.push_back({time_us, name, ttl, qtype});
+    }
+};
+
+struct Options {
+    uint32_t ttl = 300;        // for queries whose log gives none
+    uint16_t port = 53;
+    double qps = 1000;         // pacing for untimed text logs
+    size_t jobs = 0;           // 0 = one per hardware thread
+    vector<size_t> capacities = {FastDNSCache::DEFAULT_CAPACITY};
+    vector<size_t> shards = {FastDNSCache::DEFAULT_SHARDS};
+    vector<bool> lock_free_reads = {true};
+    vector<bool> admission = {true};
+    vector<size_t> replay_threads = {1};
+};
+
+static bool is_timestamp(const string& token) {
+    return !token.empty() && token.find_first_not_of("0123456789.") == string::npos &&
+           count(token.begin(), token.end(), '.') <= 1;
+}
+
+static void load_text(istream& in, const Options& options, Trace& trace) {
+    int64_t first_us = -1;
+    int64_t untimed_us = 0;
+    int64_t step_us = static_cast<int64_t>(1e6 / options.qps);
+    for (string line; getline(in, line);) {
+        line = line.substr(0, line.find_first_of("#;"));
+        istringstream fields(line);
+        vector<string> tokens;
+        for (string token; fields >> token;) {
+            tokens.push_back(token);
+        }
+        if (tokens.empty()) {
+            continue;
+        }
+
+        size_t pos = 0;
+        int64_t time_us;
+        if (tokens.size() >= 2 && is_timestamp(tokens[0])) {
+            int64_t absolute = static_cast<int64_t>(stod(tokens[pos++]) * 1e6);
+            if (first_us < 0) {
+                first_us = absolute;
+            }
+            time_us = absolute - first_us;
+        } else {
+            time_us = untimed_us;
+            untimed_us += step_us;
+        }
+
+        string wire;
+        uint16_t qtype = 1;
+        uint32_t ttl = options.ttl;
+        bool ok = text_to_wire(tokens[pos++], wire);
+        if (ok && pos < tokens.size()) {
+            ok = text_to_rr_type(tokens[pos++], qtype);
+        }
+        if (ok && pos < tokens.size()) {
+            ok = tokens[pos].find_first_not_of("0123456789") == string::npos;
+            ttl = ok ? static_cast<uint32_t>(stoul(tokens[pos++])) : 0;
+        }
+        if (!ok || pos != tokens.size()) {
+            trace.skipped++;
+            continue;
+        }
+        trace.add(wire, hash_wire_name(wire), qtype, max<int64_t>(0, time_us), ttl);
+    }
+}
+
+// Classic pcap: 24-byte file header, then a 16-byte header per packet
+struct PcapFormat {
+    bool swapped = false;
+    bool nanoseconds = false;
+    uint32_t linktype = 0;
+};
+
+static uint32_t pcap_u32(const uint8_t* p, bool swapped) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t be16(const uint8_t* p) {
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+// UDP payload of a packet to port, or nullptr for anything else
+static const uint8_t* udp_payload(const uint8_t* packet, size_t len, uint32_t linktype, uint16_t port,
+                                  size_t& payload_len) {
+    size_t offset;
+    switch (linktype) {
+    case 1: {  // Ethernet, with any number of VLAN tags
+        offset = 14;
+        if (len < offset) {
+            return nullptr;
+        }
+        uint16_t ethertype = be16(packet + 12);
+        while ((ethertype == 0x8100 || ethertype == 0x88A8) && len >= offset + 4) {
+            ethertype = be16(packet + offset + 2);
+            offset += 4;
+        }
+        if (ethertype != 0x0800 && ethertype != 0x86DD) {
+            return nullptr;
+        }
+        break;
+    }
+    case 0:    // BSD loopback, address family in host order
+    case 108:  // OpenBSD loopback
+        offset = 4;
+        break;
+    case 12:
+    case 14:
+    case 101:  // raw IP
+        offset = 0;
+        break;
+    case 113:  // Linux cooked
+        offset = 16;
+        break;
+    case 276:  // Linux cooked v2
+        offset = 20;
+        break;
+    default:
+        return nullptr;
+    }
+    if (len <= offset) {
+        return nullptr;
+    }
+
+    const uint8_t* ip = packet + offset;
+    size_t ip_len = len - offset;
+    size_t header_len;
+    if ((ip[0] >> 4) == 4) {
+        header_len = (ip[0] & 0x0F) * 4u;
+        // Fragmented datagrams are skipped
+        if (ip_len < 20 || header_len < 20 || ip[9] != 17 || (be16(ip + 6) & 0x3FFF) != 0) {
+            return nullptr;
+        }
+    } else if ((ip[0] >> 4) == 6) {
+        header_len = 40;
+        if (ip_len < header_len || ip[6] != 17) {
+            return nullptr;  // extension headers are rare on DNS and not followed
+        }
+    } else {
+        return nullptr;
+    }
+    if (ip_len < header_len + 8) {
+        return nullptr;
+    }
+
+    const uint8_t* udp = ip + header_len;
+    if (be16(udp + 2) != port) {
+        return nullptr;
+    }
+    size_t udp_len = be16(udp + 4);
+    if (udp_len < 8) {
+        return nullptr;
+    }
+    payload_len = min(udp_len, ip_len - header_len) - 8;
+    return udp + 8;
+}
+
+static bool load_pcap(istream& in, const Options& options, Trace& trace, string& error) {
+    uint8_t header[24];
+    if (!in.read(reinterpret_cast<char*>(header), sizeof(header))) {
+        error = "truncated pcap header";
+        return false;
+    }
+    PcapFormat format;
+    uint32_t magic;
+    memcpy(&magic, header, 4);
+    switch (magic) {
+    case 0xA1B2C3D4: break;
+    case 0xA1B23C4D: format.nanoseconds = true; break;
+    case 0xD4C3B2A1: format.swapped = true; break;
+    case 0x4D3CB2A1: format.swapped = format.nanoseconds = true; break;
+    default:
+        error = "not a pcap file";
+        return false;
+    }
+    format.linktype = pcap_u32(header + 20, format.swapped) & 0x0FFFFFFF;
+
+    vector<uint8_t> packet;
+    int64_t first_us = -1;
+    QueryView query;
+    uint8_t record[16];
+    while (in.read(reinterpret_cast<char*>(record), sizeof(record))) {
+        uint32_t seconds = pcap_u32(record, format.swapped);
+        uint32_t fraction = pcap_u32(record + 4, format.swapped);
+        uint32_t captured = pcap_u32(record + 8, format.swapped);
+        if (captured > 262144) {
+            error = "corrupt pcap record";
+            return false;
+        }
+        packet.resize(captured);
+        if (!in.read(reinterpret_cast<char*>(packet.data()), captured)) {
+            break;  // capture cut off mid-packet
+        }
+
+        size_t payload_len = 0;
+        const uint8_t* payload = udp_payload(packet.data(), captured, format.linktype, options.port, payload_len);
+        if (!payload || !parse_query(payload, payload_len, query)) {
+            trace.skipped++;
+            continue;
+        }
+        int64_t time_us = int64_t(seconds) * 1000000 + (format.nanoseconds ? fraction / 1000 : fraction);
+        if (first_us < 0) {
+            first_us = time_us;
+        }
+        trace.add(query.key(), query.hash, query.qtype, max<int64_t>(0, time_us - first_us), options.ttl);
+    }
+    return true;
+}
+
+static bool load_trace(const string& path, const Options& options, Trace& trace, string& error) {
+    // The format is sniffed from the first bytes, so stdin is buffered
+    // whole to be read twice; files just seek back
+    ifstream file;
+    stringstream piped;
+    if (path == "-") {
+        piped << cin.rdbuf();
+    } else {
+        file.open(path, ios::binary);
+        if (!file) {
+            error = "cannot open " + path;
+            return false;
+        }
+    }
+    istream& in = path == "-" ? static_cast<istream&>(piped) : file;
+
+    uint32_t magic = 0;
+    in.read(reinterpret_cast<char*>(&magic), 4);
+    in.clear();
+    in.seekg(0);
+    if (magic == 0x0A0D0D0A) {
+        error = path + ": pcapng is not supported; convert with 'editcap -F pcap'";
+        return false;
+    }
+    if (magic == 0xA1B2C3D4 || magic == 0xA1B23C4D || magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1) {
+        if (!load_pcap(in, options, trace, error)) {
+            error = path + ": " + error;
+            return false;
+        }
+        return true;
+    }
+    load_text(in, options, trace);
+    return true;
+}
+
+struct SimConfig {
+    size_t capacity;
+    size_t shards;
+    bool admission;
+    bool lock_free_reads;
+    size_t threads;
+};
+
+struct SimResult {
+    FastDNSCache::Stats stats;
+    double seconds = 0;
+};
+
+// Synthetic single-A answer; only its size matters to the cache
+static CachedAnswer make_answer() {
+    CachedAnswer answer;
+    const uint8_t rr[16] = {0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0x01, 0x2C, 0, 4, 192, 0, 2, 1};
+    memcpy(answer.data, rr, sizeof(rr));
+    answer.len = sizeof(rr);
+    answer.ancount = 1;
+    return answer;
+}
+
+static SimResult simulate(const Trace& trace, const SimConfig& config) {
+    FastDNSCache cache(config.capacity, config.shards, config.lock_free_reads);
+    cache.set_admission(config.admission);
+    const CachedAnswer answer = make_answer();
+    // Far enough from the clock's epoch that no stored time is ever zero
+    const CacheClock::time_point base(chrono::hours(24));
+
+    // Replay threads take interleaved records, so their clocks stay within
+    // a few queries of each other; thread 0 also runs the maintenance
+    // thread's expiry sweep every 100ms of log time
+    auto replay = [&](size_t first) {
+        int64_t next_cleanup_us = 0;
+        for (size_t i = first; i < trace.records.size(); i += config.threads) {
+            const Record& record = trace.records[i];
+            CacheClock::set(base + chrono::microseconds(record.time_us));
+            if (first == 0 && record.time_us >= next_cleanup_us) {
+                cache.cleanup_expired(64);
+                next_cleanup_us = record.time_us + 100000;
+            }
+            const string& key = trace.keys[record.name];
+            CachedAnswer hit;
+            if (!cache.get(key, trace.hashes[record.name], record.qtype, hit) && record.ttl > 0) {
+                cache.set(key, trace.hashes[record.name], record.qtype, answer, record.ttl);
+            }
+        }
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> helpers;
+    for (size_t t = 1; t < config.threads; ++t) {
+        helpers.emplace_back(replay, t);
+    }
+    replay(0);
+    for (auto& helper : helpers) {
+        helper.join();
+    }
+    SimResult result;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.stats = cache.get_stats();
+    return result;
+}
+
+static bool parse_size(const string& text, size_t& value) {
+    if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) {
+        return false;
+    }
+    size_t end = 0;
+    value = stoul(text, &end);
+    string suffix = text.substr(end);
+    if (suffix == "k" || suffix == "K") {
+        value *= 1024;
+    } else if (suffix == "m" || suffix == "M") {
+        value *= 1024 * 1024;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_size_list(const string& text, vector<size_t>& values) {
+    values.clear();
+    stringstream items(text);
+    for (string item; getline(items, item, ',');) {
+        size_t value;
+        if (!parse_size(item, value)) {
+            return false;
+        }
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+// A list of either-or settings, each item named true_name or false_name
+static bool parse_choice_list(const string& text, const char* true_name, const char* false_name,
+                              vector<bool>& values) {
+    values.clear();
+    stringstream items(text);
+    for (string item; getline(items, item, ',');) {
+        if (item != true_name && item != false_name) {
+            return false;
+        }
+        values.push_back(item == true_name);
+    }
+    return !values.empty();
+}
+
+static void usage(const char* program) {
+    cerr << "Usage: " << program << " [options] querylog\n"
+         << "  --capacity list        cache entries, e.g. 8k,64k,1m (default " << FastDNSCache::DEFAULT_CAPACITY << ")\n"
+         << "  --shards list          shard counts, 0 scales with cores (default " << FastDNSCache::DEFAULT_SHARDS << ")\n"
+         << "  --admission list       tinylfu,clock (default tinylfu)\n"
+         << "  --reads list           seqlock,locked (default seqlock)\n"
+         << "  --replay-threads list  threads sharing each cache, for lock contention (default 1)\n"
+         << "  --ttl seconds          TTL for queries the log gives none (default 300)\n"
+         << "  --port n               DNS port to pick queries out of a pcap (default 53)\n"
+         << "  --qps n                spacing of untimed text lines (default 1000)\n"
+         << "  --jobs n               configurations simulated at once (default: one per core)\n"
+         << "Every combination of the lists is simulated. The log is a classic pcap\n"
+         << "or text lines of '[unix-time] name [type] [ttl]'; '-' reads stdin." << endl;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    string input;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool ok = true;
+        if (arg == "--capacity" && i + 1 < argc) {
+            ok = parse_size_list(argv[++i], options.capacities);
+        } else if (arg == "--shards" && i + 1 < argc) {
+            ok = parse_size_list(argv[++i], options.shards);
+        } else if (arg == "--reads" && i + 1 < argc) {
+            ok = parse_choice_list(argv[++i], "seqlock", "locked", options.lock_free_reads);
+        } else if (arg == "--admission" && i + 1 < argc) {
+            ok = parse_choice_list(argv[++i], "tinylfu", "clock", options.admission);
+        } else if (arg == "--replay-threads" && i + 1 < argc) {
+            ok = parse_size_list(argv[++i], options.replay_threads);
+        } else if (arg == "--ttl" && i + 1 < argc) {
+            options.ttl = static_cast<uint32_t>(stoul(argv[++i]));
+        } else if (arg == "--port" && i + 1 < argc) {
+            options.port = static_cast<uint16_t>(stoul(argv[++i]));
+        } else if (arg == "--qps" && i + 1 < argc) {
+            options.qps = max(1.0, stod(argv[++i]));
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            options.jobs = stoul(argv[++i]);
+        } else if (input.empty() && (arg == "-" || arg[0] != '-')) {
+            input = arg;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (input.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    auto load_start = chrono::steady_clock::now();
+    Trace trace;
+    string error;
+    if (!load_trace(input, options, trace, error)) {
+        cerr << error << endl;
+        return 1;
+    }
+    if (trace.records.empty()) {
+        cerr << input << ": no queries found (" << trace.skipped << " packets or lines skipped)" << endl;
+        return 1;
+    }
+    double span = trace.records.back().time_us / 1e6;
+    cout << "Loaded " << trace.records.size() << " queries for " << trace.keys.size() << " names spanning "
+         << fixed << setprecision(1) << span << "s in "
+         << chrono::duration<double>(chrono::steady_clock::now() - load_start).count() << "s";
+    if (trace.skipped) {
+        cout << " (" << trace.skipped << " skipped)";
+    }
+    cout << endl;
+
+    vector<SimConfig> configs;
+    for (size_t capacity : options.capacities) {
+        for (size_t shards : options.shards) {
+            for (bool admission : options.admission) {
+                for (bool lock_free : options.lock_free_reads) {
+                    for (size_t threads : options.replay_threads) {
+                        configs.push_back({capacity, shards, admission, lock_free, max<size_t>(1, threads)});
+                    }
+                }
+            }
+        }
+    }
+
+    // Jobs pull configurations off a shared index; results keep input order
+    size_t jobs = options.jobs ? options.jobs : max<unsigned>(1, thread::hardware_concurrency());
+    jobs = min(jobs, configs.size());
+    vector<SimResult> results(configs.size());
+    atomic<size_t> next{0};
+    vector<thread> workers;
+    for (size_t j = 0; j < jobs; ++j) {
+        workers.emplace_back([&] {
+            for (size_t i; (i = next.fetch_add(1)) < configs.size();) {
+                results[i] = simulate(trace, configs[i]);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    cout << "\n" << right << setw(10) << "capacity" << setw(8) << "shards" << setw(9) << "policy" << setw(9)
+         << "reads" << setw(9) << "threads" << setw(10) << "hit %" << setw(12) << "misses" << setw(12)
+         << "evictions" << setw(12) << "rejections" << setw(12) << "lock waits" << setw(10) << "entries"
+         << setw(11) << "Mq/s" << endl;
+    for (size_t i = 0; i < configs.size(); ++i) {
+        const SimConfig& config = configs[i];
+        const FastDNSCache::Stats& stats = results[i].stats;
+        cout << setw(10) << stats.capacity << setw(8) << stats.shards << setw(9)
+             << (config.admission ? "tinylfu" : "clock") << setw(9) << (config.lock_free_reads ? "seqlock" : "locked")
+             << setw(9) << config.threads << setw(10) << setprecision(2) << stats.hit_ratio() * 100 << setw(12)
+             << stats.misses << setw(12) << stats.evictions << setw(12) << stats.rejections << setw(12)
+             << stats.lock_waits << setw(10) << stats.size << setw(11) << setprecision(1)
+             << trace.records.size() / results[i].seconds / 1e6 << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include "cpu_topology.h"
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <thread>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+// Parses a sysfs CPU list such as "0-3,8-11"
+static vector<int> read_cpu_list(const string& path) {
+    vector<int> cpus;
+    ifstream in(path);
+    string text;
+    if (!getline(in, text)) {
+        return cpus;
+    }
+    const char* p = text.c_str();
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return cpus;
+}
+
+CpuTopology CpuTopology::detect() {
+    CpuTopology topology;
+
+    // Sysfs node ids may have gaps; map them in ascending order
+    map<int, vector<int>> node_cpus;
+    if (DIR* dir = opendir("/sys/devices/system/node")) {
+        while (dirent* entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "node", 4) != 0 || !isdigit(static_cast<unsigned char>(entry->d_name[4]))) {
+                continue;
+            }
+            vector<int> cpus = read_cpu_list(string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+            if (!cpus.empty()) {
+                node_cpus[atoi(entry->d_name + 4)] = move(cpus);
+            }
+        }
+        closedir(dir);
+    }
+
+    vector<int> present = read_cpu_list("/sys/devices/system/cpu/present");
+    int max_cpu = present.empty() ? static_cast<int>(thread::hardware_concurrency()) - 1 : present.back();
+    for (const auto& node : node_cpus) {
+        max_cpu = max(max_cpu, node.second.back());
+    }
+    topology.node_of_cpu.assign(static_cast<size_t>(max(max_cpu, 0)) + 1, -1);
+
+    int dense = 0;
+    for (const auto& node : node_cpus) {
+        for (int cpu : node.second) {
+            topology.node_of_cpu[cpu] = dense;
+        }
+        dense++;
+    }
+    topology.node_count = max(dense, 1);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                topology.usable.push_back(cpu);
+            }
+        }
+    }
+    if (topology.usable.empty()) {
+        for (int cpu = 0; cpu <= max_cpu; ++cpu) {
+            topology.usable.push_back(cpu);
+        }
+    }
+    if (topology.usable.back() > topology.max_cpu()) {
+        topology.node_of_cpu.resize(topology.usable.back() + 1, -1);
+    }
+    return topology;
+}
+
+size_t CpuTopology::node_of(int cpu) const {
+    if (cpu < 0 || cpu > max_cpu() || node_of_cpu[cpu] < 0) {
+        return 0;
+    }
+    return static_cast<size_t>(node_of_cpu[cpu]);
+}
+
+vector<int> CpuTopology::spread(size_t count) const {
+    vector<int> ordered = usable;
+    stable_sort(ordered.begin(), ordered.end(), [this](int a, int b) { return node_of(a) < node_of(b); });
+
+    vector<int> cpus;
+    cpus.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        cpus.push_back(count <= ordered.size() ? ordered[i * ordered.size() / count] : ordered[i % ordered.size()]);
+    }
+    return cpus;
+}
+
+string CpuTopology::describe() const {
+    return to_string(node_count) + (node_count == 1 ? " NUMA node, " : " NUMA nodes, ") + to_string(usable.size()) +
+           " CPUs";
+}
+
+bool pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
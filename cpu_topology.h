@@ -0,0 +1,44 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// CPUs and NUMA nodes as the kernel reports them under
+// /sys/devices/system/node, plus the CPUs this process may run on. Nodes
+// are renumbered densely from 0 over those that have CPUs. Without sysfs
+// (or on a kernel built without NUMA) every CPU is on node 0.
+class CpuTopology {
+public:
+    static CpuTopology detect();
+
+    size_t nodes() const { return node_count; }
+    // Usable CPUs (sched_getaffinity), ascending
+    const vector<int>& usable_cpus() const { return usable; }
+    // Highest CPU id seen, usable or not; RX interrupts may land on any
+    int max_cpu() const { return static_cast<int>(node_of_cpu.size()) - 1; }
+    // Node of a CPU, 0 if unknown
+    size_t node_of(int cpu) const;
+
+    // count CPUs to pin workers to, spread evenly across the usable CPUs in
+    // node order so each node gets workers in proportion to its cores; CPUs
+    // repeat only when count exceeds them
+    vector<int> spread(size_t count) const;
+
+    // e.g. "2 NUMA nodes, 64 CPUs"
+    string describe() const;
+
+private:
+    vector<int> usable;
+    vector<int> node_of_cpu;     // by CPU id; -1 where no node lists it
+    size_t node_count = 1;
+};
+
+// Restricts the calling thread to one CPU; false if the kernel refused
+bool pin_current_thread(int cpu);
+
+#endif // CPU_TOPOLOGY_H
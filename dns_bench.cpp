@@ -0,0 +1,438 @@
+#include "dns_wire.h"
+#include "latency_histogram.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// UDP load generator for the server: each thread replays a mix of local,
+// cached and uncached questions over its own connected socket, either at a
+// fixed rate (open loop, so a slow server shows up as latency rather than
+// as fewer queries) or as fast as a window of in-flight queries allows.
+// Latency is measured per path from send to matching reply.
+//
+//   local     test1.local .. test10.local, answered from the built-in table
+//   cached    a fixed pool of names, each looked up once before timing
+//   uncached  a name never asked before, so the server goes upstream
+
+enum Path { LOCAL, CACHED, UNCACHED, NUM_PATHS };
+static const char* const PATH_NAMES[NUM_PATHS] = {"local", "cached", "uncached"};
+
+struct Options {
+    sockaddr_in server{};
+    size_t threads = 2;
+    double rate = 0;              // queries per second over all threads; 0 = closed loop
+    size_t window = 64;           // in-flight queries per thread in closed loop
+    double duration_s = 10;
+    unsigned mix[NUM_PATHS] = {40, 50, 10};
+    size_t cached_names = 1000;
+    unsigned timeout_ms = 2000;   // a reply later than this counts as lost
+};
+
+struct PathStats {
+    uint64_t sent = 0;
+    uint64_t answered = 0;
+    uint64_t lost = 0;
+    uint64_t errors = 0;          // replies with a non-zero RCODE
+    LatencyHistogram latency;
+
+    void merge(const PathStats& other) {
+        sent += other.sent;
+        answered += other.answered;
+        lost += other.lost;
+        errors += other.errors;
+        latency.merge(other.latency);
+    }
+};
+
+static bool build_query(const string& name, uint16_t id, vector<uint8_t>& packet) {
+    string wire;
+    if (!text_to_wire(name, wire)) {
+        return false;
+    }
+    const uint8_t header[12] = {uint8_t(id >> 8), uint8_t(id), 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0};
+    packet.assign(header, header + 12);
+    packet.insert(packet.end(), wire.begin(), wire.end());
+    const uint8_t question[4] = {0, 1, 0, 1};  // A, IN
+    packet.insert(packet.end(), question, question + 4);
+    return true;
+}
+
+static string cached_name(size_t index) {
+    return "bench" + to_string(index) + ".example.com";
+}
+
+static int open_socket(const sockaddr_in& server) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int buffer = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&server), sizeof(server)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Looks up every cached-pool name once, retrying the ones that go
+// unanswered, so the timed run finds them in the server's cache
+static size_t warm_cache(const Options& options) {
+    int fd = open_socket(options.server);
+    if (fd < 0) {
+        return 0;
+    }
+    vector<bool> answered(options.cached_names, false);
+    size_t remaining = options.cached_names;
+    vector<uint8_t> packet;
+    uint8_t reply[4096];
+    for (int round = 0; round < 3 && remaining > 0; ++round) {
+        for (size_t i = 0; i < options.cached_names; ++i) {
+            if (!answered[i] && build_query(cached_name(i), static_cast<uint16_t>(i), packet)) {
+                send(fd, packet.data(), packet.size(), 0);
+                if (i % 64 == 63) {
+                    this_thread::sleep_for(chrono::microseconds(500));  // stay inside socket buffers
+                }
+            }
+        }
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(options.timeout_ms);
+        while (remaining > 0 && chrono::steady_clock::now() < deadline) {
+            pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 50) <= 0) {
+                continue;
+            }
+            ssize_t n;
+            while ((n = recv(fd, reply, sizeof(reply), 0)) >= 12) {
+                size_t index = (size_t(reply[0]) << 8) | reply[1];
+                if (index < answered.size() && !answered[index]) {
+                    answered[index] = true;
+                    remaining--;
+                }
+            }
+        }
+    }
+    close(fd);
+    return options.cached_names - remaining;
+}
+
+class LoadThread {
+public:
+    LoadThread(const Options& opts, size_t thread_index)
+        : options(opts), index(thread_index), rng(0x9E3779B97F4A7C15ull * (thread_index + 1)) {}
+
+    bool run(chrono::steady_clock::time_point start, chrono::steady_clock::time_point stop) {
+        int fd = open_socket(options.server);
+        if (fd < 0) {
+            return false;
+        }
+        double interval_ns = options.rate > 0 ? 1e9 * options.threads / options.rate : 0;
+        uint64_t scheduled = 0;
+
+        while (true) {
+            auto now = chrono::steady_clock::now();
+            expire(now);
+            bool sending = now < stop;
+            if (!sending && in_flight == 0) {
+                break;
+            }
+            if (!sending && now > stop + chrono::milliseconds(options.timeout_ms)) {
+                break;
+            }
+
+            int wait_ms = 1;
+            if (sending) {
+                if (interval_ns > 0) {
+                    // Send everything that is due, including any backlog from a
+                    // stall on this side, so the offered rate stays fixed
+                    auto due = start + chrono::nanoseconds(static_cast<int64_t>(scheduled * interval_ns));
+                    while (due <= now && in_flight < MAX_IN_FLIGHT) {
+                        scheduled++;
+                        if (!send_query(fd, now)) {
+                            break;
+                        }
+                        due = start + chrono::nanoseconds(static_cast<int64_t>(scheduled * interval_ns));
+                    }
+                    auto until_due = chrono::duration_cast<chrono::milliseconds>(due - now).count();
+                    wait_ms = static_cast<int>(min<int64_t>(max<int64_t>(until_due, 0), 1));
+                } else {
+                    while (in_flight < options.window && send_query(fd, now)) {
+                    }
+                }
+            }
+
+            pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, wait_ms) > 0) {
+                receive(fd);
+            }
+        }
+
+        lost_remaining();
+        close(fd);
+        return true;
+    }
+
+    const PathStats& path_stats(size_t path) const { return stats[path]; }
+
+private:
+    static constexpr size_t MAX_IN_FLIGHT = 65536;
+
+    struct Pending {
+        chrono::steady_clock::time_point sent_at;
+        uint8_t path = 0;
+        bool active = false;
+    };
+
+    const Options& options;
+    size_t index;
+    uint64_t rng;
+    uint16_t next_id = 0;
+    uint64_t uncached_sequence = 0;
+    size_t in_flight = 0;
+    vector<Pending> pending = vector<Pending>(MAX_IN_FLIGHT);
+    deque<pair<uint16_t, chrono::steady_clock::time_point>> send_order;
+    PathStats stats[NUM_PATHS];
+    vector<uint8_t> packet;
+
+    uint64_t next_random() {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return rng;
+    }
+
+    Path pick_path() {
+        unsigned total = options.mix[LOCAL] + options.mix[CACHED] + options.mix[UNCACHED];
+        unsigned roll = static_cast<unsigned>(next_random() % total);
+        if (roll < options.mix[LOCAL]) {
+            return LOCAL;
+        }
+        return roll < options.mix[LOCAL] + options.mix[CACHED] ? CACHED : UNCACHED;
+    }
+
+    string pick_name(Path path) {
+        switch (path) {
+        case LOCAL:
+            return "test" + to_string(next_random() % 10 + 1) + ".local";
+        case CACHED:
+            return cached_name(next_random() % options.cached_names);
+        default:
+            return "u" + to_string(index) + "-" + to_string(uncached_sequence++) + "-" +
+                   to_string(next_random() % 1000000) + ".bench.example.com";
+        }
+    }
+
+    // False when the socket would not take the query; it counts as lost
+    bool send_query(int fd, chrono::steady_clock::time_point now) {
+        uint16_t id = next_id++;
+        Pending& slot = pending[id];
+        if (slot.active) {
+            // The ID space wrapped onto a query still waiting: give it up
+            stats[slot.path].lost++;
+            slot.active = false;
+            in_flight--;
+        }
+        Path path = pick_path();
+        if (!build_query(pick_name(path), id, packet)) {
+            return false;
+        }
+        stats[path].sent++;
+        if (send(fd, packet.data(), packet.size(), 0) < 0) {
+            stats[path].lost++;
+            return false;
+        }
+        slot = {now, static_cast<uint8_t>(path), true};
+        in_flight++;
+        send_order.emplace_back(id, now);
+        return true;
+    }
+
+    void receive(int fd) {
+        uint8_t reply[4096];
+        ssize_t n;
+        while ((n = recv(fd, reply, sizeof(reply), 0)) >= 0) {
+            auto now = chrono::steady_clock::now();
+            if (n < 12) {
+                continue;
+            }
+            uint16_t id = static_cast<uint16_t>((reply[0] << 8) | reply[1]);
+            Pending& slot = pending[id];
+            if (!slot.active) {
+                continue;  // late reply to a query already counted lost
+            }
+            slot.active = false;
+            in_flight--;
+            PathStats& path = stats[slot.path];
+            path.answered++;
+            if (reply[3] & 0x0F) {
+                path.errors++;
+            }
+            auto elapsed = chrono::duration_cast<chrono::nanoseconds>(now - slot.sent_at).count();
+            path.latency.counts[LatencyHistogram::bucket_of(static_cast<uint64_t>(elapsed))]++;
+            path.latency.total++;
+            path.latency.sum_ns += static_cast<uint64_t>(elapsed);
+        }
+    }
+
+    void expire(chrono::steady_clock::time_point now) {
+        auto timeout = chrono::milliseconds(options.timeout_ms);
+        while (!send_order.empty() && now - send_order.front().second > timeout) {
+            auto [id, sent_at] = send_order.front();
+            send_order.pop_front();
+            Pending& slot = pending[id];
+            if (slot.active && slot.sent_at == sent_at) {
+                stats[slot.path].lost++;
+                slot.active = false;
+                in_flight--;
+            }
+        }
+    }
+
+    void lost_remaining() {
+        for (Pending& slot : pending) {
+            if (slot.active) {
+                stats[slot.path].lost++;
+                slot.active = false;
+            }
+        }
+        in_flight = 0;
+    }
+};
+
+static bool parse_server(const string& spec, sockaddr_in& addr) {
+    string host = spec;
+    uint16_t port = 5353;
+    auto colon = spec.rfind(':');
+    if (colon != string::npos) {
+        host = spec.substr(0, colon);
+        port = static_cast<uint16_t>(stoi(spec.substr(colon + 1)));
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    return inet_pton(AF_INET, host.c_str(), &addr.sin_addr) == 1;
+}
+
+static bool parse_mix(const string& spec, unsigned mix[NUM_PATHS]) {
+    size_t first = spec.find(':');
+    size_t second = first == string::npos ? string::npos : spec.find(':', first + 1);
+    if (second == string::npos) {
+        return false;
+    }
+    mix[LOCAL] = static_cast<unsigned>(stoul(spec.substr(0, first)));
+    mix[CACHED] = static_cast<unsigned>(stoul(spec.substr(first + 1, second - first - 1)));
+    mix[UNCACHED] = static_cast<unsigned>(stoul(spec.substr(second + 1)));
+    return mix[LOCAL] + mix[CACHED] + mix[UNCACHED] > 0;
+}
+
+static void print_path(const char* name, const PathStats& path, double seconds) {
+    auto us = [&](double q) { return path.latency.percentile_ns(q) / 1000.0; };
+    cout << left << setw(10) << name << right << setw(10) << path.sent << setw(10) << path.answered
+         << setw(8) << path.lost << setw(8) << path.errors << setw(11) << fixed << setprecision(0)
+         << path.answered / seconds << setprecision(1) << setw(10) << us(0.50) << setw(10) << us(0.99)
+         << setw(10) << us(0.999) << setw(10) << path.latency.max_ns() / 1000.0 << endl;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    parse_server("127.0.0.1:5353", options.server);
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--server" && i + 1 < argc) {
+            if (!parse_server(argv[++i], options.server)) {
+                cerr << "Invalid server address " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = max<size_t>(1, stoul(argv[++i]));
+        } else if (arg == "--rate" && i + 1 < argc) {
+            options.rate = stod(argv[++i]);
+        } else if (arg == "--window" && i + 1 < argc) {
+            options.window = max<size_t>(1, stoul(argv[++i]));
+        } else if (arg == "--duration" && i + 1 < argc) {
+            options.duration_s = stod(argv[++i]);
+        } else if (arg == "--mix" && i + 1 < argc) {
+            if (!parse_mix(argv[++i], options.mix)) {
+                cerr << "Invalid mix " << argv[i] << ", expected local:cached:uncached" << endl;
+                return 1;
+            }
+        } else if (arg == "--cached-names" && i + 1 < argc) {
+            options.cached_names = max<size_t>(1, min<size_t>(65536, stoul(argv[++i])));
+        } else if (arg == "--timeout-ms" && i + 1 < argc) {
+            options.timeout_ms = static_cast<unsigned>(stoul(argv[++i]));
+        } else {
+            cerr << "Usage: " << argv[0] << " [--server ip:port] [--threads n] [--rate qps | --window n]\n"
+                 << "       [--duration s] [--mix local:cached:uncached] [--cached-names n] [--timeout-ms ms]"
+                 << endl;
+            return 1;
+        }
+    }
+
+    if (options.mix[CACHED] > 0) {
+        size_t warmed = warm_cache(options);
+        cout << "Warmed " << warmed << " / " << options.cached_names << " cached names" << endl;
+    }
+
+    cout << "Running " << options.duration_s << "s with " << options.threads << " threads, "
+         << (options.rate > 0 ? to_string(static_cast<uint64_t>(options.rate)) + " qps offered"
+                              : "closed loop, window " + to_string(options.window))
+         << ", mix " << options.mix[LOCAL] << ":" << options.mix[CACHED] << ":" << options.mix[UNCACHED] << endl;
+
+    vector<unique_ptr<LoadThread>> loaders;
+    for (size_t i = 0; i < options.threads; ++i) {
+        loaders.push_back(make_unique<LoadThread>(options, i));
+    }
+    atomic<size_t> failed{0};
+    auto start = chrono::steady_clock::now() + chrono::milliseconds(10);
+    auto stop = start + chrono::nanoseconds(static_cast<int64_t>(options.duration_s * 1e9));
+    vector<thread> threads;
+    for (auto& loader : loaders) {
+        threads.emplace_back([&, raw = loader.get()] {
+            this_thread::sleep_until(start);
+            if (!raw->run(start, stop)) {
+                failed++;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    if (failed) {
+        cerr << failed << " threads could not open a socket" << endl;
+        return 1;
+    }
+
+    PathStats totals[NUM_PATHS];
+    PathStats overall;
+    for (const auto& loader : loaders) {
+        for (size_t path = 0; path < NUM_PATHS; ++path) {
+            totals[path].merge(loader->path_stats(path));
+        }
+    }
+    for (const PathStats& path : totals) {
+        overall.merge(path);
+    }
+
+    cout << "\n" << left << setw(10) << "path" << right << setw(10) << "sent" << setw(10) << "answered"
+         << setw(8) << "lost" << setw(8) << "errors" << setw(11) << "qps" << setw(10) << "p50 us"
+         << setw(10) << "p99 us" << setw(10) << "p99.9 us" << setw(10) << "max us" << endl;
+    for (size_t path = 0; path < NUM_PATHS; ++path) {
+        if (totals[path].sent > 0) {
+            print_path(PATH_NAMES[path], totals[path], options.duration_s);
+        }
+    }
+    print_path("all", overall, options.duration_s);
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include "dns_server.h"
+#include <benchmark/benchmark.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// Hot-path microbenchmarks, built by build.sh when Google Benchmark is
+// installed. The *Threads variants share one cache across benchmark
+// threads, so their per-thread time shows contention on the shards.
+
+static constexpr size_t NAMES = 4096;
+
+static vector<uint8_t> make_query(const string& name, uint16_t qtype = 1) {
+    string wire;
+    text_to_wire(name, wire);
+    const uint8_t header[12] = {0x12, 0x34, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0};
+    const uint8_t question[4] = {uint8_t(qtype >> 8), uint8_t(qtype), 0, 1};
+    vector<uint8_t> packet(12 + wire.size() + 4);
+    memcpy(packet.data(), header, 12);
+    memcpy(packet.data() + 12, wire.data(), wire.size());
+    memcpy(packet.data() + 12 + wire.size(), question, 4);
+    return packet;
+}
+
+// One A record pointing back at the question name, as extract_answer stores it
+static CachedAnswer make_answer(uint32_t ip) {
+    CachedAnswer answer;
+    const uint8_t rr[16] = {0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0x0E, 0x10, 0, 4,
+                            uint8_t(ip >> 24), uint8_t(ip >> 16), uint8_t(ip >> 8), uint8_t(ip)};
+    memcpy(answer.data, rr, sizeof(rr));
+    answer.len = sizeof(rr);
+    answer.ancount = 1;
+    return answer;
+}
+
+struct NameSet {
+    vector<string> keys;
+    vector<uint64_t> hashes;
+
+    explicit NameSet(const string& prefix) {
+        for (size_t i = 0; i < NAMES; ++i) {
+            string wire;
+            text_to_wire(prefix + to_string(i) + ".example.com", wire);
+            hashes.push_back(hash_wire_name(wire));
+            keys.push_back(move(wire));
+        }
+    }
+};
+
+static const NameSet& cached_names() {
+    static NameSet names("host");
+    return names;
+}
+
+static FastDNSCache& shared_cache() {
+    static FastDNSCache cache(NAMES * 4, 0);
+    static bool filled = [] {
+        const NameSet& names = cached_names();
+        for (size_t i = 0; i < NAMES; ++i) {
+            cache.set(names.keys[i], names.hashes[i], 1, make_answer(static_cast<uint32_t>(i)), 3600);
+        }
+        return true;
+    }();
+    (void)filled;
+    return cache;
+}
+
+static void BM_CacheGetHit(benchmark::State& state) {
+    FastDNSCache& cache = shared_cache();
+    const NameSet& names = cached_names();
+    CachedAnswer answer;
+    size_t i = static_cast<size_t>(state.thread_index()) * 997;
+    for (auto _ : state) {
+        size_t n = i++ % NAMES;
+        benchmark::DoNotOptimize(cache.get(names.keys[n], names.hashes[n], 1, answer));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheGetHit);
+BENCHMARK(BM_CacheGetHit)->Name("BM_CacheGetHitThreads")->ThreadRange(2, 8)->UseRealTime();
+
+static void BM_CacheGetMiss(benchmark::State& state) {
+    FastDNSCache& cache = shared_cache();
+    static NameSet absent("absent");
+    CachedAnswer answer;
+    size_t i = 0;
+    for (auto _ : state) {
+        size_t n = i++ % NAMES;
+        benchmark::DoNotOptimize(cache.get(absent.keys[n], absent.hashes[n], 1, answer));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheGetMiss);
+
+static void BM_CacheSet(benchmark::State& state) {
+    // Capacity below the name count, so steady state includes evictions
+    FastDNSCache cache(NAMES / 2, 0);
+    static NameSet churn("churn");
+    CachedAnswer answer = make_answer(0x0A000001);
+    size_t i = 0;
+    for (auto _ : state) {
+        size_t n = i++ % NAMES;
+        cache.set(churn.keys[n], churn.hashes[n], 1, answer, 300);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheSet);
+
+static void BM_ParseQuery(benchmark::State& state) {
+    vector<uint8_t> packet = make_query(state.range(0) ? "WWW.Some-Longer-Name.Example.COM" : "test1.local");
+    QueryView query;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parse_query(packet.data(), packet.size(), query));
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ParseQuery)->Arg(0)->Arg(1);
+
+static void BM_HashWireName(benchmark::State& state) {
+    const NameSet& names = cached_names();
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(hash_wire_name(names.keys[i++ % NAMES]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HashWireName);
+
+static void BM_BuildCachedResponse(benchmark::State& state) {
+    vector<uint8_t> packet = make_query("host1.example.com");
+    QueryView query;
+    parse_query(packet.data(), packet.size(), query);
+    CachedAnswer answer = make_answer(0x0A000001);
+    answer.age = 42;
+    uint8_t out[ResponseBatch::MAX_RESPONSE];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            DNSServer::build_cached_response(query.id, query.question(), query.question_len(), answer, out));
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BuildCachedResponse);
+
+static void BM_LocalLookup(benchmark::State& state) {
+    PrecompiledResponses local;
+    for (int i = 1; i <= 1000; ++i) {
+        local.add_local_domain("test" + to_string(i) + ".local", "192.168.1.1");
+    }
+    local.freeze();
+    vector<QueryView> queries(16);
+    vector<vector<uint8_t>> packets;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        packets.push_back(make_query("test" + to_string(i * 61 + 1) + ".local"));
+        parse_query(packets[i].data(), packets[i].size(), queries[i]);
+    }
+    size_t len = 0;
+    bool catch_all = false;
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(local.get_response(queries[i++ % queries.size()], len, catch_all));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LocalLookup);
+
+static void BM_LatencyRecord(benchmark::State& state) {
+    static LatencyRecorder recorder(1);
+    int64_t ns = 1000;
+    for (auto _ : state) {
+        recorder.record(0, chrono::nanoseconds(ns));
+        ns = (ns * 7 + 13) & 0xFFFFF;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LatencyRecord);
+
+BENCHMARK_MAIN();
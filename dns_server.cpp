@@ -1,148 +1,813 @@
 #include "dns_server.h"
+#include "uring_engine.h"
+#include "upstream_forwarder.h"
+#include "metrics_server.h"
+#include "tcp_server.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
 #include <chrono>
+#include <random>
 
 using namespace std;
 
-bool FastDNSCache::get(const string& domain, string& ip) {
-    auto& shard = shards[get_shard_index(domain)];
-    lock_guard<mutex> lock(shard.mtx);
+static size_t round_up_pow2(size_t v) {
+    size_t p = 1;
+    while (p < v) p <<= 1;
+    return p;
+}
+
+atomic<uint64_t> FastDNSCache::next_instance_id{1};
+
+FastDNSCache::FastDNSCache(size_t capacity, size_t shard_count, bool lock_free)
+    : lock_free_reads(lock_free), instance_id(next_instance_id.fetch_add(1)) {
+    if (shard_count == 0) {
+        // Enough shards that workers rarely meet on the same lock
+        shard_count = max<size_t>(DEFAULT_SHARDS, 4 * thread::hardware_concurrency());
+    }
+    num_shards = round_up_pow2(shard_count);
+    shard_mask = num_shards - 1;
+    shard_bits = 0;
+    while ((size_t(1) << shard_bits) < num_shards) shard_bits++;
+    
+    size_t sets_per_shard = round_up_pow2(max<size_t>(1, (capacity + num_shards * WAYS - 1) / (num_shards * WAYS)));
+    set_mask = sets_per_shard - 1;
+    
+    random_device rd;
+    uint64_t seed = (uint64_t(rd()) << 32) | rd();
+    shards.reset(new Shard[num_shards]);
+    for (size_t i = 0; i < num_shards; ++i) {
+        shards[i].init(sets_per_shard, seed + i);
+    }
+    set_admission(true);
+}
+
+void FastDNSCache::set_admission(bool enabled) {
+    admission = enabled;
+    for (size_t i = 0; i < num_shards; ++i) {
+        shards[i].admission = enabled;
+    }
+}
+
+size_t FastDNSCache::capacity_for_memory(size_t memory_bytes) {
+    size_t entries = memory_bytes / BYTES_PER_ENTRY;
+    size_t capacity = WAYS;
+    while (capacity * 2 <= entries) capacity <<= 1;
+    return capacity;
+}
+
+atomic<uint64_t>* FastDNSCache::local_hit_counters() const {
+    // A thread normally talks to one cache; keep a few in case it alternates
+    struct Binding {
+        uint64_t instance = 0;
+        atomic<uint64_t>* counters = nullptr;
+    };
+    thread_local array<Binding, 4> bindings;
+    thread_local size_t next_binding = 0;
+    
+    for (const auto& binding : bindings) {
+        if (binding.instance == instance_id) {
+            return binding.counters;
+        }
+    }
+    
+    auto* counters = new atomic<uint64_t>[num_shards]();
+    {
+        lock_guard<mutex> lock(thread_hits_mutex);
+        thread_hits.emplace_back(counters);
+    }
+    bindings[next_binding++ % bindings.size()] = {instance_id, counters};
+    return counters;
+}
+
+bool FastDNSCache::get(string_view key, uint64_t name_hash, uint16_t qtype, CachedAnswer& answer) {
+    uint64_t h = question_hash(name_hash, qtype);
+    size_t shard_idx = shard_index(h);
+    auto& shard = shards[shard_idx];
+    size_t set = set_index(h);
+    uint32_t tag = tag_of(h);
+    
+    answer.refresh = false;
+    if (!lock_free_reads) {
+        return get_locked(shard, set, tag, key, qtype, answer);
+    }
     
-    shard.cleanup_expired();
+    if (key.size() <= CacheEntry::PAYLOAD_SIZE) {
+        chrono::steady_clock::time_point stored, expiry;
+        if (CacheEntry* entry = read_entry(shard, set, tag, key, qtype, answer, stored, expiry)) {
+            // Expired slots are left for the next writer or cleanup_expired
+            if (!serve_hit(*entry, CacheClock::now(), stored, expiry, answer)) {
+                shard.record_miss(set, tag);
+                return false;
+            }
+            atomic<uint64_t>& counter = local_hit_counters()[shard_idx];
+            counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            return true;
+        }
+    }
     
-    auto it = shard.entries.find(domain);
-    if (it != shard.entries.end() && it->second.is_valid()) {
-        ip = it->second.ip;
-        it->second.hits.fetch_add(1, memory_order_relaxed);
-        shard.hits.fetch_add(1, memory_order_relaxed);
+    shard.record_miss(set, tag);
+    return false;
+}
+
+CacheEntry* FastDNSCache::read_entry(Shard& shard, size_t set, uint32_t tag, string_view key, uint16_t qtype,
+                                     CachedAnswer& answer, chrono::steady_clock::time_point& stored,
+                                     chrono::steady_clock::time_point& expiry) {
+    CacheEntry* base = &shard.slots[set * WAYS];
+    for (size_t way = 0; way < WAYS; ++way) {
+        CacheEntry& entry = base[way];
         
-        shard.touch_lru(domain);
+        // Seqlock read: copy what we need, then confirm no writer touched
+        // the slot meanwhile. A torn copy is simply retried.
+        for (int attempt = 0; attempt < 16; ++attempt) {
+            uint32_t seq = entry.seq.load(memory_order_acquire);
+            if (seq & 1) {
+                continue;
+            }
+            
+            bool match = entry.matches(tag, key, qtype);
+            if (match) {
+                entry.copy_answer(answer);
+                expiry = entry.expiry;
+                stored = entry.stored;
+            }
+            
+            atomic_thread_fence(memory_order_acquire);
+            if (entry.seq.load(memory_order_relaxed) != seq) {
+                continue;
+            }
+            if (!match) {
+                break;
+            }
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool FastDNSCache::get_locked(Shard& shard, size_t set, uint32_t tag, string_view key, uint16_t qtype,
+                              CachedAnswer& answer) {
+    auto lock = shard.lock();
+    
+    CacheEntry* entry = shard.find(set, tag, key, qtype);
+    auto now = CacheClock::now();
+    if (entry && serve_hit(*entry, now, entry->stored, entry->expiry, answer)) {
+        entry->copy_answer(answer);
+        shard.hits.fetch_add(1, memory_order_relaxed);
         return true;
     }
     
-    if (it != shard.entries.end()) {
-        auto lru_it = shard.lru_map.find(it->first);
-        if (lru_it != shard.lru_map.end()) {
-            shard.lru_list.erase(lru_it->second);
-            shard.lru_map.erase(lru_it);
-        }
-        shard.entries.erase(it);
+    // Expired entries are dropped lazily here; the rest by cleanup_expired
+    if (entry) {
+        shard.remove(*entry);
     }
     
-    shard.misses.fetch_add(1, memory_order_relaxed);
+    shard.record_miss(set, tag);
     return false;
 }
 
-void FastDNSCache::set(const string& domain, const string& ip, uint32_t ttl) {
-    auto& shard = shards[get_shard_index(domain)];
-    lock_guard<mutex> lock(shard.mtx);
+bool FastDNSCache::serve_hit(CacheEntry& entry, chrono::steady_clock::time_point now,
+                             chrono::steady_clock::time_point stored, chrono::steady_clock::time_point expiry,
+                             CachedAnswer& answer) {
+    answer.stale = now >= expiry;
+    if (answer.stale && now >= expiry + stale_window) {
+        return false;
+    }
+    answer.age = static_cast<uint32_t>(chrono::duration_cast<chrono::seconds>(now - stored).count());
+    entry.record_hit();
+    answer.refresh = claim_refresh(entry, now, stored, expiry);
+    return true;
+}
+
+bool FastDNSCache::claim_refresh(CacheEntry& entry, chrono::steady_clock::time_point now,
+                                 chrono::steady_clock::time_point stored, chrono::steady_clock::time_point expiry) {
+    // Stale entries always want a refresh; fresh ones only when hot and
+    // far enough into their TTL
+    if (now < expiry && (refresh_fraction <= 0.0 || now - stored < (expiry - stored) * refresh_fraction ||
+                         entry.hits.load(memory_order_relaxed) < refresh_min_hits)) {
+        return false;
+    }
+    // Only one hit per stored answer wins; the rest keep being served
+    // without a second upstream query
+    return !entry.refresh_pending.load(memory_order_relaxed) &&
+           !entry.refresh_pending.exchange(true, memory_order_relaxed);
+}
+
+void FastDNSCache::set(string_view key, uint64_t name_hash, uint16_t qtype, const CachedAnswer& answer,
+                       uint32_t ttl) {
+    auto now = CacheClock::now();
+    insert(key, name_hash, qtype, answer, now, now + chrono::seconds(ttl));
+}
+
+bool FastDNSCache::copy_from(FastDNSCache& source, string_view key, uint64_t name_hash, uint16_t qtype,
+                             CachedAnswer& answer) {
+    if (key.size() > CacheEntry::PAYLOAD_SIZE) {
+        return false;
+    }
+    uint64_t h = question_hash(name_hash, qtype);
+    auto& shard = source.shards[source.shard_index(h)];
+    chrono::steady_clock::time_point stored, expiry;
+    auto now = CacheClock::now();
+    if (!source.read_entry(shard, source.set_index(h), source.tag_of(h), key, qtype, answer, stored, expiry) ||
+        now >= expiry) {
+        return false;
+    }
+    answer.age = static_cast<uint32_t>(chrono::duration_cast<chrono::seconds>(now - stored).count());
     
-    shard.cleanup_expired();
+    // The source keeps its own refresh-ahead claim; this copy starts unclaimed
+    answer.stale = false;
+    answer.refresh = false;
+    insert(key, name_hash, qtype, answer, stored, expiry);
+    return true;
+}
+
+void FastDNSCache::insert(string_view key, uint64_t name_hash, uint16_t qtype, const CachedAnswer& answer,
+                          chrono::steady_clock::time_point stored, chrono::steady_clock::time_point expiry) {
+    if (key.size() > CacheEntry::PAYLOAD_SIZE || answer.len > CachedAnswer::MAX_SIZE) {
+        uncacheable.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    bool inline_answer = CacheEntry::fits_inline(key.size(), answer.len);
+    
+    uint64_t h = question_hash(name_hash, qtype);
+    auto& shard = shards[shard_index(h)];
+    size_t set = set_index(h);
+    auto lock = shard.lock();
+    
+    CacheEntry* entry = shard.find(set, tag_of(h), key, qtype);
+    bool inserted = false;
+    if (!entry) {
+        shard.age_if_due();
+        entry = &shard.victim(set, CacheClock::now());
+        inserted = true;
+    }
+    if (!inline_answer && !entry->overflow) {
+        entry->overflow = new uint8_t[CachedAnswer::MAX_SIZE];
+    }
     
-    shard.evict_lru();
+    entry->begin_write();
+    if (inserted) {
+        entry->tag = tag_of(h);
+        entry->qtype = qtype;
+        entry->key_len = static_cast<uint8_t>(key.size());
+        memcpy(entry->payload, key.data(), key.size());
+        entry->hits.store(0, memory_order_relaxed);
+        entry->referenced.store(false, memory_order_relaxed);
+        shard.size.fetch_add(1, memory_order_relaxed);
+    }
+    entry->generation++;
+    entry->stored = stored;
+    entry->expiry = expiry;
+    entry->refresh_pending.store(false, memory_order_relaxed);
+    entry->answer_len = answer.len;
+    entry->ancount = answer.ancount;
+    entry->nscount = answer.nscount;
+    entry->rcode = answer.rcode;
+    memcpy(inline_answer ? entry->payload + entry->key_len : entry->overflow, answer.data, answer.len);
+    entry->end_write();
+    
+    uint32_t slot = static_cast<uint32_t>(entry - shard.slots.get());
+    shard.expiry_heap.push({entry->expiry + stale_window, slot, entry->generation});
+}
+
+void FastDNSCache::release_refresh(string_view key, uint64_t name_hash, uint16_t qtype) {
+    uint64_t h = question_hash(name_hash, qtype);
+    auto& shard = shards[shard_index(h)];
+    auto lock = shard.lock();
+    if (CacheEntry* entry = shard.find(set_index(h), tag_of(h), key, qtype)) {
+        entry->refresh_pending.store(false, memory_order_relaxed);
+    }
+}
+
+size_t FastDNSCache::cleanup_expired(size_t max_per_shard) {
+    size_t removed = 0;
+    for (size_t i = 0; i < num_shards; ++i) {
+        auto& shard = shards[i];
+        auto lock = shard.lock();
+        removed += shard.cleanup_expired(max_per_shard, stale_window);
+    }
+    return removed;
+}
+
+constexpr char FastDNSCache::SNAPSHOT_MAGIC[8];
+
+bool FastDNSCache::save_snapshot(const string& path, size_t& saved, string& error) const {
+    string tmp = path + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (!out) {
+        error = tmp + ": " + strerror(errno);
+        return false;
+    }
     
-    shard.entries[domain] = CacheEntry(ip, ttl);
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.written_at = chrono::duration_cast<chrono::seconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    
+    // Each shard is copied out under its lock and written after releasing
+    // it, so a slow disk never stalls inserts
+    vector<uint8_t> chunk;
+    saved = 0;
+    for (size_t i = 0; i < num_shards && ok; ++i) {
+        const auto& shard = shards[i];
+        chunk.clear();
+        {
+            lock_guard<mutex> lock(shard.mtx);
+            auto now = CacheClock::now();
+            for (size_t slot = 0; slot < shard.num_slots; ++slot) {
+                const CacheEntry& entry = shard.slots[slot];
+                if (!entry.occupied() || now >= entry.expiry) {
+                    continue;
+                }
+                auto remaining = chrono::duration_cast<chrono::seconds>(entry.expiry - now).count();
+                if (remaining <= 0) {
+                    continue;  // Under a second left; not worth restoring
+                }
+                
+                SnapshotRecord record;
+                memset(&record, 0, sizeof(record));
+                record.remaining = static_cast<uint32_t>(remaining);
+                record.age = static_cast<uint32_t>(chrono::duration_cast<chrono::seconds>(now - entry.stored).count());
+                record.qtype = entry.qtype;
+                record.answer_len = entry.answer_len;
+                record.ancount = entry.ancount;
+                record.nscount = entry.nscount;
+                record.key_len = entry.key_len;
+                record.rcode = entry.rcode;
+                
+                const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&record);
+                chunk.insert(chunk.end(), bytes, bytes + sizeof(record));
+                chunk.insert(chunk.end(), entry.payload, entry.payload + entry.key_len);
+                chunk.insert(chunk.end(), entry.answer_data(), entry.answer_data() + entry.answer_len);
+                saved++;
+            }
+        }
+        ok = chunk.empty() || fwrite(chunk.data(), 1, chunk.size(), out) == chunk.size();
+    }
     
-    shard.touch_lru(domain);
+    header.records = saved;
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        error = path + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
 }
 
-void FastDNSCache::cleanup_expired() {
-    for (auto& shard : shards) {
-        lock_guard<mutex> lock(shard.mtx);
-        shard.cleanup_expired();
+bool FastDNSCache::load_snapshot(const string& path, size_t& loaded, string& error) {
+    loaded = 0;
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    
+    SnapshotHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header.version != SNAPSHOT_VERSION) {
+        error = path + ": not a cache snapshot, or from another version";
+        fclose(in);
+        return false;
+    }
+    
+    // Time spent down counts against every TTL; a clock that went
+    // backwards charges nothing
+    int64_t now_unix = chrono::duration_cast<chrono::seconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    int64_t elapsed = max<int64_t>(0, now_unix - header.written_at);
+    auto now = CacheClock::now();
+    
+    uint8_t key_buf[CacheEntry::PAYLOAD_SIZE];
+    CachedAnswer answer;
+    for (uint64_t i = 0; i < header.records; ++i) {
+        SnapshotRecord record;
+        if (fread(&record, sizeof(record), 1, in) != 1 ||
+            record.key_len > CacheEntry::PAYLOAD_SIZE || record.answer_len > CachedAnswer::MAX_SIZE ||
+            fread(key_buf, 1, record.key_len, in) != record.key_len ||
+            fread(answer.data, 1, record.answer_len, in) != record.answer_len) {
+            error = path + ": truncated or corrupt after " + to_string(i) + " records";
+            fclose(in);
+            return false;
+        }
+        if (record.remaining <= elapsed) {
+            continue;
+        }
+        
+        string_view key(reinterpret_cast<const char*>(key_buf), record.key_len);
+        answer.len = record.answer_len;
+        answer.ancount = record.ancount;
+        answer.nscount = record.nscount;
+        answer.rcode = record.rcode;
+        insert(key, hash_wire_name(key), record.qtype, answer,
+               now - chrono::seconds(record.age + elapsed), now + chrono::seconds(record.remaining - elapsed));
+        loaded++;
     }
+    fclose(in);
+    return true;
 }
 
 FastDNSCache::Stats FastDNSCache::get_stats() const {
     Stats stats;
-    
-    for (const auto& shard : shards) {
-        lock_guard<mutex> lock(shard.mtx);
-        stats.hits += shard.hits.load(memory_order_relaxed);
-        stats.misses += shard.misses.load(memory_order_relaxed);
-        stats.evictions += shard.evictions.load(memory_order_relaxed);
-        stats.size += shard.entries.size();
+    for (const Stats& shard : get_shard_stats()) {
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.evictions += shard.evictions;
+        stats.rejections += shard.rejections;
+        stats.lock_waits += shard.lock_waits;
+        stats.size += shard.size;
+    }
+    stats.uncacheable = uncacheable.load(memory_order_relaxed);
+    stats.capacity = capacity();
+    stats.shards = num_shards;
+    return stats;
+}
+
+vector<FastDNSCache::Stats> FastDNSCache::get_shard_stats() const {
+    vector<Stats> stats(num_shards);
+    for (size_t i = 0; i < num_shards; ++i) {
+        const auto& shard = shards[i];
+        stats[i].hits = shard.hits.load(memory_order_relaxed);
+        stats[i].misses = shard.misses.load(memory_order_relaxed);
+        stats[i].evictions = shard.evictions.load(memory_order_relaxed);
+        stats[i].rejections = shard.rejections.load(memory_order_relaxed);
+        stats[i].lock_waits = shard.lock_waits.load(memory_order_relaxed);
+        stats[i].size = shard.size.load(memory_order_relaxed);
+        stats[i].capacity = shard.num_slots;
+        stats[i].shards = 1;
     }
     
+    // Only guards the list of per-thread counter arrays, which grows once
+    // per thread; the counters themselves are single-writer
+    lock_guard<mutex> lock(thread_hits_mutex);
+    for (const auto& counters : thread_hits) {
+        for (size_t i = 0; i < num_shards; ++i) {
+            stats[i].hits += counters[i].load(memory_order_relaxed);
+        }
+    }
     return stats;
 }
 
+// Whether tmpl answers this question: the name at offset 12 and the QTYPE
+// after it, as FrozenZone::find checks them
+static bool answers_question(const vector<uint8_t>& tmpl, const uint8_t* name, size_t name_len, uint16_t qtype) {
+    return tmpl.size() >= 12 + name_len + 2 && memcmp(tmpl.data() + 12, name, name_len) == 0 &&
+           tmpl[12 + name_len] == (qtype >> 8) && tmpl[12 + name_len + 1] == (qtype & 0xFF);
+}
+
+void PrecompiledResponses::copy_local_names(const PrecompiledResponses& other) {
+    responses = other.responses;
+    names = other.names;
+    frozen = false;
+}
+
 void PrecompiledResponses::add_local_domain(const string& domain, const string& ip) {
-    vector<uint8_t> response;
+    string wire;
+    struct in_addr addr;
+    struct in6_addr addr6;
+    if (!text_to_wire(domain, wire)) {
+        return;
+    }
     
-    response.resize(12);
-    uint16_t* header = reinterpret_cast<uint16_t*>(response.data());
-    header[0] = 0;
-    header[1] = htons(0x8180);
-    header[2] = htons(1);
-    header[3] = htons(1);
-    header[4] = htons(0);
-    header[5] = htons(0);
+    if (inet_aton(ip.c_str(), &addr)) {
+        const uint8_t* octets = reinterpret_cast<const uint8_t*>(&addr);
+        add_static(make_local_domain(domain, octets[0], octets[1], octets[2], octets[3]));
+    } else if (inet_pton(AF_INET6, ip.c_str(), &addr6) == 1) {
+        vector<uint8_t> reply;
+        string rdata(reinterpret_cast<const char*>(&addr6), sizeof(addr6));
+        if (build_local_template(wire, TYPE_AAAA, {{wire, TYPE_AAAA, 300, rdata}}, reply)) {
+            uint64_t name_hash = hash_wire_name(wire);
+            add_template(move(reply), question_hash(name_hash, TYPE_AAAA), wire.size());
+            add_catch_all(wire, name_hash);
+        }
+    }
+}
+
+void PrecompiledResponses::add_static(const StaticLocalDomain& domain) {
+    add_template(vector<uint8_t>(domain.response, domain.response + domain.len), domain.hash, domain.name_len);
+    add_catch_all(string(reinterpret_cast<const char*>(domain.response + 12), domain.name_len), domain.name_hash);
+}
+
+void PrecompiledResponses::add_catch_all(const string& name, uint64_t name_hash) {
+    // Names added here only ever hold addresses, so other types get NODATA
+    auto& bucket = responses[question_hash(name_hash, 0)];
+    const uint8_t* wire = reinterpret_cast<const uint8_t*>(name.data());
+    for (const auto& existing : bucket) {
+        if (answers_question(existing, wire, name.size(), 0)) {
+            return;
+        }
+    }
+    vector<uint8_t> nodata;
+    if (build_local_template(name, 0, {}, nodata)) {
+        frozen = false;
+        bucket.push_back(move(nodata));
+        names++;
+    }
+}
+
+void PrecompiledResponses::add_template(vector<uint8_t>&& response, uint64_t hash, size_t name_len) {
+    if (response.size() < 12 + name_len + 2) {
+        return;
+    }
+    frozen = false;
+    
+    uint16_t qtype = static_cast<uint16_t>((response[12 + name_len] << 8) | response[12 + name_len + 1]);
+    auto& bucket = responses[hash];
+    for (auto& existing : bucket) {
+        if (answers_question(existing, response.data() + 12, name_len, qtype)) {
+            existing = move(response);
+            return;
+        }
+    }
+    bucket.push_back(move(response));
+}
+
+bool PrecompiledResponses::add_zone_file(const string& path, string& error) {
+    auto zone = make_unique<FrozenZone>();
+    if (!zone->map(path, error)) {
+        return false;
+    }
+    zone_files.push_back(move(zone));
+    return true;
+}
+
+size_t PrecompiledResponses::size() const {
+    size_t count = names;
+    for (const auto& zone : zone_files) {
+        count += zone->names();
+    }
+    return count;
+}
+
+bool PrecompiledResponses::freeze() {
+    vector<ZoneTemplate> templates;
+    for (const auto& bucket : responses) {
+        for (const auto& response : bucket.second) {
+            templates.push_back({bucket.first, response.data(), response.size()});
+        }
+    }
     
-    istringstream iss(domain);
-    string label;
-    while (getline(iss, label, '.')) {
-        response.push_back(static_cast<uint8_t>(label.length()));
-        response.insert(response.end(), label.begin(), label.end());
+    frozen = frozen_table.build(templates);
+    return frozen;
+}
+
+const uint8_t* PrecompiledResponses::find(const QueryView& query, uint64_t hash, uint16_t qtype, size_t& len) const {
+    if (frozen) {
+        if (const uint8_t* tmpl = frozen_table.find(hash, query.lower, query.qname_len, qtype, len)) {
+            return tmpl;
+        }
+    } else {
+        auto it = responses.find(hash);
+        if (it != responses.end()) {
+            for (const auto& response : it->second) {
+                if (answers_question(response, query.lower, query.qname_len, qtype)) {
+                    len = response.size();
+                    return response.data();
+                }
+            }
+        }
     }
-    response.push_back(0);
     
-    uint16_t qtype = htons(1);
-    uint16_t qclass = htons(1);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&qtype), reinterpret_cast<uint8_t*>(&qtype) + 2);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&qclass), reinterpret_cast<uint8_t*>(&qclass) + 2);
+    for (const auto& zone : zone_files) {
+        if (const uint8_t* tmpl = zone->find(hash, query.lower, query.qname_len, qtype, len)) {
+            return tmpl;
+        }
+    }
+    return nullptr;
+}
+
+const uint8_t* PrecompiledResponses::get_response(const QueryView& query, size_t& len, bool& catch_all) const {
+    // Every table is searched for the exact question before any catch-all,
+    // so an answer from a later zone file beats an earlier NODATA
+    catch_all = false;
+    if (const uint8_t* tmpl = find(query, question_hash(query.hash, query.qtype), query.qtype, len)) {
+        return tmpl;
+    }
+    catch_all = true;
+    return find(query, question_hash(query.hash, 0), 0, len);
+}
+
+ResponseBatch::ResponseBatch(int socket_fd, size_t capacity, atomic<uint64_t>* drop_counter)
+    : fd(socket_fd), drops(drop_counter), arena(new uint8_t[capacity * MAX_RESPONSE]), addrs(capacity), iovs(capacity),
+      iov_counts(capacity), msgs(capacity) {}
+
+uint8_t* ResponseBatch::buffer() {
+    if (full()) {
+        flush();
+    }
+    return slot(count);
+}
+
+void ResponseBatch::commit(size_t len, const sockaddr_in& addr) {
+    iovs[count][0] = {slot(count), min(len, MAX_RESPONSE)};
+    iov_counts[count] = 1;
+    addrs[count] = addr;
+    count++;
+}
+
+void ResponseBatch::add_template(uint16_t query_id, const uint8_t* tmpl, size_t len, const sockaddr_in& addr,
+                                 uint16_t edns_udp_size) {
+    if (len < 12) {
+        return;
+    }
     
-    response.push_back(0xC0);
-    response.push_back(0x0C);
+    // The arena slot holds the copied header, which carries the ID and the
+    // additional count, and the OPT record if there is one; the records in
+    // between are gathered from the template
+    uint8_t* header = buffer();
+    memcpy(header, tmpl, 12);
+    memcpy(header, &query_id, 2);
+    iovs[count][0] = {header, 12};
+    iovs[count][1] = {const_cast<uint8_t*>(tmpl) + 12, len - 12};
+    iov_counts[count] = 2;
+    if (edns_udp_size) {
+        header[10] = 0;
+        header[11] = 1;
+        iovs[count][2] = {header + 12, write_opt(header + 12, edns_udp_size)};
+        iov_counts[count] = 3;
+    }
+    addrs[count] = addr;
+    count++;
+}
+
+size_t ResponseBatch::length(size_t i) const {
+    size_t len = 0;
+    for (size_t part = 0; part < iov_counts[i]; ++part) {
+        len += iovs[i][part].iov_len;
+    }
+    return min(len, MAX_RESPONSE);
+}
+
+size_t ResponseBatch::copy_out(size_t i, uint8_t* dst) const {
+    size_t len = 0;
+    for (size_t part = 0; part < iov_counts[i]; ++part) {
+        size_t n = min(iovs[i][part].iov_len, MAX_RESPONSE - len);
+        memcpy(dst + len, iovs[i][part].iov_base, n);
+        len += n;
+    }
+    return len;
+}
+
+void ResponseBatch::flush() {
+    if (count == 0) {
+        return;
+    }
     
-    uint16_t atype = htons(1);
-    uint16_t aclass = htons(1);
-    uint32_t ttl = htonl(300);
-    uint16_t rdlength = htons(4);
+    for (size_t i = 0; i < count; ++i) {
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = iovs[i].data();
+        msgs[i].msg_hdr.msg_iovlen = iov_counts[i];
+    }
     
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&atype), reinterpret_cast<uint8_t*>(&atype) + 2);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&aclass), reinterpret_cast<uint8_t*>(&aclass) + 2);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&ttl), reinterpret_cast<uint8_t*>(&ttl) + 4);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&rdlength), reinterpret_cast<uint8_t*>(&rdlength) + 2);
+    if (count == 1) {
+        if (sendmsg(fd, &msgs[0].msg_hdr, 0) < 0) {
+            count_dropped(1);
+        }
+        count = 0;
+        return;
+    }
     
-    struct in_addr addr;
-    if (inet_aton(ip.c_str(), &addr)) {
-        response.insert(response.end(), reinterpret_cast<uint8_t*>(&addr), reinterpret_cast<uint8_t*>(&addr) + 4);
+    size_t sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(fd, &msgs[sent], count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                break;  // Socket buffer full: drop the rest
+            }
+            // The error is the first message's alone (a bad client
+            // address); the replies queued behind it still go out
+            count_dropped(1);
+            sent += 1;
+            continue;
+        }
+        sent += n;
     }
     
-    responses[domain] = move(response);
+    count_dropped(count - sent);
+    count = 0;
 }
 
-bool PrecompiledResponses::get_response(const string& domain, uint16_t query_id, vector<uint8_t>& response) {
-    auto it = responses.find(domain);
-    if (it == responses.end()) {
-        return false;
+// Cache of the NUMA node the calling thread serves: set by each worker,
+// 0 for every other thread and whenever there is only one cache
+static thread_local size_t current_node = 0;
+
+DNSServer::DNSServer(uint16_t port) : DNSServer([port] {
+    ServerConfig cfg;
+    cfg.port = port;
+    return cfg;
+}()) {}
+
+DNSServer::DNSServer(const ServerConfig& cfg)
+    : config(cfg), running(false), topology(CpuTopology::detect()) {
+    if (config.num_workers == 0) {
+        config.num_workers = topology.usable_cpus().size();
+        if (config.num_workers == 0) config.num_workers = 4;
     }
     
-    response = it->second;
-    *reinterpret_cast<uint16_t*>(response.data()) = query_id;
+    worker_nodes.assign(config.num_workers, 0);
+    if (config.pin_workers) {
+        worker_cpus = topology.spread(config.num_workers);
+        for (size_t i = 0; i < config.num_workers; ++i) {
+            worker_nodes[i] = topology.node_of(worker_cpus[i]);
+        }
+    } else if (config.cache_per_node) {
+        cerr << "Per-node caches need pinned workers; using one shared cache" << endl;
+        config.cache_per_node = false;
+    }
+    create_caches();
     
-    return true;
+    if (config.client_rate) {
+        client_limiter = make_unique<RateLimiter>(config.rate_buckets, config.client_rate, config.client_burst,
+                                                  config.rate_slip);
+    }
+    if (config.rrl_rate) {
+        response_limiter = make_unique<RateLimiter>(config.rate_buckets, config.rrl_rate, 0, config.rate_slip);
+    }
+    config.edns_udp_size = std::clamp<uint16_t>(config.edns_udp_size, CLASSIC_UDP_SIZE, CachedAnswer::MAX_SIZE);
+    open_sockets();
+    // One reader per worker, plus the TCP loop
+    qsbr = make_unique<QsbrDomain>(config.num_workers + 1);
+}
+
+void DNSServer::create_caches() {
+    size_t capacity = config.cache_memory_bytes ? FastDNSCache::capacity_for_memory(config.cache_memory_bytes)
+                                                : config.cache_capacity;
+    size_t nodes = config.cache_per_node ? topology.nodes() : 1;
+    caches.resize(nodes);
+    for (size_t node = 0; node < nodes; ++node) {
+        auto build = [&, node] {
+            caches[node] = make_unique<FastDNSCache>(capacity, config.cache_shards, config.cache_lock_free_reads);
+        };
+        
+        // A replica is built by a thread on its own node: slots are
+        // initialized as they are allocated, so first touch puts the whole
+        // table in that node's memory
+        auto worker = find(worker_nodes.begin(), worker_nodes.end(), node);
+        if (nodes > 1 && worker != worker_nodes.end()) {
+            int cpu = worker_cpus[worker - worker_nodes.begin()];
+            exception_ptr failure;
+            thread builder([&] {
+                pin_current_thread(cpu);
+                try {
+                    build();
+                } catch (...) {
+                    failure = current_exception();
+                }
+            });
+            builder.join();
+            if (failure) {
+                rethrow_exception(failure);
+            }
+        } else {
+            build();
+        }
+        
+        caches[node]->set_refresh_ahead(config.prefetch_fraction, config.prefetch_min_hits);
+        caches[node]->set_serve_stale(config.serve_stale_s);
+        caches[node]->set_admission(config.cache_admission);
+    }
+}
+
+// Node 0 keeps the configured path so a restart without per-node caches
+// still finds its snapshot
+static string node_snapshot_path(const string& path, size_t node) {
+    return node == 0 ? path : path + "." + to_string(node);
 }
 
-DNSServer::DNSServer(uint16_t port) : socket_fd(-1), running(false) {
-    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (socket_fd < 0) {
+static int open_udp_socket(uint16_t port, bool reuseport) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
         throw runtime_error("Failed to create socket");
     }
     
     int reuse = 1;
-    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        close(fd);
+        return -1;
+    }
     
     int buffer_size = 1024 * 1024;
-    setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
-    setsockopt(socket_fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
     
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -150,17 +815,126 @@ DNSServer::DNSServer(uint16_t port) : socket_fd(-1), running(false) {
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(port);
     
-    if (bind(socket_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
-        close(socket_fd);
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
         throw runtime_error("Failed to bind socket to port " + to_string(port));
     }
+    return fd;
+}
+
+void DNSServer::open_sockets() {
+    if (config.reuseport && config.num_workers > 1) {
+        for (size_t i = 0; i < config.num_workers; ++i) {
+            int fd;
+            try {
+                fd = open_udp_socket(config.port, true);
+            } catch (...) {
+                for (int open_fd : socket_fds) close(open_fd);
+                socket_fds.clear();
+                throw;
+            }
+            if (fd < 0) {
+                // Kernel without SO_REUSEPORT: fall back to one shared socket
+                for (int open_fd : socket_fds) close(open_fd);
+                socket_fds.clear();
+                break;
+            }
+            // The kernel's own reuseport scoring prefers this socket for
+            // packets received on its worker's CPU when no CBPF is attached
+            if (!worker_cpus.empty()) {
+                setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &worker_cpus[i], sizeof(int));
+            }
+            socket_fds.push_back(fd);
+        }
+        
+        // With more sockets than CPUs the surplus would never be selected
+        if (config.num_workers > thread::hardware_concurrency()) {
+            config.cpu_steering = false;
+        }
+        if (!socket_fds.empty() && config.cpu_steering) {
+            attach_cpu_steering();
+        }
+    }
+    
+    if (socket_fds.empty()) {
+        config.reuseport = false;
+        socket_fds.push_back(open_udp_socket(config.port, false));
+    }
+}
+
+void DNSServer::attach_cpu_steering() {
+    // Steer each datagram to the socket whose index matches the CPU that
+    // received it, so a flow stays on the core its RX queue is serviced by.
+    // Sockets join the reuseport group in bind order, which is worker order.
+    //
+    // With pinned workers the CPU is looked up instead: each maps to the
+    // worker pinned to it, or else the nearest one below it on the same
+    // NUMA node, so a packet is always handled (and its cache probed) on
+    // the node whose CPU took the interrupt. Runs of CPUs sharing a worker
+    // become one range test each, tried in order.
+    vector<sock_filter> code;
+    code.push_back({ BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) });
+    
+    vector<uint32_t> target(topology.max_cpu() + 1);
+    bool identity = true;
+    for (int cpu = 0; cpu <= topology.max_cpu() && !worker_cpus.empty(); ++cpu) {
+        size_t node = topology.node_of(cpu);
+        uint32_t best = cpu % socket_fds.size();
+        int best_cpu = -1;
+        int lowest_cpu = INT32_MAX;
+        for (size_t i = 0; i < worker_cpus.size(); ++i) {
+            if (worker_nodes[i] != node) {
+                continue;
+            }
+            if (worker_cpus[i] <= cpu && worker_cpus[i] > best_cpu) {
+                best = static_cast<uint32_t>(i);
+                best_cpu = worker_cpus[i];
+            } else if (best_cpu < 0 && worker_cpus[i] < lowest_cpu) {
+                best = static_cast<uint32_t>(i);
+                lowest_cpu = worker_cpus[i];
+            }
+        }
+        target[cpu] = best;
+        identity = identity && best == cpu % socket_fds.size();
+    }
+    
+    size_t ranges = 0;
+    for (size_t cpu = 1; cpu <= target.size(); ++cpu) {
+        ranges += cpu == target.size() || target[cpu] != target[cpu - 1];
+    }
+    if (worker_cpus.empty() || identity || 3 + 2 * ranges > BPF_MAXINSNS) {
+        code.push_back({ BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(socket_fds.size()) });
+        code.push_back({ BPF_RET | BPF_A, 0, 0, 0 });
+    } else {
+        for (size_t cpu = 0; cpu < target.size(); ++cpu) {
+            if (cpu + 1 < target.size() && target[cpu + 1] == target[cpu]) {
+                continue;
+            }
+            // if (A > cpu) skip the return, else it is this run's worker
+            code.push_back({ BPF_JMP | BPF_JGT | BPF_K, 1, 0, static_cast<uint32_t>(cpu) });
+            code.push_back({ BPF_RET | BPF_K, 0, 0, target[cpu] });
+        }
+        // CPUs past those sysfs listed (hotplugged since start)
+        code.push_back({ BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(socket_fds.size()) });
+        code.push_back({ BPF_RET | BPF_A, 0, 0, 0 });
+    }
+    struct sock_fprog prog;
+    prog.len = static_cast<unsigned short>(code.size());
+    prog.filter = code.data();
+    
+    if (setsockopt(socket_fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        // Not fatal: the kernel keeps hashing the 4-tuple across the group
+        cerr << "CPU steering unavailable: " << strerror(errno) << endl;
+        config.cpu_steering = false;
+    }
 }
 
 DNSServer::~DNSServer() {
     stop();
-    if (socket_fd >= 0) {
-        close(socket_fd);
+    for (int fd : socket_fds) {
+        close(fd);
     }
+    delete precompiled.load();
 }
 
 bool DNSServer::start() {
@@ -168,277 +942,862 @@ bool DNSServer::start() {
         return false;
     }
     
+    for (const auto& path : config.zone_files) {
+        string error;
+        if (!precompiled.load()->add_zone_file(path, error)) {
+            cerr << "Failed to load zone " << error << endl;
+            return false;
+        }
+    }
+    
+    // Warm start: answers still within their TTL are served from the first
+    // query instead of each costing an upstream round trip
+    for (size_t node = 0; node < caches.size() && !config.cache_snapshot.empty(); ++node) {
+        string path = node_snapshot_path(config.cache_snapshot, node);
+        size_t loaded = 0;
+        string error;
+        if (!caches[node]->load_snapshot(path, loaded, error)) {
+            cerr << "Cache snapshot not loaded: " << error << endl;
+        } else if (loaded > 0) {
+            cout << "Warm start: " << loaded << " cached answers from " << path << endl;
+        }
+    }
+    
+    forwarder = std::make_unique<UpstreamForwarder>(
+        upstream_resolvers, std::chrono::milliseconds(config.upstream_timeout_ms),
+        [this](const std::vector<UpstreamQuery>& waiters, const uint8_t* reply, size_t len) {
+            on_upstream_reply(waiters, reply, len);
+        });
+    forwarder->set_hedging(config.upstream_hedging);
+    if (!forwarder->start()) {
+        cerr << "No usable upstream resolvers; cache misses will get SERVFAIL" << endl;
+        forwarder.reset();
+    }
+    
+    // Local names are fixed from here on: trade the load-time map for the
+    // perfect hash that workers probe
+    if (!precompiled.load()->freeze()) {
+        cerr << "Local domain hash collision; serving local names from the hash map" << endl;
+    }
+    
+    local_names.store(precompiled.load()->size(), memory_order_relaxed);
+    
+    if (!config.trace_file.empty() || config.slow_query_us) {
+        QueryTracer::Options options;
+        options.file = config.trace_file;
+        options.sample = config.trace_sample;
+        options.slow = chrono::microseconds(config.slow_query_us);
+        tracer = make_unique<QueryTracer>(options);
+        string error;
+        if (!tracer->start(error)) {
+            cerr << "Query tracing unavailable: " << error << endl;
+            tracer.reset();
+        }
+    }
+    
     running = true;
     
-    size_t num_threads = thread::hardware_concurrency();
-    if (num_threads == 0) num_threads = 4;
+    if (config.tcp) {
+        TcpServer::Limits limits;
+        limits.max_connections = config.tcp_max_connections;
+        limits.max_pipelined = config.tcp_max_pipelined;
+        limits.idle_timeout = chrono::milliseconds(config.tcp_idle_timeout_ms);
+        tcp = make_unique<TcpServer>(config.port, limits, *qsbr, config.num_workers,
+                                     [this](const uint8_t* data, size_t len, uint64_t conn, ResponseBatch& out) {
+                                         return handle_query(data, len, sockaddr_in{}, out, conn);
+                                     });
+        string error;
+        if (!tcp->start(error)) {
+            cerr << "TCP listener unavailable: " << error << endl;
+            tcp.reset();
+        }
+    }
+    
+    // Last before the workers: render_metrics() must never see tcp,
+    // forwarder or tracer while they are still being assigned
+    if (config.metrics_port) {
+        metrics = make_unique<MetricsServer>(config.metrics_address, config.metrics_port,
+                                            [this] { return render_metrics(); });
+        string error;
+        if (!metrics->start(error)) {
+            cerr << "Metrics endpoint unavailable: " << error << endl;
+            metrics.reset();
+        }
+    }
     
-    for (size_t i = 0; i < num_threads; ++i) {
-        worker_threads.emplace_back(&DNSServer::worker_thread, this);
+    for (size_t i = 0; i < config.num_workers; ++i) {
+        worker_threads.emplace_back(&DNSServer::worker_thread, this, i);
     }
+    maintenance_thread = thread(&DNSServer::maintenance_loop, this);
     
-    cout << "DNS Server started with " << num_threads << " worker threads" << endl;
+    cout << "DNS Server started with " << config.num_workers << " worker threads";
+    cout << ", " << precompiled.load()->size() << " local names";
+    if (config.reuseport) {
+        cout << " (" << socket_fds.size() << " SO_REUSEPORT sockets"
+             << (config.cpu_steering ? ", CPU steered)" : ")");
+    }
+    if (tcp) {
+        cout << ", TCP";
+    }
+    if (!worker_cpus.empty()) {
+        cout << ", pinned across " << topology.describe();
+    }
+    if (caches.size() > 1) {
+        cout << ", a cache per node";
+    }
+    cout << endl;
     return true;
 }
 
 void DNSServer::stop() {
-    if (!running) {
+    if (!running.exchange(false)) {
         return;
     }
     
-    running = false;
+    // Scrapes read the forwarder, the TCP server and the tracer, so the
+    // endpoint goes before any of them is drained or torn down
+    if (metrics) {
+        metrics->stop();
+        metrics.reset();
+    }
     
-    // Wait for all threads to finish
+    // Shutting the read side wakes workers parked in a receive at once and
+    // takes no more queries; replies still leave on the same sockets
+    for (int fd : socket_fds) {
+        shutdown(fd, SHUT_RD);
+    }
     for (auto& thread : worker_threads) {
         if (thread.joinable()) {
             thread.join();
         }
     }
-    
     worker_threads.clear();
+    
+    // No new queries from TCP clients either, so nothing new reaches the
+    // forwarder; lookups already upstream are answered, and cached, before
+    // anything is torn down, TCP clients' included
+    if (tcp) {
+        tcp->stop_reading();
+    }
+    if (forwarder && !forwarder->drain(chrono::milliseconds(config.drain_timeout_ms))) {
+        cerr << "Drain timed out with " << forwarder->pending() << " upstream lookups in flight" << endl;
+    }
+    
+    // Fails whatever is still in flight back to its clients; the forwarder
+    // goes first so none of its completions race the TCP teardown
+    if (forwarder) {
+        forwarder->stop();
+        forwarder.reset();
+    }
+    if (tcp) {
+        tcp->stop();
+        tcp.reset();
+    }
+    
+    // Everything that records has stopped; the rest of the rings is written
+    if (tracer) {
+        tracer->stop();
+    }
+    
+    // The final snapshot is taken once the maintenance thread (which may be
+    // writing one) is gone
+    if (maintenance_thread.joinable()) {
+        maintenance_thread.join();
+    }
+    save_cache_snapshot();
     cout << "DNS Server stopped" << endl;
 }
 
+void DNSServer::maintenance_loop() {
+    // Expiry is spread over small bounded steps so no single shard lock is
+    // held for long, however full the cache is
+    auto next_snapshot = chrono::steady_clock::now() + chrono::seconds(config.snapshot_interval_s);
+    while (running) {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        for (auto& cache : caches) {
+            cache->cleanup_expired(64);
+        }
+        
+        if (config.snapshot_interval_s > 0 && chrono::steady_clock::now() >= next_snapshot) {
+            save_cache_snapshot();
+            next_snapshot = chrono::steady_clock::now() + chrono::seconds(config.snapshot_interval_s);
+        }
+    }
+}
+
+void DNSServer::save_cache_snapshot() {
+    if (config.cache_snapshot.empty()) {
+        return;
+    }
+    for (size_t node = 0; node < caches.size(); ++node) {
+        size_t saved = 0;
+        string error;
+        if (!caches[node]->save_snapshot(node_snapshot_path(config.cache_snapshot, node), saved, error)) {
+            cerr << "Cache snapshot failed: " << error << endl;
+        }
+    }
+}
+
 void DNSServer::add_upstream_resolver(const string& ip, uint16_t port) {
     upstream_resolvers.emplace_back(ip, port);
 }
 
 void DNSServer::add_local_domain(const string& domain, const string& ip) {
-    precompiled.add_local_domain(domain, ip);
+    precompiled.load()->add_local_domain(domain, ip);
+}
+
+void DNSServer::add_local_domain(const StaticLocalDomain& domain) {
+    precompiled.load()->add_static(domain);
+}
+
+bool DNSServer::reload_local_zones() {
+    lock_guard<mutex> lock(reload_mutex);
+    
+    auto next = make_unique<PrecompiledResponses>();
+    next->copy_local_names(*precompiled.load(memory_order_acquire));
+    for (const auto& path : config.zone_files) {
+        string error;
+        if (!next->add_zone_file(path, error)) {
+            cerr << "Reload aborted, keeping current local names: " << error << endl;
+            return false;
+        }
+    }
+    if (!next->freeze()) {
+        cerr << "Local domain hash collision; serving local names from the hash map" << endl;
+    }
+    size_t names = next->size();
+    local_names.store(names, memory_order_relaxed);
+    
+    // Publish, then wait until every worker has finished the batch it was
+    // in; only then can nothing still point into the old table
+    PrecompiledResponses* old = precompiled.exchange(next.release(), memory_order_acq_rel);
+    qsbr->synchronize();
+    delete old;
+    
+    cout << "Reloaded local zones: " << names << " local names" << endl;
+    return true;
+}
+
+void DNSServer::worker_thread(size_t index) {
+    int fd = socket_fds[index % socket_fds.size()];
+    
+    // Pinned before anything is allocated, so the worker's buffers and
+    // ring land in its node's memory
+    if (!worker_cpus.empty() && !pin_current_thread(worker_cpus[index])) {
+        cerr << "Worker " << index << " could not be pinned to CPU " << worker_cpus[index] << endl;
+    }
+    current_node = worker_nodes[index] < caches.size() ? worker_nodes[index] : 0;
+    
+    if (config.io_engine == IOEngine::IoUring) {
+        UringEngine engine(fd, config.uring_entries, config.uring_buffers, config.edns_udp_size, &oversized_queries);
+        if (engine.setup()) {
+            ResponseBatch responses(fd, max<size_t>(config.batch_size, 1), &send_failures);
+            engine.run(running, responses, *qsbr, index, [this](const uint8_t* data, size_t len,
+                                                  const sockaddr_in& client_addr, ResponseBatch& out) {
+                handle_query(data, len, client_addr, out);
+            });
+            qsbr->offline(index);  // an exited worker must not hold up reloads
+            return;
+        }
+        if (index == 0) {
+            cerr << "io_uring engine unavailable, falling back to blocking workers" << endl;
+        }
+    }
+    
+    run_blocking_worker(index, fd);
+    qsbr->offline(index);
 }
 
-void DNSServer::worker_thread() {
-    uint8_t buffer[512];  // DNS messages are typically <= 512 bytes
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+// Workers go QSBR-offline around every blocking receive and come back online
+// before touching the local table; by then the previous batch has been
+// flushed, so its template iovecs no longer point into any table
+void DNSServer::run_blocking_worker(size_t index, int fd) {
+    size_t batch_size = max<size_t>(config.batch_size, 1);
+    ResponseBatch responses(fd, batch_size, &send_failures);
+    
+    // Queries may be as large as the EDNS size we advertise; anything longer
+    // arrives truncated and is dropped rather than parsed
+    size_t receive_size = config.edns_udp_size;
+    
+    if (batch_size == 1) {
+        vector<uint8_t> buffer(receive_size);
+        struct sockaddr_in client_addr;
+        
+        while (running) {
+            socklen_t client_len = sizeof(client_addr);
+            qsbr->offline(index);
+            ssize_t len = recvfrom(fd, buffer.data(), buffer.size(), MSG_TRUNC,
+                                  reinterpret_cast<struct sockaddr*>(&client_addr), &client_len);
+            qsbr->online(index);
+            
+            if (len > static_cast<ssize_t>(buffer.size())) {
+                oversized_queries.fetch_add(1, std::memory_order_relaxed);  // MSG_TRUNC reports the full length
+            } else if (len > 0) {
+                handle_query(buffer.data(), len, client_addr, responses);
+                responses.flush();
+            } else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                // Error occurred
+                if (running) {
+                    std::cerr << "Error receiving data: " << strerror(errno) << std::endl;
+                }
+            }
+        }
+        return;
+    }
+    
+    // Batched path: one recvmmsg fills up to batch_size datagrams, and all of
+    // their responses leave in one sendmmsg
+    vector<uint8_t> buffers(batch_size * receive_size);
+    vector<sockaddr_in> client_addrs(batch_size);
+    vector<iovec> iovs(batch_size);
+    vector<mmsghdr> msgs(batch_size);
     
     while (running) {
-        ssize_t len = recvfrom(socket_fd, buffer, sizeof(buffer), 0,
-                              reinterpret_cast<struct sockaddr*>(&client_addr), &client_len);
+        for (size_t i = 0; i < batch_size; ++i) {
+            iovs[i].iov_base = buffers.data() + i * receive_size;
+            iovs[i].iov_len = receive_size;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = &client_addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(client_addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
         
-        if (len > 0) {
-            handle_query(buffer, len, client_addr);
-        } else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            // Error occurred
-            if (running) {
+        // MSG_WAITFORONE blocks for the first datagram only, then takes
+        // whatever else is already queued
+        qsbr->offline(index);
+        int n = recvmmsg(fd, msgs.data(), batch_size, MSG_WAITFORONE, nullptr);
+        qsbr->online(index);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && running) {
                 std::cerr << "Error receiving data: " << strerror(errno) << std::endl;
             }
+            continue;
+        }
+        
+        for (int i = 0; i < n; ++i) {
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                oversized_queries.fetch_add(1, std::memory_order_relaxed);
+            } else if (msgs[i].msg_len > 0) {
+                handle_query(buffers.data() + i * receive_size, msgs[i].msg_len, client_addrs[i], responses);
+            }
         }
+        responses.flush();
     }
 }
 
-void DNSServer::handle_query(const uint8_t* data, size_t len, const sockaddr_in& client_addr) {
-    auto start_time = std::chrono::high_resolution_clock::now();
+bool DNSServer::handle_query(const uint8_t* data, size_t len, const sockaddr_in& client_addr, ResponseBatch& out,
+                             uint64_t tcp_conn) {
+    auto start_time = std::chrono::steady_clock::now();
     total_queries.fetch_add(1, std::memory_order_relaxed);
-    
-    DNSHeader header;
-    if (!parse_dns_header(data, len, header)) {
-        return;  // Invalid header
+    TraceRecord trace{};
+    
+    // A flooding or spoofed source is turned away on its address alone,
+    // before it costs a parse or a lookup
+    RateLimiter::Verdict verdict = RateLimiter::Verdict::Allow;
+    if (client_limiter && !tcp_conn) {
+        verdict = client_limiter->check(RateLimiter::client_key(client_addr, config.rate_prefix), start_time);
+        if (verdict == RateLimiter::Verdict::Drop) {
+            trace_reply(trace, start_time, 0, 0, TracePath::Limited, 0);
+            return false;
+        }
     }
     
-    if (header.qdcount != 1) {
-        return;  // We only handle single questions
+    // Validated in place; the lowercased name and its hash come out of the
+    // same pass and key every lookup below, so no strings are built
+    QueryView query;
+    if (!parse_query(data, len, query)) {
+        malformed_queries.fetch_add(1, std::memory_order_relaxed);
+        trace_reply(trace, start_time, 0, 0, TracePath::Error, 1);
+        if (query.rcode) {
+            out.commit(build_error_response(query.id, out.buffer(), query.rcode), client_addr);
+            return true;
+        }
+        return false;  // Malformed, not a query, or not a single question
     }
-    
-    size_t offset = 12;  // Skip header
-    DNSQuestion question;
-    if (!parse_dns_question(data, len, offset, question)) {
-        return;  // Invalid question
+    QUERY_PROBE(parse, query.hash, query.qtype);
+    if (tracer) {
+        trace.parse_ns = QueryTracer::since(start_time);
     }
-    
-    if (question.qtype != 1) {  // Only handle A records
-        auto error_response = build_error_response(header.id, 4);  // NOTIMP
-        sendto(socket_fd, error_response.data(), error_response.size(), 0,
-               reinterpret_cast<const struct sockaddr*>(&client_addr), sizeof(client_addr));
-        return;
+    if (verdict == RateLimiter::Verdict::Slip) {
+        out.commit(build_truncated_response(query.id, query.question(), query.question_len(), out.buffer()), client_addr);
+        trace_reply(trace, start_time, query.hash, query.qtype, TracePath::Limited, 0);
+        return true;
+    }
+    size_t limit = tcp_conn ? ResponseBatch::MAX_RESPONSE : udp_reply_limit(query);
+    uint16_t edns_size = query.edns ? config.edns_udp_size : 0;
+    
+    if (query.edns && query.edns_version != 0) {
+        uint8_t* reply = out.buffer();
+        out.commit(finish_reply(reply, build_error_response(query.id, reply, 0), 0, true, limit, 1),
+                   client_addr);  // BADVERS
+        trace_reply(trace, start_time, query.hash, query.qtype, TracePath::Error, 16);
+        return true;
     }
-    
-    std::string domain = question.qname;
-    std::transform(domain.begin(), domain.end(), domain.begin(), ::tolower);
     
     // FAST PATH 1: Pre-compiled local domain response (target: <50μs)
-    std::vector<uint8_t> response;
-    if (precompiled.get_response(domain, header.id, response)) {
-        sendto(socket_fd, response.data(), response.size(), 0,
-               reinterpret_cast<const struct sockaddr*>(&client_addr), sizeof(client_addr));
-        local_domain_hits.fetch_add(1, std::memory_order_relaxed);
-        
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
-        
-        // Log only if unusually slow for local domain
-        if (duration.count() > 100) {
-            std::cout << "Local domain " << domain << " served in " << duration.count() << "μs" << std::endl;
+    size_t tmpl_len = 0;
+    bool catch_all = false;
+    const PrecompiledResponses* local = precompiled.load(std::memory_order_acquire);
+    if (const uint8_t* tmpl = local->get_response(query, tmpl_len, catch_all)) {
+        QUERY_PROBE(lookup, query.hash, query.qtype, static_cast<int>(TracePath::Local));
+        if (tracer) {
+            trace.lookup_ns = QueryTracer::since(start_time);
         }
-        return;
+        if (response_limiter && !tcp_conn &&
+            (verdict = limit_response(client_addr, question_hash(query.hash, query.qtype), 0, start_time)) !=
+                RateLimiter::Verdict::Allow) {
+            if (verdict == RateLimiter::Verdict::Slip) {
+                out.commit(build_truncated_response(query.id, query.question(), query.question_len(), out.buffer()), client_addr);
+            }
+            trace_reply(trace, start_time, query.hash, query.qtype, TracePath::Limited, 0);
+            return verdict == RateLimiter::Verdict::Slip;
+        }
+        if (!catch_all && tmpl_len + (edns_size ? OPT_RR_SIZE : 0) <= limit) {
+            out.add_template(query.id, tmpl, tmpl_len, client_addr, edns_size);
+        } else {
+            // A catch-all is shared by every type the name lacks, so the
+            // client's QTYPE goes into a copy; oversized answers are copied
+            // to be cut down
+            tmpl_len = std::min(tmpl_len, MAX_TEMPLATE);
+            uint8_t* reply = out.buffer();
+            memcpy(reply, tmpl, tmpl_len);
+            memcpy(reply, &query.id, 2);
+            reply[12 + query.qname_len] = static_cast<uint8_t>(query.qtype >> 8);
+            reply[12 + query.qname_len + 1] = static_cast<uint8_t>(query.qtype);
+            out.commit(finish_reply(reply, tmpl_len, query.question_len(), query.edns, limit), client_addr);
+        }
+        local_domain_hits.fetch_add(1, std::memory_order_relaxed);
+        latency.record(LOCAL_LATENCY, std::chrono::steady_clock::now() - start_time);
+        trace_reply(trace, start_time, query.hash, query.qtype, TracePath::Local, tmpl[3] & 0x0F);
+        return true;
     }
     
     // FAST PATH 2: Cache hit (target: <200μs)
-    std::string cached_ip;
-    if (cache.get(domain, cached_ip)) {
-        auto dns_response = build_dns_response(header.id, question.qname, cached_ip);
-        sendto(socket_fd, dns_response.data(), dns_response.size(), 0,
-               reinterpret_cast<const struct sockaddr*>(&client_addr), sizeof(client_addr));
-        cache_hits.fetch_add(1, std::memory_order_relaxed);
-        
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
-        
-        // Track response times for statistics
-        {
-            std::lock_guard<std::mutex> lock(stats_mutex);
-            response_times.push_back(duration.count() / 1000.0);  // Convert to milliseconds
-            if (response_times.size() > 10000) {
-                response_times.erase(response_times.begin(), response_times.begin() + 5000);  // Keep last 5000
+    CachedAnswer cached;
+    uint8_t* reply = out.buffer();
+    size_t reply_len = 0;
+    if (query.qclass == 1 && cache_lookup(query, cached) &&
+        (reply_len = build_cached_response(query.id, query.question(), query.question_len(), cached, reply))) {
+        QUERY_PROBE(lookup, query.hash, query.qtype, static_cast<int>(TracePath::Cache));
+        if (tracer) {
+            trace.lookup_ns = QueryTracer::since(start_time);
+        }
+        if (response_limiter && !tcp_conn &&
+            (verdict = limit_response(client_addr, question_hash(query.hash, query.qtype), cached.rcode,
+                                      start_time)) != RateLimiter::Verdict::Allow) {
+            if (verdict == RateLimiter::Verdict::Slip) {
+                out.commit(build_truncated_response(query.id, query.question(), query.question_len(), reply), client_addr);
+            }
+            // The hit may have claimed this entry's refresh; left unused,
+            // the claim would shut out every later refresh of it
+            if (cached.refresh) {
+                prefetch(query);
             }
+            trace_reply(trace, start_time, query.hash, query.qtype, TracePath::Limited, 0);
+            return verdict == RateLimiter::Verdict::Slip;
         }
-        
-        return;
+        out.commit(finish_reply(reply, reply_len, query.question_len(), query.edns, limit), client_addr);
+        cache_hits.fetch_add(1, std::memory_order_relaxed);
+        if (cached.refresh) {
+            prefetch(query);
+        }
+        latency.record(CACHE_LATENCY, std::chrono::steady_clock::now() - start_time);
+        trace_reply(trace, start_time, query.hash, query.qtype, TracePath::Cache, cached.rcode);
+        return true;
     }
     
-    // SLOW PATH: Upstream resolution
-    std::string resolved_ip;
-    if (resolve_upstream(domain, resolved_ip)) {
-        cache.set(domain, resolved_ip, 300);  // Cache for 5 minutes
-        auto dns_response = build_dns_response(header.id, question.qname, resolved_ip);
-        sendto(socket_fd, dns_response.data(), dns_response.size(), 0,
-               reinterpret_cast<const struct sockaddr*>(&client_addr), sizeof(client_addr));
-    } else {
-        auto error_response = build_error_response(header.id);
-        sendto(socket_fd, error_response.data(), error_response.size(), 0,
-               reinterpret_cast<const struct sockaddr*>(&client_addr), sizeof(client_addr));
+    // SLOW PATH: Hand the miss to the asynchronous forwarder; the reply goes
+    // out from its I/O thread so this worker keeps serving hits meanwhile.
+    // Its trace record is completed there.
+    QUERY_PROBE(lookup, query.hash, query.qtype, static_cast<int>(TracePath::Upstream));
+    UpstreamQuery upstream_query;
+    upstream_query.client_fd = out.socket();
+    upstream_query.client_addr = client_addr;
+    upstream_query.client_id = query.id;
+    upstream_query.tcp_conn = tcp_conn;
+    upstream_query.edns = query.edns;
+    upstream_query.reply_limit = static_cast<uint32_t>(limit);
+    upstream_query.cache_node = current_node;
+    upstream_query.question.assign(query.question(), query.question() + query.question_len());
+    upstream_query.domain.assign(query.key());
+    upstream_query.qtype = query.qtype;
+    upstream_query.start = start_time;
+    if (tracer) {
+        upstream_query.parse_ns = trace.parse_ns;
+        upstream_query.lookup_ns = trace.lookup_ns = QueryTracer::since(start_time);
     }
     
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-    
-    // Track upstream resolution times
-    {
-        std::lock_guard<std::mutex> lock(stats_mutex);
-        response_times.push_back(duration.count());
-        if (response_times.size() > 10000) {
-            response_times.erase(response_times.begin(), response_times.begin() + 5000);
-        }
+    if (!forwarder || !forwarder->forward(std::move(upstream_query))) {
+        out.commit(finish_reply(reply, build_error_response(query.id, reply), 0, query.edns, limit), client_addr);
+        trace_reply(trace, start_time, query.hash, query.qtype, TracePath::Servfail, 2);
     }
+    return true;
 }
 
-bool DNSServer::parse_dns_header(const uint8_t* data, size_t len, DNSHeader& header) {
-    if (len < 12) {
-        return false;
+void DNSServer::trace_reply(TraceRecord& trace, chrono::steady_clock::time_point start, uint64_t hash, uint16_t qtype,
+                            TracePath path, uint8_t rcode) {
+    QUERY_PROBE(reply, hash, qtype, static_cast<int>(path), rcode);
+    if (!tracer) {
+        return;
     }
-    
-    const uint16_t* ptr = reinterpret_cast<const uint16_t*>(data);
-    header.id = ptr[0];
-    header.flags = ntohs(ptr[1]);
-    header.qdcount = ntohs(ptr[2]);
-    header.ancount = ntohs(ptr[3]);
-    header.nscount = ntohs(ptr[4]);
-    header.arcount = ntohs(ptr[5]);
-    
-    return true;
+    trace.reply_ns = QueryTracer::since(start);
+    trace.start_ns = QueryTracer::to_ns(start);
+    trace.qname_hash = hash;
+    trace.qtype = qtype;
+    trace.path = path;
+    trace.rcode = rcode;
+    tracer->record(trace);
 }
 
-bool DNSServer::parse_dns_question(const uint8_t* data, size_t len, size_t& offset, DNSQuestion& question) {
-    question.qname = parse_domain_name(data, len, offset);
-    if (question.qname.empty() || offset + 4 > len) {
-        return false;
+size_t DNSServer::udp_reply_limit(const QueryView& query) const {
+    // Sizes under 512 are treated as 512 (RFC 6891 6.2.3)
+    if (!query.edns) {
+        return CLASSIC_UDP_SIZE;
     }
-    
-    const uint16_t* ptr = reinterpret_cast<const uint16_t*>(data + offset);
-    question.qtype = ntohs(ptr[0]);
-    question.qclass = ntohs(ptr[1]);
-    offset += 4;
-    
-    return true;
+    return std::max<size_t>(CLASSIC_UDP_SIZE, std::min(query.edns_udp_size, config.edns_udp_size));
 }
 
-std::string DNSServer::parse_domain_name(const uint8_t* data, size_t len, size_t& offset) {
-    std::string result;
-    bool jumped = false;
-    size_t original_offset = offset;
-    
+size_t DNSServer::finish_reply(uint8_t* reply, size_t len, size_t question_len, bool edns, size_t limit,
+                               uint8_t ext_rcode) {
+    size_t opt_len = edns ? OPT_RR_SIZE : 0;
+    if (len + opt_len > limit) {
+        len = 12 + question_len;
+        reply[2] |= 0x02;  // TC
+        memset(reply + 6, 0, 6);
+        truncated_replies.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (edns) {
+        reply[10] = 0;
+        reply[11] = 1;
+        len += write_opt(reply + len, config.edns_udp_size, ext_rcode);
+    }
+    return len;
+}
+
+RateLimiter::Verdict DNSServer::limit_response(const sockaddr_in& client_addr, uint64_t question, uint8_t rcode,
+                                               chrono::steady_clock::time_point now) {
+    uint64_t key = RateLimiter::client_key(client_addr, config.rate_prefix);
+    key ^= rcode == 0 ? question : (uint64_t(rcode) + 1) * 0xC2B2AE3D27D4EB4Full;
+    return response_limiter->check(key, now);
+}
+
+bool DNSServer::cache_lookup(const QueryView& query, CachedAnswer& answer) {
+    FastDNSCache& local = *caches[current_node];
+    if (local.get(query.key(), query.hash, query.qtype, answer)) {
+        return true;
+    }
+    // One remote read, then hits for it stay on this node
+    for (size_t node = 0; node < caches.size(); ++node) {
+        if (node != current_node && local.copy_from(*caches[node], query.key(), query.hash, query.qtype, answer)) {
+            cache_replications.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void DNSServer::prefetch(const QueryView& query) {
+    // A waiter with no client: the reply only refreshes the cache, and real
+    // misses for the same question coalesce onto it. If it cannot be sent
+    // the claim is given back; if it fails the entry simply runs out its TTL.
+    UpstreamQuery refresh;
+    refresh.question.assign(query.question(), query.question() + query.question_len());
+    refresh.domain.assign(query.key());
+    refresh.qtype = query.qtype;
+    refresh.cache_node = current_node;
+    refresh.start = std::chrono::steady_clock::now();
+    if (forwarder && forwarder->forward(std::move(refresh))) {
+        prefetches.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        caches[current_node]->release_refresh(query.key(), query.hash, query.qtype);
+    }
+}
+
+// Skips one possibly-compressed name without decoding it
+static bool skip_name(const uint8_t* data, size_t len, size_t& offset) {
     while (offset < len) {
         uint8_t label_len = data[offset];
-        
         if (label_len == 0) {
             offset++;
-            break;
+            return true;
+        }
+        if ((label_len & 0xC0) == 0xC0) {
+            offset += 2;
+            return offset <= len;
+        }
+        offset += 1 + label_len;
+    }
+    return false;
+}
+
+static uint32_t read_u32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return ntohl(value);
+}
+
+static void write_u32(uint8_t* p, uint32_t value) {
+    value = htonl(value);
+    memcpy(p, &value, 4);
+}
+
+// Walks count resource records from offset, calling visit(rr, rdlength)
+// with rr at each record's TYPE field once the record is known to fit
+template <typename Visit>
+static bool walk_records(uint8_t* data, size_t len, size_t& offset, size_t count, Visit&& visit) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!skip_name(data, len, offset) || offset + 10 > len) {
+            return false;
         }
         
-        if ((label_len & 0xC0) == 0xC0) {  // Compression pointer
-            if (!jumped) {
-                original_offset = offset + 2;
-                jumped = true;
-            }
-            offset = ((label_len & 0x3F) << 8) | data[offset + 1];
+        uint16_t rdlength = (data[offset + 8] << 8) | data[offset + 9];
+        if (offset + 10 + rdlength > len) {
+            return false;
+        }
+        visit(data + offset, rdlength);
+        offset += 10 + rdlength;
+    }
+    return true;
+}
+
+void DNSServer::on_upstream_reply(const std::vector<UpstreamQuery>& waiters, const uint8_t* reply, size_t len) {
+    uint8_t response[UpstreamForwarder::MAX_REPLY + OPT_RR_SIZE];
+    size_t body_len = 0;  // header through the authority section; 0 answers SERVFAIL
+    CachedAnswer answer;
+    uint32_t ttl = 0;
+    const auto& first = waiters.front();
+    uint64_t name_hash = hash_wire_name(first.domain);
+    bool answered = reply && extract_answer(reply, len, answer, ttl);
+    
+    // Into the cache of every node a waiter came from; other nodes copy it
+    // on their first hit
+    vector<bool> nodes(caches.size());
+    for (const auto& query : waiters) {
+        nodes[query.cache_node < caches.size() ? query.cache_node : 0] = true;
+    }
+    for (size_t node = 0; node < caches.size(); ++node) {
+        if (!nodes[node]) {
             continue;
         }
-        
-        if (offset + 1 + label_len > len) {
-            return "";  // Invalid
+        if (answered) {
+            caches[node]->set(first.domain, name_hash, first.qtype, answer, ttl);
+        } else {
+            // A failed refresh leaves the old entry (still served if stale)
+            // open to another attempt
+            caches[node]->release_refresh(first.domain, name_hash, first.qtype);
         }
-        
-        if (!result.empty()) {
-            result += ".";
+    }
+    if (reply && len <= UpstreamForwarder::MAX_REPLY) {
+        // Relayed like a cache hit, without the additional section: the
+        // upstream's OPT record is not the client's, and each client gets
+        // its own below
+        memcpy(response, reply, len);
+        DNSHeader header;
+        size_t offset = 12;
+        if (parse_dns_header(response, len, header) && header.qdcount == 1 && skip_name(response, len, offset) &&
+            offset + 4 <= len &&
+            walk_records(response, len, offset += 4, header.ancount + header.nscount, [](uint8_t*, uint16_t) {})) {
+            response[10] = 0;
+            response[11] = 0;
+            body_len = offset;
         }
-        
-        result.append(reinterpret_cast<const char*>(data + offset + 1), label_len);
-        offset += 1 + label_len;
     }
     
-    if (jumped) {
-        offset = original_offset;
-    }
+    auto end_time = std::chrono::steady_clock::now();
+    uint8_t short_reply[12 + MAX_WIRE_NAME + 4 + OPT_RR_SIZE];  // errors and truncated replies
     
-    return result;
+    uint8_t reply_rcode = body_len ? response[3] & 0x0F : 2;
+    // There is no TCP path to upstreams, so a TCP client that got TC back
+    // would ask again and never see the full answer; it gets SERVFAIL
+    bool truncated = body_len && (response[2] & 0x02);
+    for (const auto& query : waiters) {
+        if (query.client_fd < 0 && query.tcp_conn == 0) {
+            continue;  // Refresh-ahead lookup
+        }
+        QUERY_PROBE(upstream, name_hash, query.qtype, reply_rcode);
+        TraceRecord trace{};
+        if (tracer) {
+            trace.parse_ns = query.parse_ns;
+            trace.lookup_ns = query.lookup_ns;
+            trace.upstream_ns = QueryTracer::since(query.start);
+        }
+        uint8_t* out = short_reply;
+        size_t out_len = 0;
+        size_t question_len = query.question.size();
+        RateLimiter::Verdict verdict = RateLimiter::Verdict::Allow;
+        if (response_limiter && query.tcp_conn == 0) {
+            verdict = limit_response(query.client_addr, question_hash(name_hash, query.qtype), reply_rcode, end_time);
+            if (verdict == RateLimiter::Verdict::Drop) {
+                trace_reply(trace, query.start, name_hash, query.qtype, TracePath::Limited, 0);
+                continue;
+            }
+        }
+        bool servfail = !body_len || 12 + question_len > body_len || (truncated && query.tcp_conn);
+        if (verdict == RateLimiter::Verdict::Slip) {
+            out_len = build_truncated_response(query.client_id, query.question.data(), question_len, short_reply);
+        } else if (!servfail) {
+            // Relay the upstream answer under each client's own transaction ID
+            // and question spelling (case may differ between coalesced clients).
+            // One that will not fit is cut down in a copy of its header and
+            // question, leaving the shared body intact for the other waiters.
+            response[10] = 0;
+            response[11] = 0;
+            *reinterpret_cast<uint16_t*>(response) = query.client_id;
+            memcpy(response + 12, query.question.data(), question_len);
+            if (body_len + (query.edns ? OPT_RR_SIZE : 0) <= query.reply_limit) {
+                out = response;
+            } else {
+                memcpy(short_reply, response, 12 + question_len);
+            }
+            out_len = finish_reply(out, body_len, question_len, query.edns, query.reply_limit);
+        } else {
+            out_len = finish_reply(short_reply, build_error_response(query.client_id, short_reply), 0, query.edns,
+                                   query.reply_limit);
+        }
+        
+        if (query.tcp_conn) {
+            if (tcp) {
+                tcp->deliver(query.tcp_conn, out, out_len);
+            }
+        } else if (sendto(query.client_fd, out, out_len, 0,
+                          reinterpret_cast<const struct sockaddr*>(&query.client_addr), sizeof(query.client_addr)) < 0) {
+            send_failures.fetch_add(1, std::memory_order_relaxed);
+        }
+        latency.record(UPSTREAM_LATENCY, end_time - query.start);
+        if (verdict == RateLimiter::Verdict::Slip) {
+            trace_reply(trace, query.start, name_hash, query.qtype, TracePath::Limited, reply_rcode);
+        } else if (servfail) {
+            trace_reply(trace, query.start, name_hash, query.qtype, TracePath::Servfail, 2);
+        } else {
+            trace_reply(trace, query.start, name_hash, query.qtype, TracePath::Upstream, reply_rcode);
+        }
+    }
 }
 
-std::vector<uint8_t> DNSServer::build_dns_response(uint16_t query_id, const std::string& domain, const std::string& ip) {
-    std::vector<uint8_t> response;
+bool DNSServer::extract_answer(const uint8_t* data, size_t len, CachedAnswer& answer, uint32_t& ttl) {
+    DNSHeader header;
+    if (!parse_dns_header(data, len, header) || header.qdcount != 1) {
+        return false;
+    }
     
-    // DNS Header
-    response.resize(12);
-    uint16_t* header = reinterpret_cast<uint16_t*>(response.data());
-    header[0] = query_id;
-    header[1] = htons(0x8180);  // Standard response flags
-    header[2] = htons(1);  // 1 question
-    header[3] = htons(1);  // 1 answer
-    header[4] = htons(0);  // 0 authority
-    header[5] = htons(0);  // 0 additional
+    uint8_t rcode = header.flags & 0x000F;
+    if ((rcode != 0 && rcode != 3) || (header.flags & 0x0200)) {
+        return false;  // Errors and truncated replies are not cached
+    }
     
-    // Question section
-    encode_domain_name(domain, response);
-    uint16_t qtype = htons(1);   // A record
-    uint16_t qclass = htons(1);  // IN class
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&qtype), reinterpret_cast<uint8_t*>(&qtype) + 2);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&qclass), reinterpret_cast<uint8_t*>(&qclass) + 2);
+    // Lookups only serve class IN and the key has no class, so an answer
+    // of any other class (CH version.bind) must not be stored under it
+    size_t offset = 12;
+    if (!skip_name(data, len, offset) || offset + 4 > len || ((data[offset + 2] << 8) | data[offset + 3]) != 1) {
+        return false;
+    }
+    offset += 4;
     
-    // Answer section (compression pointer)
-    response.push_back(0xC0);
-    response.push_back(0x0C);
+    // Keep answer + authority; compression pointers into them stay valid
+    // because every cached hit is rebuilt with the same question length.
+    // No served record may outlive its own TTL, so the entry gets the
+    // smallest of them.
+    uint8_t* records = const_cast<uint8_t*>(data);
+    size_t start = offset;
+    uint32_t min_ttl = UINT32_MAX;
+    auto track_ttl = [&](const uint8_t* rr, uint16_t) { min_ttl = min(min_ttl, read_u32(rr + 4)); };
+    if (!walk_records(records, len, offset, header.ancount, track_ttl)) {
+        return false;
+    }
     
-    uint16_t atype = htons(1);
-    uint16_t aclass = htons(1);
-    uint32_t ttl = htonl(300);
-    uint16_t rdlength = htons(4);
+    // NXDOMAIN and NODATA are cached only with the zone's SOA, for the
+    // lower of its TTL and its MINIMUM field (RFC 2308 section 5)
+    bool negative = rcode == 3 || header.ancount == 0;
+    bool have_soa = false;
+    if (!walk_records(records, len, offset, header.nscount, [&](const uint8_t* rr, uint16_t rdlength) {
+            track_ttl(rr, rdlength);
+            if (negative && ((rr[0] << 8) | rr[1]) == 6 && rdlength >= 22) {
+                min_ttl = min(min_ttl, read_u32(rr + 10 + rdlength - 4));
+                have_soa = true;
+            }
+        })) {
+        return false;
+    }
+    if ((negative && !have_soa) || offset - start > sizeof(answer.data)) {
+        return false;
+    }
     
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&atype), reinterpret_cast<uint8_t*>(&atype) + 2);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&aclass), reinterpret_cast<uint8_t*>(&aclass) + 2);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&ttl), reinterpret_cast<uint8_t*>(&ttl) + 4);
-    response.insert(response.end(), reinterpret_cast<uint8_t*>(&rdlength), reinterpret_cast<uint8_t*>(&rdlength) + 2);
+    ttl = min(min_ttl, negative ? config.negative_max_ttl : config.cache_max_ttl);
+    if (ttl == 0) {
+        return false;  // Zero TTL means use once, never cache
+    }
     
-    // IP address
-    struct in_addr addr;
-    if (inet_aton(ip.c_str(), &addr)) {
-        response.insert(response.end(), reinterpret_cast<uint8_t*>(&addr), reinterpret_cast<uint8_t*>(&addr) + 4);
+    memcpy(answer.data, data + start, offset - start);
+    answer.len = static_cast<uint16_t>(offset - start);
+    answer.ancount = header.ancount;
+    answer.nscount = header.nscount;
+    answer.rcode = rcode;
+    
+    // Stored records never claim more than the entry lives, which also
+    // gives a negative answer's SOA its negative TTL (RFC 2308 section 3)
+    size_t stored = 0;
+    return walk_records(answer.data, answer.len, stored, answer.ancount + answer.nscount, [&](uint8_t* rr, uint16_t) {
+        write_u32(rr + 4, min(read_u32(rr + 4), ttl));
+    });
+}
+
+bool DNSServer::parse_dns_header(const uint8_t* data, size_t len, DNSHeader& header) {
+    if (len < 12) {
+        return false;
     }
     
-    return response;
+    const uint16_t* ptr = reinterpret_cast<const uint16_t*>(data);
+    header.id = ptr[0];
+    header.flags = ntohs(ptr[1]);
+    header.qdcount = ntohs(ptr[2]);
+    header.ancount = ntohs(ptr[3]);
+    header.nscount = ntohs(ptr[4]);
+    header.arcount = ntohs(ptr[5]);
+    
+    return true;
 }
 
-std::vector<uint8_t> DNSServer::build_error_response(uint16_t query_id, uint16_t rcode) {
-    std::vector<uint8_t> response(12);
-    uint16_t* header = reinterpret_cast<uint16_t*>(response.data());
+size_t DNSServer::build_cached_response(uint16_t query_id, const uint8_t* question, size_t question_len,
+                                        const CachedAnswer& answer, uint8_t* out) {
+    size_t len = 12 + question_len + answer.len;
+    if (len > ResponseBatch::MAX_RESPONSE) {
+        return 0;
+    }
+    
+    uint16_t* header = reinterpret_cast<uint16_t*>(out);
+    header[0] = query_id;
+    header[1] = htons(0x8180 | answer.rcode);
+    header[2] = htons(1);
+    header[3] = htons(answer.ancount);
+    header[4] = htons(answer.nscount);
+    header[5] = htons(0);
+    
+    // The client's question, byte for byte, keeps its case and the offsets
+    // the cached records' compression pointers were written against
+    memcpy(out + 12, question, question_len);
+    memcpy(out + 12 + question_len, answer.data, answer.len);
+    
+    // TTLs count down by the entry's age; stale answers carry at most
+    // STALE_TTL so clients come back soon for the refreshed copy
+    size_t offset = 12 + question_len;
+    return walk_records(out, len, offset, answer.ancount + answer.nscount, [&](uint8_t* rr, uint16_t) {
+        uint32_t ttl = read_u32(rr + 4);
+        write_u32(rr + 4, answer.stale ? min(ttl, CachedAnswer::STALE_TTL) : ttl > answer.age ? ttl - answer.age : 0);
+    }) ? len : 0;
+}
+
+size_t DNSServer::build_truncated_response(uint16_t query_id, const uint8_t* question, size_t question_len,
+                                           uint8_t* out) {
+    build_error_response(query_id, out, 0);
+    out[2] |= 0x02;  // TC
+    out[5] = 1;      // the question, so the client can match it
+    memcpy(out + 12, question, question_len);
+    return 12 + question_len;
+}
+
+size_t DNSServer::build_error_response(uint16_t query_id, uint8_t* out, uint16_t rcode) {
+    uint16_t* header = reinterpret_cast<uint16_t*>(out);
     
     header[0] = query_id;
     header[1] = htons(0x8180 | rcode);  // Error response
@@ -447,76 +1806,261 @@ std::vector<uint8_t> DNSServer::build_error_response(uint16_t query_id, uint16_t
     header[4] = htons(0);  // 0 authority
     header[5] = htons(0);  // 0 additional
     
-    return response;
+    return 12;
 }
 
-void DNSServer::encode_domain_name(const std::string& domain, std::vector<uint8_t>& buffer) {
-    std::istringstream iss(domain);
-    std::string label;
-    
-    while (std::getline(iss, label, '.')) {
-        buffer.push_back(static_cast<uint8_t>(label.length()));
-        buffer.insert(buffer.end(), label.begin(), label.end());
-    }
-    buffer.push_back(0);  // End of domain name
+static DNSServer::LatencySummary summarize(const LatencyHistogram& histogram) {
+    constexpr double NS_PER_MS = 1e6;
+    DNSServer::LatencySummary summary;
+    summary.count = histogram.total;
+    summary.avg_ms = histogram.mean_ns() / NS_PER_MS;
+    summary.p50_ms = histogram.percentile_ns(0.50) / NS_PER_MS;
+    summary.p95_ms = histogram.percentile_ns(0.95) / NS_PER_MS;
+    summary.p99_ms = histogram.percentile_ns(0.99) / NS_PER_MS;
+    summary.max_ms = histogram.max_ns() / NS_PER_MS;
+    return summary;
 }
 
-bool DNSServer::resolve_upstream(const std::string& domain, std::string& ip) {
-    // Simple upstream resolution using system resolver
-    struct addrinfo hints, *result;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;  // IPv4 only
-    hints.ai_socktype = SOCK_DGRAM;
-    
-    int status = getaddrinfo(domain.c_str(), nullptr, &hints, &result);
-    if (status != 0) {
-        return false;
-    }
-    
-    if (result && result->ai_family == AF_INET) {
-        struct sockaddr_in* addr_in = (struct sockaddr_in*)result->ai_addr;
-        char ip_str[INET_ADDRSTRLEN];
-        if (inet_ntop(AF_INET, &(addr_in->sin_addr), ip_str, INET_ADDRSTRLEN)) {
-            ip = std::string(ip_str);
-            freeaddrinfo(result);
-            return true;
-        }
+FastDNSCache::Stats DNSServer::get_cache_stats() const {
+    FastDNSCache::Stats total;
+    for (const auto& cache : caches) {
+        FastDNSCache::Stats stats = cache->get_stats();
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.evictions += stats.evictions;
+        total.rejections += stats.rejections;
+        total.lock_waits += stats.lock_waits;
+        total.uncacheable += stats.uncacheable;
+        total.size += stats.size;
+        total.capacity += stats.capacity;
+        total.shards += stats.shards;
     }
-    
-    freeaddrinfo(result);
-    return false;
+    return total;
 }
 
 DNSServer::PerformanceStats DNSServer::get_performance_stats() const {
-    PerformanceStats stats;
+    PerformanceStats stats{};
     
     stats.total_queries = total_queries.load(std::memory_order_relaxed);
     stats.cache_hits = cache_hits.load(std::memory_order_relaxed);
     stats.local_domain_hits = local_domain_hits.load(std::memory_order_relaxed);
+    stats.coalesced_queries = forwarder ? forwarder->coalesced() : 0;
+    stats.prefetches = prefetches.load(std::memory_order_relaxed);
     
     if (stats.total_queries > 0) {
         stats.cache_hit_ratio = static_cast<double>(stats.cache_hits + stats.local_domain_hits) / stats.total_queries;
     }
     
-    {
-        std::lock_guard<std::mutex> lock(stats_mutex);
-        if (!response_times.empty()) {
-            auto sorted_times = response_times;
-            std::sort(sorted_times.begin(), sorted_times.end());
-            
-            double sum = 0;
-            for (double time : sorted_times) {
-                sum += time;
+    // Per-thread histograms are merged here, on the reader's time
+    LatencyHistogram all;
+    LatencySummary* summaries[LATENCY_SERIES] = {&stats.local, &stats.cached, &stats.upstream};
+    for (size_t series = 0; series < LATENCY_SERIES; ++series) {
+        LatencyHistogram histogram = latency.snapshot(series);
+        *summaries[series] = summarize(histogram);
+        all.merge(histogram);
+    }
+    LatencySummary overall = summarize(all);
+    stats.avg_response_time_ms = overall.avg_ms;
+    stats.p95_response_time_ms = overall.p95_ms;
+    stats.p99_response_time_ms = overall.p99_ms;
+    
+    return stats;
+}
+
+// Prometheus histogram buckets, in seconds. Each LatencyHistogram bucket is
+// counted under the first bound at or above its upper edge, so a bound is
+// off by at most one fine bucket (about 3%).
+static const double LATENCY_BOUNDS[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+    1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0,
+};
+
+static void write_histogram(ostringstream& out, const char* name, const string& labels,
+                            const LatencyHistogram& histogram) {
+    string prefix = labels.empty() ? "{" : "{" + labels + ",";
+    size_t bucket = 0;
+    uint64_t cumulative = 0;
+    for (double bound : LATENCY_BOUNDS) {
+        uint64_t bound_ns = static_cast<uint64_t>(bound * 1e9);
+        while (bucket < LatencyHistogram::NUM_BUCKETS &&
+               LatencyHistogram::bucket_lower(bucket) + LatencyHistogram::bucket_width(bucket) - 1 <= bound_ns) {
+            cumulative += histogram.counts[bucket++];
+        }
+        out << name << "_bucket" << prefix << "le=\"" << bound << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket" << prefix << "le=\"+Inf\"} " << histogram.total << "\n";
+    string suffix = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << suffix << " " << histogram.sum_ns / 1e9 << "\n";
+    out << name << "_count" << suffix << " " << histogram.total << "\n";
+}
+
+static void write_header(ostringstream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+string DNSServer::render_metrics() const {
+    ostringstream out;
+    
+    write_header(out, "dns_queries_total", "counter", "Queries received, including malformed ones.");
+    out << "dns_queries_total " << total_queries.load(std::memory_order_relaxed) << "\n";
+    
+    static const char* const path_names[LATENCY_SERIES] = {"local", "cache", "upstream"};
+    write_header(out, "dns_response_seconds", "histogram", "Time from receipt to reply, by answering path.");
+    for (size_t series = 0; series < LATENCY_SERIES; ++series) {
+        write_histogram(out, "dns_response_seconds", string("path=\"") + path_names[series] + "\"",
+                        latency.snapshot(series));
+    }
+    
+    write_header(out, "dns_dropped_total", "counter", "Queries or replies lost, by reason.");
+    out << "dns_dropped_total{reason=\"malformed\"} " << malformed_queries.load(std::memory_order_relaxed) << "\n";
+    out << "dns_dropped_total{reason=\"oversized\"} " << oversized_queries.load(std::memory_order_relaxed) << "\n";
+    out << "dns_dropped_total{reason=\"send_failed\"} " << send_failures.load(std::memory_order_relaxed) << "\n";
+    
+    // Receive-queue overflows happen in the kernel before a worker ever
+    // sees the datagram; SO_MEMINFO reports them per socket without locks
+    uint64_t socket_drops = 0;
+    for (int fd : socket_fds) {
+        uint32_t meminfo[SK_MEMINFO_VARS] = {};
+        socklen_t size = sizeof(meminfo);
+        if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &size) == 0) {
+            socket_drops += meminfo[SK_MEMINFO_DROPS];
+        }
+    }
+    out << "dns_dropped_total{reason=\"socket_overflow\"} " << socket_drops << "\n";
+    
+    write_header(out, "dns_local_names", "gauge", "Names in the local table.");
+    out << "dns_local_names " << local_names.load(std::memory_order_relaxed) << "\n";
+    write_header(out, "dns_prefetches_total", "counter", "Refresh-ahead and serve-stale lookups sent upstream.");
+    out << "dns_prefetches_total " << prefetches.load(std::memory_order_relaxed) << "\n";
+    write_header(out, "dns_truncated_replies_total", "counter", "Replies cut to the question with TC set, over the client's UDP size.");
+    out << "dns_truncated_replies_total " << truncated_replies.load(std::memory_order_relaxed) << "\n";
+    
+    if (client_limiter || response_limiter) {
+        write_header(out, "dns_rate_limited_total", "counter", "UDP queries over a rate limit, by limit and action.");
+        const pair<const char*, const RateLimiter*> limiters[] = {{"client", client_limiter.get()},
+                                                                  {"response", response_limiter.get()}};
+        for (const auto& [name, limiter] : limiters) {
+            if (limiter) {
+                RateLimiter::Stats stats = limiter->get_stats();
+                out << "dns_rate_limited_total{limit=\"" << name << "\",action=\"drop\"} " << stats.dropped << "\n";
+                out << "dns_rate_limited_total{limit=\"" << name << "\",action=\"slip\"} " << stats.slipped << "\n";
             }
-            stats.avg_response_time_ms = sum / sorted_times.size();
-            
-            size_t p95_idx = static_cast<size_t>(sorted_times.size() * 0.95);
-            size_t p99_idx = static_cast<size_t>(sorted_times.size() * 0.99);
-            
-            stats.p95_response_time_ms = sorted_times[std::min(p95_idx, sorted_times.size() - 1)];
-            stats.p99_response_time_ms = sorted_times[std::min(p99_idx, sorted_times.size() - 1)];
         }
     }
     
-    return stats;
+    if (tcp) {
+        TcpServer::Stats tcp_stats = tcp->get_stats();
+        write_header(out, "dns_tcp_connections_open", "gauge", "TCP connections currently open.");
+        out << "dns_tcp_connections_open " << tcp_stats.open << "\n";
+        write_header(out, "dns_tcp_connections_total", "counter", "TCP connections, by outcome.");
+        out << "dns_tcp_connections_total{outcome=\"accepted\"} " << tcp_stats.accepted << "\n";
+        out << "dns_tcp_connections_total{outcome=\"rejected\"} " << tcp_stats.rejected << "\n";
+        out << "dns_tcp_connections_total{outcome=\"idle_closed\"} " << tcp_stats.idle_closed << "\n";
+        write_header(out, "dns_tcp_queries_total", "counter", "Messages read from TCP connections.");
+        out << "dns_tcp_queries_total " << tcp_stats.queries << "\n";
+    }
+    
+    if (tracer) {
+        QueryTracer::Stats trace_stats = tracer->get_stats();
+        write_header(out, "dns_trace_records_total", "counter", "Query trace records, by outcome.");
+        out << "dns_trace_records_total{outcome=\"recorded\"} " << trace_stats.recorded << "\n";
+        out << "dns_trace_records_total{outcome=\"dropped\"} " << trace_stats.dropped << "\n";
+        out << "dns_trace_records_total{outcome=\"written\"} " << trace_stats.written << "\n";
+        write_header(out, "dns_slow_queries_total", "counter", "Queries answered at or over the slow-query threshold.");
+        out << "dns_slow_queries_total " << trace_stats.slow << "\n";
+    }
+    
+    // Per-node caches add a node label to every shard series
+    vector<pair<string, vector<FastDNSCache::Stats>>> shard_stats;
+    size_t cache_capacity = 0;
+    for (size_t node = 0; node < caches.size(); ++node) {
+        string label = caches.size() > 1 ? "node=\"" + to_string(node) + "\"," : "";
+        shard_stats.emplace_back(label, caches[node]->get_shard_stats());
+        cache_capacity += caches[node]->capacity();
+    }
+    struct ShardSeries {
+        const char* name;
+        const char* type;
+        const char* help;
+        uint64_t FastDNSCache::Stats::*field;
+    };
+    static const ShardSeries shard_series[] = {
+        {"dns_cache_hits_total", "counter", "Cache hits per shard.", &FastDNSCache::Stats::hits},
+        {"dns_cache_misses_total", "counter", "Cache misses per shard.", &FastDNSCache::Stats::misses},
+        {"dns_cache_evictions_total", "counter", "Live entries evicted for space per shard.", &FastDNSCache::Stats::evictions},
+        {"dns_cache_admission_rejections_total", "counter", "Evictions where TinyLFU kept the incumbent over the window entry, per shard.", &FastDNSCache::Stats::rejections},
+        {"dns_cache_lock_waits_total", "counter", "Shard lock acquisitions that had to wait.", &FastDNSCache::Stats::lock_waits},
+    };
+    for (const auto& series : shard_series) {
+        write_header(out, series.name, series.type, series.help);
+        for (const auto& [label, shards] : shard_stats) {
+            for (size_t i = 0; i < shards.size(); ++i) {
+                out << series.name << "{" << label << "shard=\"" << i << "\"} " << shards[i].*series.field << "\n";
+            }
+        }
+    }
+    write_header(out, "dns_cache_entries", "gauge", "Occupied cache slots per shard.");
+    for (const auto& [label, shards] : shard_stats) {
+        for (size_t i = 0; i < shards.size(); ++i) {
+            out << "dns_cache_entries{" << label << "shard=\"" << i << "\"} " << shards[i].size << "\n";
+        }
+    }
+    write_header(out, "dns_cache_capacity", "gauge", "Cache slots across all shards (and nodes).");
+    out << "dns_cache_capacity " << cache_capacity << "\n";
+    write_header(out, "dns_cache_uncacheable_total", "counter", "Answers never cached: name over 204 wire bytes, or answer over 4 KB.");
+    out << "dns_cache_uncacheable_total " << get_cache_stats().uncacheable << "\n";
+    if (caches.size() > 1) {
+        write_header(out, "dns_cache_replications_total", "counter", "Answers copied from another NUMA node's cache on a local miss.");
+        out << "dns_cache_replications_total " << cache_replications.load(std::memory_order_relaxed) << "\n";
+    }
+    
+    if (forwarder) {
+        write_header(out, "dns_upstream_coalesced_total", "counter", "Misses that joined an identical in-flight lookup.");
+        out << "dns_upstream_coalesced_total " << forwarder->coalesced() << "\n";
+        
+        auto upstreams = forwarder->upstream_stats();
+        struct UpstreamSeries {
+            const char* name;
+            const char* help;
+            uint64_t UpstreamForwarder::UpstreamStats::*field;
+        };
+        static const UpstreamSeries upstream_series[] = {
+            {"dns_upstream_queries_total", "Queries sent per upstream, retries included.",
+             &UpstreamForwarder::UpstreamStats::queries},
+            {"dns_upstream_replies_total", "Matched replies per upstream.", &UpstreamForwarder::UpstreamStats::replies},
+            {"dns_upstream_timeouts_total", "Attempts that timed out per upstream.",
+             &UpstreamForwarder::UpstreamStats::timeouts},
+            {"dns_upstream_send_errors_total", "Sends that failed per upstream.",
+             &UpstreamForwarder::UpstreamStats::send_errors},
+        };
+        for (const auto& series : upstream_series) {
+            write_header(out, series.name, "counter", series.help);
+            for (const auto& upstream : upstreams) {
+                out << series.name << "{upstream=\"" << upstream.address << "\"} " << upstream.*series.field << "\n";
+            }
+        }
+        write_header(out, "dns_upstream_srtt_seconds", "gauge", "Smoothed round trip per upstream, used to pick one.");
+        for (const auto& upstream : upstreams) {
+            out << "dns_upstream_srtt_seconds{upstream=\"" << upstream.address << "\"} " << upstream.srtt_seconds << "\n";
+        }
+        write_header(out, "dns_upstream_failure_rate", "gauge", "Recent share of attempts that failed, per upstream.");
+        for (const auto& upstream : upstreams) {
+            out << "dns_upstream_failure_rate{upstream=\"" << upstream.address << "\"} " << upstream.failure_rate << "\n";
+        }
+        write_header(out, "dns_upstream_backed_off", "gauge", "1 while an upstream sits out after consecutive failures.");
+        for (const auto& upstream : upstreams) {
+            out << "dns_upstream_backed_off{upstream=\"" << upstream.address << "\"} " << (upstream.backed_off ? 1 : 0)
+                << "\n";
+        }
+        write_header(out, "dns_upstream_hedges_total", "counter", "Lookups duplicated to a second upstream.");
+        out << "dns_upstream_hedges_total " << forwarder->hedges() << "\n";
+        write_header(out, "dns_upstream_hedge_wins_total", "counter", "Hedged lookups answered by the second upstream.");
+        out << "dns_upstream_hedge_wins_total " << forwarder->hedge_wins() << "\n";
+        write_header(out, "dns_upstream_rtt_seconds", "histogram", "Round trip from send to matched reply, per upstream.");
+        for (const auto& upstream : upstreams) {
+            write_histogram(out, "dns_upstream_rtt_seconds", "upstream=\"" + upstream.address + "\"", upstream.rtt);
+        }
+    }
+    
+    return out.str();
 }
@@ -11,12 +11,22 @@
 #include <chrono>
 #include <array>
 #include <sstream>
-#include <list>
+#include <queue>
+#include <functional>
+#include <stdexcept>
+#include <string_view>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <netdb.h>
 #include <cstring>
+#include "dns_wire.h"
+#include "zone_file.h"
+#include "qsbr.h"
+#include "latency_histogram.h"
+#include "frequency_sketch.h"
+#include "cpu_topology.h"
+#include "rate_limiter.h"
+#include "query_trace.h"
 
 using namespace std;
 
@@ -44,179 +54,781 @@ struct DNSAnswer {
     string rdata;
 };
 
-struct CacheEntry {
-    string ip;
+// Time as the cache sees it. cache_sim builds the cache with
+// CACHE_SIM_CLOCK, so each replay thread drives expiry from its log's
+// timestamps instead of the wall clock.
+struct CacheClock {
+    using time_point = chrono::steady_clock::time_point;
+#ifdef CACHE_SIM_CLOCK
+    static time_point now() { return current(); }
+    static void set(time_point t) { current() = t; }
+    
+private:
+    static time_point& current() {
+        thread_local time_point t;
+        return t;
+    }
+#else
+    static time_point now() { return chrono::steady_clock::now(); }
+#endif
+};
+
+// A cached answer in wire format: the answer and authority sections exactly
+// as they followed the question in the upstream reply. Compression pointers
+// in them refer to the question at offset 12, which has the same layout in
+// every query for this name, so a hit only needs a header, the client's own
+// question and TTLs lowered by the entry's age.
+struct CachedAnswer {
+    static constexpr size_t MAX_SIZE = 4096;   // the forwarder's EDNS buffer; larger replies are relayed uncached
+    static constexpr uint32_t STALE_TTL = 30;  // TTL on stale answers, as RFC 8767 recommends
+    
+    uint8_t data[MAX_SIZE];
+    uint16_t len = 0;
+    uint16_t ancount = 0;
+    uint16_t nscount = 0;
+    uint8_t rcode = 0;
+    uint32_t age = 0;       // seconds since stored; filled in by FastDNSCache::get
+    bool refresh = false;   // set by get() for the one caller that should refresh it ahead of expiry
+    bool stale = false;     // past its TTL, served within the serve-stale window
+};
+
+// One slot of a cache shard's flat table. Key and answer are stored inline
+// in one payload area, so inserts never allocate. An answer too long to
+// share it with the key (large RRsets, CNAME chains) goes to an overflow
+// block the slot allocates the first time and keeps until the cache is
+// destroyed, so a lock-free reader never follows a freed pointer.
+struct alignas(64) CacheEntry {
+    // Key + answer, when the answer fits. Keys always live here, so names
+    // longer than this (in wire format, up to 255) are never cached
+    static constexpr size_t PAYLOAD_SIZE = 204;
+    static constexpr uint32_t MAX_HITS = 65535;    // saturates so hot entries stop writing it
+    
+    uint32_t tag = 0;               // upper hash bits, 0 marks an empty slot
+    uint32_t generation = 0;        // bumped per insert, validates expiry heap nodes
+    atomic<uint32_t> seq{0};        // seqlock: odd while a writer is changing the slot
+    atomic<uint32_t> hits{0};       // since stored, halved when the shard's sketch ages
     chrono::steady_clock::time_point expiry;
-    atomic<uint32_t> hits{0};
+    chrono::steady_clock::time_point stored;
+    uint8_t* overflow = nullptr;    // CachedAnswer::MAX_SIZE bytes, or null
+    uint16_t qtype = 0;
+    uint16_t answer_len = 0;
+    uint16_t ancount = 0;
+    uint16_t nscount = 0;
+    uint8_t key_len = 0;
+    uint8_t rcode = 0;
+    atomic<bool> referenced{false}; // CLOCK second-chance bit, set on hit
+    atomic<bool> refresh_pending{false};  // refresh-ahead claimed; cleared when the answer is rewritten
+    uint8_t payload[PAYLOAD_SIZE];  // key_len bytes of name, then answer_len bytes of RRs if they fit
     
-    CacheEntry() = default;
-    CacheEntry(const string& ip_addr, uint32_t ttl_seconds) 
-        : ip(ip_addr), expiry(chrono::steady_clock::now() + chrono::seconds(ttl_seconds)) {}
+    ~CacheEntry() { delete[] overflow; }
     
-    CacheEntry(const CacheEntry& other) 
-        : ip(other.ip), expiry(other.expiry), hits(other.hits.load()) {}
+    static bool fits_inline(size_t key_size, size_t answer_size) { return key_size + answer_size <= PAYLOAD_SIZE; }
+    const uint8_t* answer_data() const { return fits_inline(key_len, answer_len) ? payload + key_len : overflow; }
     
-    CacheEntry& operator=(const CacheEntry& other) {
-        if (this != &other) {
-            ip = other.ip;
-            expiry = other.expiry;
-            hits.store(other.hits.load());
-        }
-        return *this;
+    bool occupied() const { return tag != 0; }
+    
+    bool matches(uint32_t t, string_view key, uint16_t type) const {
+        return tag == t && qtype == type && key_len == key.size() &&
+               memcmp(payload, key.data(), key.size()) == 0;
     }
     
-    CacheEntry(CacheEntry&& other) noexcept
-        : ip(move(other.ip)), expiry(other.expiry), hits(other.hits.load()) {}
+    bool is_valid() const {
+        return CacheClock::now() < expiry;
+    }
     
-    CacheEntry& operator=(CacheEntry&& other) noexcept {
-        if (this != &other) {
-            ip = move(other.ip);
-            expiry = other.expiry;
-            hits.store(other.hits.load());
+    // Copies the answer out; the lengths are read once and clamped so a
+    // torn seqlock read can never run past the payload or overflow block
+    void copy_answer(CachedAnswer& out) const {
+        size_t key = min<size_t>(key_len, PAYLOAD_SIZE);
+        size_t len = answer_len;
+        const uint8_t* src = payload + key;
+        if (!fits_inline(key, len)) {
+            src = overflow;
+            len = src ? min(len, CachedAnswer::MAX_SIZE) : 0;
         }
-        return *this;
+        memcpy(out.data, src, len);
+        out.len = static_cast<uint16_t>(len);
+        out.ancount = ancount;
+        out.nscount = nscount;
+        out.rcode = rcode;
     }
     
-    bool is_valid() const {
-        return chrono::steady_clock::now() < expiry;
+    // Writers are serialized by the shard mutex; these only fence readers
+    void begin_write() {
+        seq.store(seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+    void end_write() {
+        seq.store(seq.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+    
+    // Hit bookkeeping that skips the store once nothing would change, so
+    // concurrent readers of a hot entry don't keep bouncing its cache line
+    void record_hit() {
+        if (hits.load(memory_order_relaxed) < MAX_HITS) {
+            hits.fetch_add(1, memory_order_relaxed);
+        }
+        if (!referenced.load(memory_order_relaxed)) {
+            referenced.store(true, memory_order_relaxed);
+        }
     }
 };
 
+static_assert(sizeof(CacheEntry) == 256, "CacheEntry should span four cache lines");
+
 class FastDNSCache {
-private:
-    static constexpr size_t CACHE_SIZE = 8192;
-    static constexpr size_t CACHE_MASK = CACHE_SIZE - 1;
-    static constexpr size_t NUM_SHARDS = 16;
-    static constexpr size_t MAX_ENTRIES_PER_SHARD = CACHE_SIZE / NUM_SHARDS;
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 8192;
+    static constexpr size_t DEFAULT_SHARDS = 16;
+    
+    // Each shard is a set-associative table: a name hashes to one set of
+    // WAYS adjacent slots and can live in any of them. Victims are chosen by
+    // a per-set CLOCK hand, so a hit only sets a bit and never relinks anything.
+    static constexpr size_t WAYS = 8;
+    
+    // W-TinyLFU admission, per set: one way is the window every new name
+    // enters through, the rest are the main area. When a full set takes a
+    // new name, the window's occupant competes with the main area's CLOCK
+    // victim and the less frequently used of the two is evicted, so a burst
+    // of one-off names only ever churns the window way. Frequency is a
+    // shard-wide sketch of misses and of the hits of removed entries, plus
+    // a resident entry's own hit counter. Sketch and hit counters are
+    // halved after SAMPLES_PER_SLOT misses per slot, so old popularity fades.
+    static constexpr size_t SAMPLES_PER_SLOT = 10;
+    
+    // Approximate resident bytes per entry: the slot, its expiry heap node
+    // and its share of the admission sketch
+    static constexpr size_t BYTES_PER_ENTRY = sizeof(CacheEntry) + 32 + 8;
     
+private:
     struct Shard {
-        unordered_map<string, CacheEntry> entries;
-        list<string> lru_list;
-        unordered_map<string, list<string>::iterator> lru_map;
+        unique_ptr<CacheEntry[]> slots;
+        unique_ptr<uint8_t[]> clock_hands;
+        unique_ptr<uint8_t[]> window_ways;  // per set, the way new names enter through
+        size_t num_slots = 0;
+        bool admission = false;
+        FrequencySketch sketch;         // written lock-free by misses, aged under mtx
+        uint64_t next_aging = 0;        // misses count at which the sketch is next halved
+        atomic<size_t> size{0};         // changed under mtx, read lock-free by stats
         mutable mutex mtx;
-        atomic<uint64_t> hits{0};
+        atomic<uint64_t> hits{0};       // locked reads only; lock-free hits use thread_hits
         atomic<uint64_t> misses{0};
         atomic<uint64_t> evictions{0};
+        atomic<uint64_t> rejections{0}; // evictions of a window entry that lost admission
+        atomic<uint64_t> lock_waits{0}; // acquisitions that found mtx held
         
-        void cleanup_expired() {
-            auto now = chrono::steady_clock::now();
-            auto it = entries.begin();
-            while (it != entries.end()) {
-                if (now >= it->second.expiry) {
-                    auto lru_it = lru_map.find(it->first);
-                    if (lru_it != lru_map.end()) {
-                        lru_list.erase(lru_it->second);
-                        lru_map.erase(lru_it);
-                    }
-                    it = entries.erase(it);
-                } else {
-                    ++it;
+        // Takes mtx, counting the times it had to wait, so contention on
+        // a hot shard shows up in the stats
+        unique_lock<mutex> lock() {
+            unique_lock<mutex> guard(mtx, try_to_lock);
+            if (!guard.owns_lock()) {
+                lock_waits.fetch_add(1, memory_order_relaxed);
+                guard.lock();
+            }
+            return guard;
+        }
+        
+        // Min-heap of removal times (expiry plus the stale window); nodes go
+        // stale when a slot is rewritten or evicted and are skipped when
+        // they surface
+        struct ExpiryNode {
+            chrono::steady_clock::time_point expiry;
+            uint32_t slot;
+            uint32_t generation;
+            bool operator>(const ExpiryNode& other) const { return expiry > other.expiry; }
+        };
+        priority_queue<ExpiryNode, vector<ExpiryNode>, greater<ExpiryNode>> expiry_heap;
+        
+        void init(size_t num_sets, uint64_t seed) {
+            num_slots = num_sets * WAYS;
+            slots.reset(new CacheEntry[num_slots]);
+            clock_hands.reset(new uint8_t[num_sets]());
+            window_ways.reset(new uint8_t[num_sets]());
+            sketch.init(num_slots, seed);
+            next_aging = SAMPLES_PER_SLOT * num_slots;
+        }
+        
+        // Sketch key of a question, from the same hash bits that placed it
+        static uint64_t sketch_key(size_t set, uint32_t tag) { return (uint64_t(tag) << 32) | set; }
+        
+        void record_miss(size_t set, uint32_t tag) {
+            misses.fetch_add(1, memory_order_relaxed);
+            if (admission) {
+                sketch.increment(sketch_key(set, tag));
+            }
+        }
+        
+        uint32_t frequency(const CacheEntry& entry, size_t set) const {
+            return sketch.estimate(sketch_key(set, entry.tag)) + entry.hits.load(memory_order_relaxed);
+        }
+        
+        // Halves every frequency once enough misses have been sampled
+        void age_if_due() {
+            if (!admission || misses.load(memory_order_relaxed) < next_aging) {
+                return;
+            }
+            sketch.age();
+            for (size_t i = 0; i < num_slots; ++i) {
+                slots[i].hits.store(slots[i].hits.load(memory_order_relaxed) / 2, memory_order_relaxed);
+            }
+            next_aging = misses.load(memory_order_relaxed) + SAMPLES_PER_SLOT * num_slots;
+        }
+        
+        CacheEntry* find(size_t set, uint32_t tag, string_view key, uint16_t qtype) {
+            CacheEntry* base = &slots[set * WAYS];
+            for (size_t way = 0; way < WAYS; ++way) {
+                if (base[way].matches(tag, key, qtype)) {
+                    return &base[way];
+                }
+            }
+            return nullptr;
+        }
+        
+        // Folds the entry's hits into the sketch, so a popular name that
+        // expires or is evicted keeps its standing when it comes back
+        void remove(CacheEntry& entry) {
+            if (admission) {
+                size_t set = static_cast<size_t>(&entry - slots.get()) / WAYS;
+                sketch.increment(sketch_key(set, entry.tag), entry.hits.load(memory_order_relaxed));
+            }
+            entry.begin_write();
+            entry.tag = 0;
+            entry.end_write();
+            size.fetch_sub(1, memory_order_relaxed);
+        }
+        
+        // Free or expired slot if the set has one, else the slot given up
+        // by CLOCK or, under admission, by the window/main contest
+        CacheEntry& victim(size_t set, chrono::steady_clock::time_point now) {
+            CacheEntry* base = &slots[set * WAYS];
+            for (size_t way = 0; way < WAYS; ++way) {
+                if (!base[way].occupied()) {
+                    return base[way];
+                }
+            }
+            for (size_t way = 0; way < WAYS; ++way) {
+                if (now >= base[way].expiry) {
+                    remove(base[way]);
+                    return base[way];
                 }
             }
+            
+            size_t window = admission ? window_ways[set] : WAYS;
+            CacheEntry& main_victim = clock_victim(set, window);
+            evictions.fetch_add(1, memory_order_relaxed);
+            if (!admission) {
+                remove(main_victim);
+                return main_victim;
+            }
+            
+            // The window's occupant joins the main area only if it is used
+            // more than what it would push out; either way the freed slot
+            // becomes the window and takes the new name
+            CacheEntry& candidate = base[window];
+            if (frequency(candidate, set) > frequency(main_victim, set)) {
+                window_ways[set] = static_cast<uint8_t>(&main_victim - base);
+                remove(main_victim);
+                return main_victim;
+            }
+            rejections.fetch_add(1, memory_order_relaxed);
+            remove(candidate);
+            return candidate;
         }
         
-        void evict_lru() {
-            if (entries.size() >= MAX_ENTRIES_PER_SHARD && !lru_list.empty()) {
-                const string& oldest = lru_list.back();
-                entries.erase(oldest);
-                lru_map.erase(oldest);
-                lru_list.pop_back();
-                evictions.fetch_add(1, memory_order_relaxed);
+        // First unreferenced way the hand reaches, skipping skip_way and
+        // clearing reference bits as it passes
+        CacheEntry& clock_victim(size_t set, size_t skip_way) {
+            CacheEntry* base = &slots[set * WAYS];
+            uint8_t& hand = clock_hands[set];
+            for (;;) {
+                size_t way = hand;
+                hand = (hand + 1) % WAYS;
+                if (way == skip_way) {
+                    continue;
+                }
+                CacheEntry& candidate = base[way];
+                if (!candidate.referenced.load(memory_order_relaxed)) {
+                    return candidate;
+                }
+                candidate.referenced.store(false, memory_order_relaxed);
             }
         }
         
-        void touch_lru(const string& domain) {
-            auto lru_it = lru_map.find(domain);
-            if (lru_it != lru_map.end()) {
-                lru_list.erase(lru_it->second);
+        // Drops at most max_removals entries past their expiry plus the
+        // stale window, oldest first
+        size_t cleanup_expired(size_t max_removals, chrono::seconds stale_window) {
+            auto now = CacheClock::now();
+            size_t removed = 0;
+            while (removed < max_removals && !expiry_heap.empty() && expiry_heap.top().expiry <= now) {
+                const ExpiryNode& node = expiry_heap.top();
+                CacheEntry& entry = slots[node.slot];
+                if (entry.occupied() && entry.generation == node.generation) {
+                    remove(entry);
+                    removed++;
+                }
+                expiry_heap.pop();
+            }
+            
+            // Stale nodes from rewritten slots can pile up; rebuild
+            if (expiry_heap.size() > 4 * num_slots) {
+                decltype(expiry_heap) rebuilt;
+                for (uint32_t i = 0; i < num_slots; ++i) {
+                    if (slots[i].occupied()) {
+                        rebuilt.push({slots[i].expiry + stale_window, i, slots[i].generation});
+                    }
+                }
+                expiry_heap.swap(rebuilt);
             }
-            lru_list.push_front(domain);
-            lru_map[domain] = lru_list.begin();
+            return removed;
         }
     };
     
-    array<Shard, NUM_SHARDS> shards;
+    unique_ptr<Shard[]> shards;
+    bool lock_free_reads;
+    bool admission = true;
+    double refresh_fraction = 0.0;
+    uint32_t refresh_min_hits = 0;
+    chrono::seconds stale_window{0};
+    size_t num_shards;
+    size_t shard_mask;
+    unsigned shard_bits;
+    size_t set_mask;
+    atomic<uint64_t> uncacheable{0};  // names or answers too long for a slot, never stored
     
-    size_t get_shard_index(const string& domain) const {
-        return hash<string>{}(domain) & (NUM_SHARDS - 1);
-    }
+    // Lock-free hits are counted per thread (one counter per shard, single
+    // writer) and summed in get_stats(), so a hot shard has no shared
+    // counter line that every core writes
+    static atomic<uint64_t> next_instance_id;
+    uint64_t instance_id;
+    mutable mutex thread_hits_mutex;
+    mutable vector<unique_ptr<atomic<uint64_t>[]>> thread_hits;
+    atomic<uint64_t>* local_hit_counters() const;
+    
+    bool get_locked(Shard& shard, size_t set, uint32_t tag, string_view key, uint16_t qtype,
+                    CachedAnswer& answer);
+    // Seqlock read of the matching slot without the shard mutex: copies its
+    // answer and times, and returns it (null on a miss). Counts nothing and
+    // claims nothing; key must fit CacheEntry::PAYLOAD_SIZE.
+    CacheEntry* read_entry(Shard& shard, size_t set, uint32_t tag, string_view key, uint16_t qtype,
+                           CachedAnswer& answer, chrono::steady_clock::time_point& stored,
+                           chrono::steady_clock::time_point& expiry);
+    bool claim_refresh(CacheEntry& entry, chrono::steady_clock::time_point now,
+                       chrono::steady_clock::time_point stored, chrono::steady_clock::time_point expiry);
+    bool serve_hit(CacheEntry& entry, chrono::steady_clock::time_point now,
+                   chrono::steady_clock::time_point stored, chrono::steady_clock::time_point expiry,
+                   CachedAnswer& answer);
+    void insert(string_view key, uint64_t name_hash, uint16_t qtype, const CachedAnswer& answer,
+                chrono::steady_clock::time_point stored, chrono::steady_clock::time_point expiry);
+    
+    static constexpr char SNAPSHOT_MAGIC[8] = {'D', 'N', 'S', 'C', 'A', 'C', 'H', '1'};
+    static constexpr uint32_t SNAPSHOT_VERSION = 1;
+    
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t records;
+        int64_t written_at;             // Unix seconds
+    };
+    
+    // Followed by key_len bytes of name and answer_len bytes of RRs
+    struct SnapshotRecord {
+        uint32_t remaining;             // seconds of TTL left when written
+        uint32_t age;                   // seconds since the answer was fetched
+        uint16_t qtype;
+        uint16_t answer_len;
+        uint16_t ancount;
+        uint16_t nscount;
+        uint8_t key_len;
+        uint8_t rcode;
+        uint16_t reserved;
+    };
+    
+    size_t shard_index(uint64_t h) const { return h & shard_mask; }
+    size_t set_index(uint64_t h) const { return (h >> shard_bits) & set_mask; }
+    static uint32_t tag_of(uint64_t h) { return static_cast<uint32_t>(h >> 32) | 1; }
     
 public:
-    bool get(const string& domain, string& ip);
-    void set(const string& domain, const string& ip, uint32_t ttl = 300);
-    void cleanup_expired();
+    // Both values are rounded up to powers of two so shard and set selection
+    // are plain masks; capacity ends up as shards * sets * WAYS entries.
+    // num_shards == 0 picks one scaled to the hardware thread count.
+    //
+    // With lock_free_reads, get() never takes the shard mutex: each slot is
+    // a seqlock that readers validate around their copy, and recency is the
+    // slot's CLOCK bit. Writers still serialize on the shard mutex.
+    explicit FastDNSCache(size_t capacity = DEFAULT_CAPACITY, size_t num_shards = DEFAULT_SHARDS,
+                          bool lock_free_reads = true);
+    
+    // Largest power-of-two capacity whose entries fit in memory_bytes
+    static size_t capacity_for_memory(size_t memory_bytes);
+    
+    // Refresh-ahead: a hit on an entry with at least min_hits hits that is
+    // past fraction of its TTL comes back with answer.refresh set, once per
+    // stored answer, so the caller can fetch a fresh copy while this one is
+    // still served. fraction 0 disables it. Call before first use.
+    void set_refresh_ahead(double fraction, uint32_t min_hits) {
+        refresh_fraction = fraction;
+        refresh_min_hits = min_hits;
+    }
+    
+    // Serve-stale (RFC 8767): an entry stays for window seconds past its
+    // TTL, and a hit on it returns the answer with stale and refresh set so
+    // the caller can answer at once and look it up again in the background.
+    // 0 disables it. Call before first use.
+    void set_serve_stale(uint32_t window_seconds) { stale_window = chrono::seconds(window_seconds); }
+    
+    // W-TinyLFU admission (see WAYS above); on by default. Off, a full set
+    // simply evicts its CLOCK victim. Call before first use.
+    void set_admission(bool enabled);
+    bool admission_enabled() const { return admission; }
+    
+    // Gives up a refresh claimed through get() that produced no new answer,
+    // so a later hit may try again
+    void release_refresh(string_view key, uint64_t name_hash, uint16_t qtype);
+    
+    size_t capacity() const { return num_shards * shards[0].num_slots; }
+    size_t shard_count() const { return num_shards; }
+    
+    // Keyed by question: lowercased wire-format name and QTYPE (class IN is
+    // implied). name_hash is hash_wire_name(key), which the query parser
+    // has already computed on the hot path.
+    bool get(string_view key, uint64_t name_hash, uint16_t qtype, CachedAnswer& answer);
+    void set(string_view key, uint64_t name_hash, uint16_t qtype, const CachedAnswer& answer, uint32_t ttl);
+    
+    // get() from another cache (a replica on another NUMA node) that also
+    // stores the answer here with its original expiry, so later hits for it
+    // stay local. Misses and stale entries are not copied. The source is
+    // only read through its slot seqlocks, never its shard mutexes.
+    bool copy_from(FastDNSCache& source, string_view key, uint64_t name_hash, uint16_t qtype, CachedAnswer& answer);
+    
+    // Incremental expiry for the maintenance thread: removes at most
+    // max_per_shard expired entries from each shard
+    size_t cleanup_expired(size_t max_per_shard = SIZE_MAX);
+    
+    // Binary snapshot of every live entry with its age and remaining TTL,
+    // written beside path and renamed over it. Loading streams the file
+    // back, charging entries for the wall-clock time since it was written
+    // and skipping those that expired meanwhile; a missing file loads
+    // nothing and is not an error. Geometry may differ between runs.
+    bool save_snapshot(const string& path, size_t& saved, string& error) const;
+    bool load_snapshot(const string& path, size_t& loaded, string& error);
     
     struct Stats {
         uint64_t hits = 0;
         uint64_t misses = 0;
         uint64_t evictions = 0;
+        uint64_t rejections = 0;    // evictions where admission kept the older entry
+        uint64_t lock_waits = 0;
+        uint64_t uncacheable = 0;   // whole cache only: see CacheEntry::PAYLOAD_SIZE
         size_t size = 0;
+        size_t capacity = 0;
+        size_t shards = 0;
         double hit_ratio() const { return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0; }
     };
     
+    // Both read relaxed counters only and never take a shard lock
     Stats get_stats() const;
+    vector<Stats> get_shard_stats() const;
 };
 
 class PrecompiledResponses {
 private:
-    unordered_map<string, vector<uint8_t>> responses;
+    // Source set while loading: templates bucketed by question_hash of the
+    // name and type they answer. Each template starts with the header and
+    // question, so the name at offset 12 and the QTYPE after it are its key.
+    unordered_map<uint64_t, vector<vector<uint8_t>>> responses;
+    size_t names = 0;               // catch-all templates in responses
+    
+    // Perfect-hash form of responses, built by freeze()
+    FrozenZone frozen_table;
+    bool frozen = false;
+    
+    // Compiled zone files, served straight from their mappings and probed
+    // after the names above, in the order they were added
+    vector<unique_ptr<FrozenZone>> zone_files;
+    
+    void add_template(vector<uint8_t>&& response, uint64_t hash, size_t name_len);
+    void add_catch_all(const string& name, uint64_t name_hash);
+    const uint8_t* find(const QueryView& query, uint64_t hash, uint16_t qtype, size_t& len) const;
     
 public:
+    // Names added through add_local_domain/add_static carry over to a
+    // reloaded table; zone files are mapped afresh instead
+    void copy_local_names(const PrecompiledResponses& other);
+    
+    // An IPv4 address adds an A answer, an IPv6 one an AAAA answer
     void add_local_domain(const string& domain, const string& ip);
-    bool get_response(const string& domain, uint16_t query_id, vector<uint8_t>& response);
+    void add_static(const StaticLocalDomain& domain);
+    bool add_zone_file(const string& path, string& error);
+    
+    // Builds the perfect hash from everything added so far; lookups then
+    // touch one seed, one slot and the template. Adding names thaws it.
+    // False (lookups stay on the hash map) only if two questions share a hash.
+    bool freeze();
+    bool is_frozen() const { return frozen; }
+    size_t size() const;            // distinct local names
+    
+    // The stored reply for query's name and type with a zero ID, or
+    // nullptr if the name is not local. Every local name also has a
+    // catch-all template under QTYPE 0, returned with catch_all set for
+    // types it has no answer for: NODATA, or for an alias just its CNAME
+    // chain. The caller copies it and writes the query's QTYPE in.
+    const uint8_t* get_response(const QueryView& query, size_t& len, bool& catch_all) const;
+};
+
+enum class IOEngine {
+    Blocking,   // recvfrom/recvmmsg worker loop (portable default)
+    IoUring     // multishot recvmsg + provided buffer ring, see uring_engine.h
+};
+
+struct ServerConfig {
+    uint16_t port = 53;
+    size_t num_workers = 0;       // 0 = one per hardware thread
+    bool reuseport = true;        // one SO_REUSEPORT socket per worker
+    bool cpu_steering = true;     // CBPF program mapping RX CPU -> worker socket
+    bool pin_workers = true;      // each worker on its own CPU, spread across NUMA nodes
+    bool cache_per_node = false;  // one cache per NUMA node; an answer is copied to a node on its first hit there
+    size_t batch_size = 32;       // datagrams per recvmmsg/sendmmsg; 1 = recvfrom/sendto
+    size_t cache_capacity = FastDNSCache::DEFAULT_CAPACITY;
+    size_t cache_shards = FastDNSCache::DEFAULT_SHARDS;  // 0 = scale with hardware threads
+    size_t cache_memory_bytes = 0;  // when set, overrides cache_capacity
+    bool cache_lock_free_reads = true;  // seqlock lookups instead of taking the shard mutex
+    bool cache_admission = true;  // W-TinyLFU: one-off names cannot push out frequently used ones
+    IOEngine io_engine = IOEngine::Blocking;
+    unsigned uring_entries = 4096;  // SQ size and in-flight sends per worker ring
+    unsigned uring_buffers = 4096;  // provided receive buffers per worker ring
+    unsigned upstream_timeout_ms = 1500;  // per attempt, before trying the next upstream
+    bool upstream_hedging = false;  // duplicate a lookup to a second upstream once the first is past its p95
+    vector<string> zone_files;    // compiled with zone_compiler, mapped at start()
+    uint32_t cache_max_ttl = 86400;     // upstream TTLs are honored up to this
+    uint32_t negative_max_ttl = 10800;  // cap on NXDOMAIN/NODATA caching (RFC 2308 suggests 3 hours)
+    uint32_t serve_stale_s = 0;   // RFC 8767: answer from expired entries this long past their TTL; 0 = off
+    double prefetch_fraction = 0.9;  // refresh hot entries upstream once this far into their TTL; 0 = off
+    uint32_t prefetch_min_hits = 3;  // hits an entry needs before it is worth refreshing
+    uint16_t edns_udp_size = 1232;  // advertised and the cap on UDP replies; 1232 avoids IP fragmentation
+    bool tcp = true;              // RFC 7766 listener on the same port
+    size_t tcp_max_connections = 1024;
+    size_t tcp_max_pipelined = 64;  // upstream lookups in flight per connection before its reads pause
+    unsigned tcp_idle_timeout_ms = 10000;
+    unsigned drain_timeout_ms = 5000;  // stop() waits this long for lookups already upstream
+    uint32_t client_rate = 0;     // UDP queries/s per source prefix, checked before parsing; 0 = off
+    uint32_t client_burst = 0;    // 0 = one second's worth of client_rate
+    uint32_t rrl_rate = 0;        // identical UDP responses/s per source prefix (RRL); 0 = off
+    uint32_t rate_slip = 2;       // every Nth limited query gets a TC reply, sending real clients to TCP; 0 = drop all
+    unsigned rate_prefix = 24;    // IPv4 prefix length clients are grouped by
+    size_t rate_buckets = 65536;  // per limiter; 8 bytes each
+    uint16_t metrics_port = 0;    // Prometheus endpoint at http://metrics_address:port/metrics; 0 = off
+    string metrics_address = "127.0.0.1";
+    string cache_snapshot;        // loaded at start(), saved periodically and at stop(); empty = off
+    unsigned snapshot_interval_s = 300;
+    string trace_file;            // binary per-query trace records; empty = off
+    uint32_t trace_sample = 1;    // 1 in N records go to trace_file
+    unsigned slow_query_us = 0;   // log queries answered this slowly, from the trace thread; 0 = off
+};
+
+// Responses collected by one worker for a receive batch and flushed to the
+// socket with a single sendmmsg. Replies are written straight into a fixed
+// per-slot arena that is reused after every flush, so building a reply never
+// allocates. Template replies skip even that: only their header (and an
+// OPT record) live in the arena and the rest is gathered from the caller's
+// immutable buffer.
+class ResponseBatch {
+public:
+    // Largest reply any path builds: a full question, the largest cached
+    // answer or local template, and an OPT record. UDP replies are held to
+    // the client's EDNS size before they get here; TCP takes them whole.
+    static constexpr size_t MAX_RESPONSE = 12 + MAX_WIRE_NAME + 4 + CachedAnswer::MAX_SIZE + OPT_RR_SIZE;
+    
+private:
+    int fd;
+    size_t count = 0;
+    atomic<uint64_t>* drops;            // replies the kernel refused, shared across workers
+    unique_ptr<uint8_t[]> arena;        // slot i owns [i * MAX_RESPONSE, (i + 1) * MAX_RESPONSE)
+    vector<sockaddr_in> addrs;
+    vector<array<iovec, 3>> iovs;
+    vector<uint8_t> iov_counts;
+    vector<mmsghdr> msgs;
+    
+    uint8_t* slot(size_t i) { return arena.get() + i * MAX_RESPONSE; }
+    
+public:
+    ResponseBatch(int socket_fd, size_t capacity, atomic<uint64_t>* drop_counter = nullptr);
+    
+    // Scratch space of MAX_RESPONSE bytes for the next reply, flushing
+    // first if the batch is full; commit() queues what was written
+    uint8_t* buffer();
+    void commit(size_t len, const sockaddr_in& addr);
+    
+    // Queues tmpl under query_id, followed by an OPT record advertising
+    // edns_udp_size unless that is 0; tmpl must stay unchanged until flush()
+    void add_template(uint16_t query_id, const uint8_t* tmpl, size_t len, const sockaddr_in& addr,
+                      uint16_t edns_udp_size = 0);
+    
+    void flush();
+    bool full() const { return count == msgs.size(); }
+    int socket() const { return fd; }
+    
+    // Lets an engine that submits sends itself take over the queued replies
+    size_t size() const { return count; }
+    size_t copy_out(size_t i, uint8_t* dst) const;  // gathers reply i into MAX_RESPONSE bytes
+    size_t length(size_t i) const;
+    const sockaddr_in& addr(size_t i) const { return addrs[i]; }
+    void clear() { count = 0; }
+    void count_dropped(size_t n) {
+        if (drops && n) {
+            drops->fetch_add(n, memory_order_relaxed);
+        }
+    }
 };
 
+struct UpstreamQuery;
+class UpstreamForwarder;
+class MetricsServer;
+class TcpServer;
+
 class DNSServer {
 private:
-    int socket_fd;
-    bool running;
+    ServerConfig config;
+    vector<int> socket_fds;       // one per worker, or a single shared socket
+    atomic<bool> running;
     vector<thread> worker_threads;
-    FastDNSCache cache;
-    PrecompiledResponses precompiled;
+    thread maintenance_thread;
+    
+    // Worker i runs on worker_cpus[i] (when pinned) and uses the cache of
+    // worker_nodes[i]; there is one cache per NUMA node with cache_per_node,
+    // else a single shared one
+    CpuTopology topology;
+    vector<int> worker_cpus;
+    vector<size_t> worker_nodes;
+    vector<unique_ptr<FastDNSCache>> caches;
+    
+    // Local names, swapped whole on reload. Workers load the pointer per
+    // query without locks; a replaced table is freed once the QSBR grace
+    // period shows no worker can still hold it.
+    atomic<PrecompiledResponses*> precompiled{new PrecompiledResponses()};
+    unique_ptr<QsbrDomain> qsbr;  // one reader per worker
+    mutex reload_mutex;
+    atomic<size_t> local_names{0};  // size of the live table, for threads outside QSBR
     
     vector<pair<string, uint16_t>> upstream_resolvers;
+    unique_ptr<UpstreamForwarder> forwarder;
+    unique_ptr<MetricsServer> metrics;
+    unique_ptr<TcpServer> tcp;
+    unique_ptr<QueryTracer> tracer;  // null unless tracing or logging slow queries
+    
+    // UDP only: a TCP client has already proved its address
+    unique_ptr<RateLimiter> client_limiter;    // queries per source prefix
+    unique_ptr<RateLimiter> response_limiter;  // responses per (source prefix, answer)
     
     atomic<uint64_t> total_queries{0};
     atomic<uint64_t> cache_hits{0};
     atomic<uint64_t> local_domain_hits{0};
+    atomic<uint64_t> prefetches{0};
+    atomic<uint64_t> malformed_queries{0};  // dropped without a reply
+    atomic<uint64_t> oversized_queries{0};  // UDP datagrams longer than edns_udp_size, dropped unparsed
+    atomic<uint64_t> send_failures{0};      // replies that never left the socket
+    atomic<uint64_t> truncated_replies{0};  // cut back to the question with TC set
+    atomic<uint64_t> cache_replications{0};  // answers copied from another node's cache
     
-    mutable mutex stats_mutex;
-    vector<double> response_times;
+    // Response time per path, from receipt to the reply being queued
+    enum LatencySeries : size_t { LOCAL_LATENCY, CACHE_LATENCY, UPSTREAM_LATENCY, LATENCY_SERIES };
+    LatencyRecorder latency{LATENCY_SERIES};
     
 public:
     DNSServer(uint16_t port = 53);
+    explicit DNSServer(const ServerConfig& cfg);
     ~DNSServer();
     
     bool start();
     void stop();
     void add_upstream_resolver(const string& ip, uint16_t port = 53);
     void add_local_domain(const string& domain, const string& ip);
+    void add_local_domain(const StaticLocalDomain& domain);
+    
+    // Re-maps config.zone_files into a new local table and swaps it in while
+    // workers keep serving; the cache is untouched. False (the old table
+    // stays live) if a zone fails to load. Call from a non-worker thread.
+    bool reload_local_zones();
+    
+    struct LatencySummary {
+        uint64_t count = 0;
+        double avg_ms = 0;
+        double p50_ms = 0;
+        double p95_ms = 0;
+        double p99_ms = 0;
+        double max_ms = 0;
+    };
     
     struct PerformanceStats {
         uint64_t total_queries;
         uint64_t cache_hits;
         uint64_t local_domain_hits;
+        uint64_t coalesced_queries;   // misses that waited on an identical in-flight lookup
+        uint64_t prefetches;          // refresh-ahead lookups sent for hot entries near expiry
         double cache_hit_ratio;
-        double avg_response_time_ms;
+        double avg_response_time_ms;  // over all three paths below
         double p95_response_time_ms;
         double p99_response_time_ms;
+        LatencySummary local;
+        LatencySummary cached;
+        LatencySummary upstream;
     };
     
     PerformanceStats get_performance_stats() const;
+    FastDNSCache::Stats get_cache_stats() const;  // summed over the per-node caches
+    size_t worker_count() const { return config.num_workers; }  // resolved from the usable CPUs if unset
+    
+    // Prometheus text exposition of every counter the server keeps, built
+    // from relaxed atomics and per-thread histograms without shard locks
+    string render_metrics() const;
+    
+    // Builders write into out (at least ResponseBatch::MAX_RESPONSE bytes)
+    // and return the reply length, 0 if it could not be built
+    static size_t build_cached_response(uint16_t query_id, const uint8_t* question, size_t question_len,
+                                        const CachedAnswer& answer, uint8_t* out);
+    static size_t build_error_response(uint16_t query_id, uint8_t* out, uint16_t rcode = 2);
+    // Empty reply with TC set, for rate-limited clients to retry over TCP
+    static size_t build_truncated_response(uint16_t query_id, const uint8_t* question, size_t question_len,
+                                           uint8_t* out);
     
 private:
-    void worker_thread();
-    void handle_query(const uint8_t* data, size_t len, const sockaddr_in& client_addr);
+    void create_caches();
+    void open_sockets();
+    void attach_cpu_steering();
+    void worker_thread(size_t index);
+    void run_blocking_worker(size_t index, int fd);
+    void maintenance_loop();
+    void save_cache_snapshot();
+    // tcp_conn is 0 for a UDP datagram from client_addr, else the TcpServer
+    // connection it arrived on. False if the query was dropped unanswered.
+    bool handle_query(const uint8_t* data, size_t len, const sockaddr_in& client_addr, ResponseBatch& out,
+                      uint64_t tcp_conn = 0);
+    size_t udp_reply_limit(const QueryView& query) const;
+    // Adds the OPT record an EDNS query must get back (RFC 6891 6.1.1) and
+    // cuts a reply over limit back to its question with TC set, so the
+    // client retries over TCP. Returns the final length.
+    size_t finish_reply(uint8_t* reply, size_t len, size_t question_len, bool edns, size_t limit,
+                        uint8_t ext_rcode = 0);
     
     bool parse_dns_header(const uint8_t* data, size_t len, DNSHeader& header);
-    bool parse_dns_question(const uint8_t* data, size_t len, size_t& offset, DNSQuestion& question);
-    vector<uint8_t> build_dns_response(uint16_t query_id, const string& domain, const string& ip);
-    vector<uint8_t> build_error_response(uint16_t query_id, uint16_t rcode = 2);
     
-    bool resolve_upstream(const string& domain, string& ip);
+    // The calling worker's node cache, then the other nodes'
+    bool cache_lookup(const QueryView& query, CachedAnswer& answer);
+    // RRL verdict for a UDP reply: answers are counted per question, errors
+    // and NXDOMAIN per rcode, so random names share one budget
+    RateLimiter::Verdict limit_response(const sockaddr_in& client_addr, uint64_t question, uint8_t rcode,
+                                        chrono::steady_clock::time_point now);
+    void prefetch(const QueryView& query);
+    // Fires the reply probe and, while tracing, completes and records trace
+    void trace_reply(TraceRecord& trace, chrono::steady_clock::time_point start, uint64_t hash, uint16_t qtype,
+                     TracePath path, uint8_t rcode);
+    void on_upstream_reply(const vector<UpstreamQuery>& waiters, const uint8_t* reply, size_t len);
+    // Cacheable part of an upstream reply and how long it may be cached:
+    // positive answers for their smallest TTL, negative ones (RFC 2308) for
+    // their SOA's TTL or MINIMUM, whichever is lower. Class IN only.
+    bool extract_answer(const uint8_t* data, size_t len, CachedAnswer& answer, uint32_t& ttl);
     
-    string parse_domain_name(const uint8_t* data, size_t len, size_t& offset);
-    void encode_domain_name(const string& domain, vector<uint8_t>& buffer);
+    friend struct DNSServerTestAccess;  // dns_server_test.cpp
 };
 
 #endif // DNS_SERVER_H
@@ -0,0 +1,104 @@
+#include "dns_server.h"
+#include "upstream_forwarder.h"
+#include <cstdio>
+#include <vector>
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+// Reaches the upstream completion without a forwarder or any traffic
+struct DNSServerTestAccess {
+    static void upstream_reply(DNSServer& server, const vector<UpstreamQuery>& waiters, const vector<uint8_t>& reply) {
+        server.on_upstream_reply(waiters, reply.data(), reply.size());
+    }
+};
+
+static const vector<uint8_t> VERSION_BIND = {7, 'v', 'e', 'r', 's', 'i', 'o', 'n', 4, 'b', 'i', 'n', 'd', 0};
+
+// An upstream reply to a TXT question for version.bind in qclass, with one
+// TXT answer of the same class
+static vector<uint8_t> txt_reply(uint16_t qclass) {
+    vector<uint8_t> reply = {0x00, 0x01, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00};
+    reply.insert(reply.end(), VERSION_BIND.begin(), VERSION_BIND.end());
+    uint8_t cls_hi = static_cast<uint8_t>(qclass >> 8), cls_lo = static_cast<uint8_t>(qclass);
+    reply.insert(reply.end(), {0x00, 0x10, cls_hi, cls_lo});
+    reply.insert(reply.end(), {0xC0, 0x0C, 0x00, 0x10, cls_hi, cls_lo, 0x00, 0x00, 0x0E, 0x10, 0x00, 0x04});
+    reply.insert(reply.end(), {3, '1', '.', '0'});
+    return reply;
+}
+
+// A waiter without a client, like a refresh-ahead lookup: the reply only
+// goes into the cache
+static vector<UpstreamQuery> refresh_waiter(uint16_t qclass) {
+    UpstreamQuery query;
+    query.question = VERSION_BIND;
+    query.question.insert(query.question.end(), {0x00, 0x10, static_cast<uint8_t>(qclass >> 8), static_cast<uint8_t>(qclass)});
+    query.domain.assign(VERSION_BIND.begin(), VERSION_BIND.end());
+    query.qtype = 16;
+    query.start = chrono::steady_clock::now();
+    vector<UpstreamQuery> waiters;
+    waiters.push_back(move(query));
+    return waiters;
+}
+
+static ServerConfig test_config() {
+    ServerConfig config;
+    config.port = 0;
+    config.num_workers = 1;
+    config.pin_workers = false;
+    config.tcp = false;
+    return config;
+}
+
+static void test_non_in_answer_not_cached() {
+    DNSServer server(test_config());
+    DNSServerTestAccess::upstream_reply(server, refresh_waiter(3), txt_reply(3));  // CH
+    CHECK(server.get_cache_stats().size == 0);
+    DNSServerTestAccess::upstream_reply(server, refresh_waiter(255), txt_reply(255));  // ANY
+    CHECK(server.get_cache_stats().size == 0);
+}
+
+static void test_in_answer_cached() {
+    DNSServer server(test_config());
+    DNSServerTestAccess::upstream_reply(server, refresh_waiter(1), txt_reply(1));
+    CHECK(server.get_cache_stats().size == 1);
+}
+
+static void test_copy_from_replica() {
+    FastDNSCache remote(1024, 4), local(1024, 4);
+    string key(VERSION_BIND.begin(), VERSION_BIND.end());
+    uint64_t name_hash = hash_wire_name(key);
+    CachedAnswer answer;
+    answer.len = 4;
+    answer.ancount = 1;
+    remote.set(key, name_hash, 16, answer, 60);
+    
+    CachedAnswer copied;
+    CHECK(!local.copy_from(remote, key, name_hash, 1, copied));
+    CHECK(local.copy_from(remote, key, name_hash, 16, copied));
+    CHECK(copied.len == 4 && !copied.refresh);
+    CachedAnswer hit;
+    CHECK(local.get(key, name_hash, 16, hit));
+    CHECK(hit.len == 4);
+}
+
+int main() {
+    test_non_in_answer_not_cached();
+    test_in_answer_cached();
+    test_copy_from_replica();
+    if (failures) {
+        fprintf(stderr, "dns_server_test: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("dns_server_test: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include "dns_wire.h"
+#include <cctype>
+#include <cstring>
+#include <utility>
+#include <arpa/inet.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// The parser's hash step: the crc32 instruction where available, otherwise
+// the same portable step the constexpr path uses
+static inline uint64_t hash_word(uint64_t h, uint64_t word) {
+#ifdef __SSE4_2__
+    return _mm_crc32_u64(h, word);
+#else
+    return wire_hash_step(h, word);
+#endif
+}
+
+static inline uint64_t load_word(const uint8_t* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint8_t ascii_lower(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+uint64_t hash_wire_name(const uint8_t* name, size_t len) {
+    uint64_t h = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        h = hash_word(h, load_word(name + i));
+    }
+    if (i < len) {
+        uint8_t tail[8] = {0};
+        memcpy(tail, name + i, len - i);
+        h = hash_word(h, load_word(tail));
+    }
+    return wire_hash_finish(h, len);
+}
+
+bool parse_query(const uint8_t* data, size_t len, QueryView& query) {
+    if (len < 12 + 1 + 4) {
+        return false;
+    }
+
+    uint16_t flags, qdcount, arcount;
+    memcpy(&query.id, data, 2);
+    memcpy(&flags, data + 2, 2);
+    memcpy(&qdcount, data + 4, 2);
+    memcpy(&arcount, data + 10, 2);
+    query.flags = ntohs(flags);
+    query.arcount = ntohs(arcount);
+
+    // Responses are never answered (reflection loops); opcode must be QUERY
+    if ((query.flags & 0x8000) || (query.flags & 0x7800) || ntohs(qdcount) != 1) {
+        return false;
+    }
+
+    // Walk the label lengths only; pointers and extended labels are invalid
+    // in a lone question. Label length bytes are < 64, below 'A', so the
+    // lowercasing below can treat the whole name as one byte string.
+    query.rcode = 0;
+    size_t offset = 12;
+    for (;;) {
+        if (offset >= len) {
+            return false;
+        }
+        uint8_t label_len = data[offset];
+        if (label_len == 0) {
+            offset++;
+            break;
+        }
+        if (label_len > 63) {
+            return false;
+        }
+        offset += 1 + label_len;
+        if (offset - 12 > MAX_WIRE_NAME) {
+            query.rcode = 1;  // FORMERR
+            return false;
+        }
+    }
+    // The zero label counts toward the limit too
+    if (offset - 12 > MAX_WIRE_NAME) {
+        query.rcode = 1;
+        return false;
+    }
+    if (offset + 4 > len) {
+        return false;
+    }
+
+    const uint8_t* src = data + 12;
+    size_t n = offset - 12;
+    uint8_t* dst = query.lower;
+    uint64_t h = 0;
+    size_t i = 0;
+
+    // Lowercase and hash in one pass: each full vector is folded to
+    // lowercase, stored, and its words fed to the hash while still hot
+#ifdef __AVX2__
+    const __m256i upper_lo32 = _mm256_set1_epi8('A' - 1);
+    const __m256i upper_hi32 = _mm256_set1_epi8('Z' + 1);
+    const __m256i case_bit32 = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i is_upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, upper_lo32), _mm256_cmpgt_epi8(upper_hi32, v));
+        v = _mm256_or_si256(v, _mm256_and_si256(is_upper, case_bit32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+        h = hash_word(h, load_word(dst + i));
+        h = hash_word(h, load_word(dst + i + 8));
+        h = hash_word(h, load_word(dst + i + 16));
+        h = hash_word(h, load_word(dst + i + 24));
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i upper_lo = _mm_set1_epi8('A' - 1);
+    const __m128i upper_hi = _mm_set1_epi8('Z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(v, upper_lo), _mm_cmplt_epi8(v, upper_hi));
+        v = _mm_or_si128(v, _mm_and_si128(is_upper, case_bit));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+        h = hash_word(h, load_word(dst + i));
+        h = hash_word(h, load_word(dst + i + 8));
+    }
+#endif
+
+    // Scalar tail; the zero padding makes the last partial word match
+    // what hash_wire_name feeds for it
+    size_t hashed = i;
+    for (; i < n; ++i) {
+        dst[i] = ascii_lower(src[i]);
+    }
+    memset(dst + n, 0, 8);
+    for (; hashed < n; hashed += 8) {
+        h = hash_word(h, load_word(dst + hashed));
+    }
+
+    uint16_t qtype, qclass;
+    memcpy(&qtype, data + offset, 2);
+    memcpy(&qclass, data + offset + 2, 2);
+
+    query.qname = src;
+    query.qname_len = n;
+    query.qtype = ntohs(qtype);
+    query.qclass = ntohs(qclass);
+    query.question_end = offset + 4;
+    query.hash = wire_hash_finish(h, n);
+
+    // EDNS: an OPT record, if any, leads the additional section of a query
+    // (nothing else goes before it in practice). Owner is the root name.
+    query.edns = false;
+    size_t opt = query.question_end;
+    if (query.arcount > 0 && opt + OPT_RR_SIZE <= len && data[opt] == 0 &&
+        data[opt + 1] == 0 && data[opt + 2] == TYPE_OPT) {
+        size_t rdlength = (data[opt + 9] << 8) | data[opt + 10];
+        if (opt + OPT_RR_SIZE + rdlength > len) {
+            return false;
+        }
+        query.edns = true;
+        query.edns_udp_size = static_cast<uint16_t>((data[opt + 3] << 8) | data[opt + 4]);
+        query.edns_version = data[opt + 6];
+    }
+    return true;
+}
+
+bool text_to_wire(const string& text, string& wire) {
+    wire.clear();
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t dot = text.find('.', start);
+        if (dot == string::npos) {
+            dot = text.size();
+        }
+        size_t label_len = dot - start;
+        if (label_len == 0 || label_len > 63) {
+            return false;
+        }
+        wire.push_back(static_cast<char>(label_len));
+        for (size_t i = start; i < dot; ++i) {
+            wire.push_back(static_cast<char>(ascii_lower(static_cast<uint8_t>(text[i]))));
+        }
+        start = dot + 1;
+    }
+    wire.push_back('\0');
+    return wire.size() <= MAX_WIRE_NAME;
+}
+
+string wire_to_text(string_view wire) {
+    string text;
+    size_t offset = 0;
+    while (offset < wire.size()) {
+        uint8_t label_len = static_cast<uint8_t>(wire[offset]);
+        if (label_len == 0 || offset + 1 + label_len > wire.size()) {
+            break;
+        }
+        if (!text.empty()) {
+            text.push_back('.');
+        }
+        text.append(wire.substr(offset + 1, label_len));
+        offset += 1 + label_len;
+    }
+    return text.empty() ? "." : text;
+}
+
+static const pair<const char*, uint16_t> RR_TYPES[] = {
+    {"A", 1}, {"NS", 2}, {"CNAME", 5}, {"SOA", 6}, {"PTR", 12}, {"MX", 15}, {"TXT", 16},
+    {"AAAA", 28}, {"SRV", 33}, {"DS", 43}, {"DNSKEY", 48}, {"HTTPS", 65}, {"ANY", 255},
+};
+
+bool text_to_rr_type(string text, uint16_t& type) {
+    for (char& c : text) {
+        c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+    }
+    for (const auto& known : RR_TYPES) {
+        if (text == known.first) {
+            type = known.second;
+            return true;
+        }
+    }
+    if (text.rfind("TYPE", 0) == 0) {
+        text = text.substr(4);
+    }
+    if (text.empty() || text.find_first_not_of("0123456789") != string::npos || text.size() > 5) {
+        return false;
+    }
+    unsigned long value = stoul(text);
+    type = static_cast<uint16_t>(value);
+    return value <= 65535;
+}
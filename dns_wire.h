@@ -0,0 +1,142 @@
+#ifndef DNS_WIRE_H
+#define DNS_WIRE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Longest wire-format name, terminating zero label included (RFC 1035 2.3.4)
+constexpr size_t MAX_WIRE_NAME = 255;
+
+// Largest UDP reply to a client without EDNS (RFC 1035 4.2.1)
+constexpr size_t CLASSIC_UDP_SIZE = 512;
+
+// A single-question query validated in place. The name is never decoded to
+// dotted text: qname points into the packet, lower holds the same wire bytes
+// ASCII-lowercased, and hash covers lower. Both come out of one pass over
+// the name, so caches and local zones can key on lower directly.
+struct QueryView {
+    uint16_t id = 0;                // network order, echoed back as is
+    uint16_t flags = 0;
+    uint16_t arcount = 0;
+    uint16_t qtype = 0;
+    uint16_t qclass = 0;
+    uint8_t rcode = 0;              // FORMERR when parse_query refuses the question itself
+    bool edns = false;              // carried an OPT record (RFC 6891)
+    uint8_t edns_version = 0;
+    uint16_t edns_udp_size = 0;     // as advertised; callers clamp it
+    const uint8_t* qname = nullptr;
+    size_t qname_len = 0;           // wire bytes, zero label included
+    size_t question_end = 0;        // packet offset just past QCLASS
+    uint64_t hash = 0;              // hash_wire_name(lower, qname_len)
+    uint8_t lower[MAX_WIRE_NAME + 9];  // zero-padded past qname_len for word-wise hashing
+
+    string_view key() const { return {reinterpret_cast<const char*>(lower), qname_len}; }
+    const uint8_t* question() const { return qname; }
+    size_t question_len() const { return question_end - 12; }
+};
+
+// False for anything that is not a standard single-question query with an
+// uncompressed name, or whose OPT record runs past the packet; such packets
+// are dropped without a reply. A query whose name exceeds MAX_WIRE_NAME is
+// refused with rcode set to FORMERR, for the caller to answer.
+bool parse_query(const uint8_t* data, size_t len, QueryView& query);
+
+// The name hash consumes 8-byte little-endian words, zero-padding the last.
+// Under SSE4.2 each step is CRC32C, which the parser runs on the crc32
+// instruction; the bitwise form here yields the same value in constant
+// expressions, so tables built at compile time agree with the parser.
+#ifdef __SSE4_2__
+constexpr uint32_t WIRE_HASH_KIND = 1;  // CRC32C; recorded in compiled zone files
+#else
+constexpr uint32_t WIRE_HASH_KIND = 2;  // multiply-rotate
+#endif
+
+constexpr uint64_t wire_hash_step(uint64_t h, uint64_t word) {
+#ifdef __SSE4_2__
+    uint32_t crc = static_cast<uint32_t>(h);
+    for (int i = 0; i < 8; ++i) {
+        crc ^= static_cast<uint8_t>(word >> (8 * i));
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+        }
+    }
+    return crc;
+#else
+    h ^= word;
+    h *= 0x9E3779B97F4A7C15ull;
+    return (h << 31) | (h >> 33);
+#endif
+}
+
+// murmur3 finalizer: the cache indexes shards and sets by the low bits and
+// tags by the high ones, so every bit has to depend on every input bit
+constexpr uint64_t wire_hash_finish(uint64_t h, size_t len) {
+    h ^= static_cast<uint64_t>(len) << 32;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+constexpr uint64_t hash_wire_name_constexpr(const uint8_t* name, size_t len) {
+    uint64_t h = 0;
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t word = 0;
+        for (size_t b = 0; b < 8 && i + b < len; ++b) {
+            word |= static_cast<uint64_t>(name[i + b]) << (8 * b);
+        }
+        h = wire_hash_step(h, word);
+    }
+    return wire_hash_finish(h, len);
+}
+
+// Hash of an already-lowercased wire name; matches QueryView::hash
+uint64_t hash_wire_name(const uint8_t* name, size_t len);
+inline uint64_t hash_wire_name(string_view name) {
+    return hash_wire_name(reinterpret_cast<const uint8_t*>(name.data()), name.size());
+}
+
+// Dotted text <-> lowercased wire format, for configuration and logging
+bool text_to_wire(const string& text, string& wire);
+string wire_to_text(string_view wire);
+
+// RR types the local zones build answers for
+constexpr uint16_t TYPE_A = 1;
+constexpr uint16_t TYPE_NS = 2;
+constexpr uint16_t TYPE_CNAME = 5;
+constexpr uint16_t TYPE_PTR = 12;
+constexpr uint16_t TYPE_MX = 15;
+constexpr uint16_t TYPE_TXT = 16;
+constexpr uint16_t TYPE_AAAA = 28;
+constexpr uint16_t TYPE_SRV = 33;
+
+constexpr uint16_t TYPE_OPT = 41;
+
+// An OPT pseudo-record (RFC 6891 6.1.2) for a reply: root owner, no
+// options, advertising udp_size. ext_rcode holds RCODE bits above the
+// header's four, so 1 makes BADVERS.
+constexpr size_t OPT_RR_SIZE = 11;
+inline size_t write_opt(uint8_t* out, uint16_t udp_size, uint8_t ext_rcode = 0) {
+    const uint8_t opt[OPT_RR_SIZE] = {0, 0, TYPE_OPT, static_cast<uint8_t>(udp_size >> 8),
+                                      static_cast<uint8_t>(udp_size), ext_rcode, 0, 0, 0, 0, 0};
+    for (size_t i = 0; i < OPT_RR_SIZE; ++i) {
+        out[i] = opt[i];
+    }
+    return OPT_RR_SIZE;
+}
+
+// Mnemonic ("AAAA") or RFC 3597 form ("TYPE28"), case-insensitive
+bool text_to_rr_type(string text, uint16_t& type);
+
+// Keys a question by name and type, for the cache and the local zones alike
+constexpr uint64_t question_hash(uint64_t name_hash, uint16_t qtype) {
+    return name_hash ^ (qtype * 0x9E3779B97F4A7C15ull);
+}
+
+#endif // DNS_WIRE_H
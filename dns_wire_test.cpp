@@ -0,0 +1,73 @@
+#include "dns_wire.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+// A QUERY for type A whose name is wire_len bytes, zero label included,
+// made of 63-byte labels and one shorter one to make up the rest
+static vector<uint8_t> make_query(size_t wire_len) {
+    vector<uint8_t> packet = {0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    size_t left = wire_len - 1;
+    while (left > 0) {
+        size_t label = min<size_t>(63, left - 1);
+        if (left - (label + 1) == 1) {
+            label--;  // a lone length byte would be an empty label
+        }
+        packet.push_back(static_cast<uint8_t>(label));
+        packet.insert(packet.end(), label, 'a');
+        left -= label + 1;
+    }
+    packet.push_back(0);
+    packet.insert(packet.end(), {0x00, 0x01, 0x00, 0x01});
+    return packet;
+}
+
+static void test_name_at_limit() {
+    vector<uint8_t> packet = make_query(MAX_WIRE_NAME);
+    QueryView query;
+    CHECK(parse_query(packet.data(), packet.size(), query));
+    CHECK(query.qname_len == MAX_WIRE_NAME);
+    CHECK(query.question_len() == MAX_WIRE_NAME + 4);
+    CHECK(query.qtype == 1);
+    CHECK(query.hash == hash_wire_name(query.lower, query.qname_len));
+}
+
+static void test_name_past_limit() {
+    vector<uint8_t> packet = make_query(MAX_WIRE_NAME + 1);
+    QueryView query;
+    CHECK(!parse_query(packet.data(), packet.size(), query));
+    CHECK(query.rcode == 1);
+    CHECK(memcmp(&query.id, packet.data(), 2) == 0);
+}
+
+static void test_malformed_is_dropped() {
+    vector<uint8_t> packet = make_query(16);
+    packet[2] |= 0x80;  // a response
+    QueryView query;
+    CHECK(!parse_query(packet.data(), packet.size(), query));
+    CHECK(query.rcode == 0);
+}
+
+int main() {
+    test_name_at_limit();
+    test_name_past_limit();
+    test_malformed_is_dropped();
+    if (failures) {
+        fprintf(stderr, "dns_wire_test: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("dns_wire_test: all tests passed\n");
+    return 0;
+}
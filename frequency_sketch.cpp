@@ -0,0 +1,31 @@
+#include "frequency_sketch.h"
+
+using namespace std;
+
+void FrequencySketch::init(size_t entries, uint64_t seed) {
+    size_t counters = 64;
+    while (counters < 4 * entries) {
+        counters <<= 1;
+    }
+    index_mask = counters - 1;
+    row_words = counters / 16;
+    words.reset(new atomic<uint64_t>[ROWS * row_words]());
+
+    // splitmix64, so each row indexes by an unrelated function of the key
+    for (size_t row = 0; row < ROWS; ++row) {
+        seed += 0x9E3779B97F4A7C15ull;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        seeds[row] = z ^ (z >> 31);
+    }
+}
+
+void FrequencySketch::age() {
+    // Halving every nibble at once: shift the word, then clear the bit
+    // each counter received from its neighbour
+    for (size_t i = 0; i < ROWS * row_words; ++i) {
+        uint64_t value = words[i].load(memory_order_relaxed);
+        words[i].store((value >> 1) & 0x7777777777777777ull, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef FREQUENCY_SKETCH_H
+#define FREQUENCY_SKETCH_H
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Count-min sketch of 4-bit counters for TinyLFU admission: four rows of
+// four counters per tracked entry, packed sixteen to a word, so estimating
+// a key's recent popularity costs four loads from a table of eight bytes
+// per entry; narrower rows fill up before they are aged. Counters
+// saturate at 15 and age() halves them all, so the sketch tracks recent
+// frequency rather than all-time counts.
+//
+// Updates are relaxed loads and stores rather than read-modify-writes:
+// concurrent increments of one word may lose a count, which an estimate
+// tolerates, and readers never contend on a locked instruction.
+class FrequencySketch {
+public:
+    static constexpr uint32_t MAX_COUNT = 15;
+
+    // A seed per instance keeps crafted names from aiming at the same
+    // counters as a known hot name
+    void init(size_t entries, uint64_t seed);
+
+    void increment(uint64_t key, uint32_t n = 1) {
+        for (size_t row = 0; row < ROWS; ++row) {
+            size_t index = counter_index(key, row);
+            atomic<uint64_t>& word = words[row * row_words + index / 16];
+            unsigned shift = (index % 16) * 4;
+            uint64_t value = word.load(memory_order_relaxed);
+            uint32_t count = (value >> shift) & MAX_COUNT;
+            if (count < MAX_COUNT) {
+                uint64_t add = n < MAX_COUNT - count ? n : MAX_COUNT - count;
+                word.store(value + (add << shift), memory_order_relaxed);
+            }
+        }
+    }
+
+    uint32_t estimate(uint64_t key) const {
+        uint32_t smallest = MAX_COUNT;
+        for (size_t row = 0; row < ROWS; ++row) {
+            size_t index = counter_index(key, row);
+            uint64_t value = words[row * row_words + index / 16].load(memory_order_relaxed);
+            uint32_t count = (value >> ((index % 16) * 4)) & MAX_COUNT;
+            smallest = count < smallest ? count : smallest;
+        }
+        return smallest;
+    }
+
+    void age();
+
+private:
+    static constexpr size_t ROWS = 4;
+
+    unique_ptr<atomic<uint64_t>[]> words;
+    size_t row_words = 0;
+    size_t index_mask = 0;
+    uint64_t seeds[ROWS] = {};
+
+    size_t counter_index(uint64_t key, size_t row) const {
+        uint64_t h = (key ^ seeds[row]) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(h >> 32) & index_mask;
+    }
+};
+
+#endif // FREQUENCY_SKETCH_H
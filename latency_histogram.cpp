@@ -0,0 +1,83 @@
+#include "latency_histogram.h"
+
+using namespace std;
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum_ns += other.sum_ns;
+}
+
+uint64_t LatencyHistogram::percentile_ns(double q) const {
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * total);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return bucket_lower(i) + bucket_width(i) / 2;
+        }
+    }
+    return max_ns();
+}
+
+uint64_t LatencyHistogram::max_ns() const {
+    for (size_t i = NUM_BUCKETS; i-- > 0;) {
+        if (counts[i]) {
+            return bucket_lower(i) + bucket_width(i) - 1;
+        }
+    }
+    return 0;
+}
+
+atomic<uint64_t> LatencyRecorder::next_instance_id{1};
+
+LatencyRecorder::LatencyRecorder(size_t series)
+    : num_series(series), instance_id(next_instance_id.fetch_add(1)) {}
+
+LatencyRecorder::ThreadSeries* LatencyRecorder::local_series() {
+    // Same scheme as the cache's hit counters: a thread normally records
+    // into one recorder, so a few remembered bindings cover it
+    struct Binding {
+        uint64_t instance = 0;
+        ThreadSeries* series = nullptr;
+    };
+    thread_local array<Binding, 4> bindings;
+    thread_local size_t next_binding = 0;
+
+    for (const auto& binding : bindings) {
+        if (binding.instance == instance_id) {
+            return binding.series;
+        }
+    }
+
+    auto* series = new ThreadSeries[num_series]();
+    {
+        lock_guard<mutex> lock(threads_mutex);
+        threads.emplace_back(series);
+    }
+    bindings[next_binding++ % bindings.size()] = {instance_id, series};
+    return series;
+}
+
+LatencyHistogram LatencyRecorder::snapshot(size_t series) const {
+    LatencyHistogram merged;
+    lock_guard<mutex> lock(threads_mutex);
+    for (const auto& thread_series : threads) {
+        const ThreadSeries& local = thread_series[series];
+        for (size_t i = 0; i < LatencyHistogram::NUM_BUCKETS; ++i) {
+            uint64_t n = local.counts[i].load(memory_order_relaxed);
+            merged.counts[i] += n;
+            merged.total += n;
+        }
+        merged.sum_ns += local.sum_ns.load(memory_order_relaxed);
+    }
+    return merged;
+}
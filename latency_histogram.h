@@ -0,0 +1,99 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Log-linear (HDR-style) histogram of nanosecond latencies: each power of
+// two is split into 2^SUB_BITS equal buckets, so every recorded value is
+// off by at most about 3% whatever its magnitude, in a fixed 9 KB.
+class LatencyHistogram {
+public:
+    static constexpr unsigned SUB_BITS = 5;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
+    static constexpr unsigned MAX_MSB = 39;  // ~18 minutes; longer values land in the last bucket
+    static constexpr size_t NUM_BUCKETS = (MAX_MSB - SUB_BITS + 2) * SUB_BUCKETS;
+
+    static size_t bucket_of(uint64_t ns) {
+        if (ns < SUB_BUCKETS) {
+            return static_cast<size_t>(ns);
+        }
+        unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+        if (msb > MAX_MSB) {
+            return NUM_BUCKETS - 1;
+        }
+        unsigned shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((ns >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Smallest value that lands in bucket, and the width of its range
+    static uint64_t bucket_lower(size_t bucket) {
+        size_t group = bucket / SUB_BUCKETS;
+        size_t offset = bucket % SUB_BUCKETS;
+        return group == 0 ? offset : (SUB_BUCKETS + offset) << (group - 1);
+    }
+    static uint64_t bucket_width(size_t bucket) {
+        size_t group = bucket / SUB_BUCKETS;
+        return group == 0 ? 1 : uint64_t(1) << (group - 1);
+    }
+
+    array<uint64_t, NUM_BUCKETS> counts{};
+    uint64_t total = 0;
+    uint64_t sum_ns = 0;
+
+    void merge(const LatencyHistogram& other);
+
+    // Midpoint of the bucket holding the q-th quantile (0 < q <= 1), 0 if empty
+    uint64_t percentile_ns(double q) const;
+    uint64_t max_ns() const;
+    double mean_ns() const { return total ? static_cast<double>(sum_ns) / total : 0.0; }
+};
+
+// One histogram per series per recording thread, merged only when read.
+// record() is a thread-local lookup and two single-writer relaxed stores:
+// no lock, no shared counter line, and nothing that grows with traffic.
+class LatencyRecorder {
+public:
+    explicit LatencyRecorder(size_t num_series);
+
+    LatencyRecorder(const LatencyRecorder&) = delete;
+    LatencyRecorder& operator=(const LatencyRecorder&) = delete;
+
+    void record(size_t series, chrono::nanoseconds elapsed) {
+        uint64_t ns = elapsed.count() > 0 ? static_cast<uint64_t>(elapsed.count()) : 0;
+        ThreadSeries& local = local_series()[series];
+        bump(local.counts[LatencyHistogram::bucket_of(ns)], 1);
+        bump(local.sum_ns, ns);
+    }
+
+    // Everything recorded into series so far, across all threads
+    LatencyHistogram snapshot(size_t series) const;
+
+private:
+    struct ThreadSeries {
+        atomic<uint64_t> counts[LatencyHistogram::NUM_BUCKETS];
+        atomic<uint64_t> sum_ns;
+    };
+
+    static void bump(atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    size_t num_series;
+    static atomic<uint64_t> next_instance_id;
+    uint64_t instance_id;
+    mutable mutex threads_mutex;
+    vector<unique_ptr<ThreadSeries[]>> threads;
+
+    ThreadSeries* local_series();
+};
+
+#endif // LATENCY_HISTOGRAM_H
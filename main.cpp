@@ -1,24 +1,75 @@
 #include "dns_server.h"
 #include <iostream>
 #include <signal.h>
+#include <unistd.h>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 
 using namespace std;
 
 unique_ptr<DNSServer> server;
 
-void signal_handler(int signum) {
-    cout << "\nReceived signal " << signum << ", shutting down..." << endl;
-    if (server) {
-        server->stop();
+// Set by SIGHUP; the main loop performs the reload outside signal context
+volatile sig_atomic_t reload_requested = 0;
+// Set by SIGINT/SIGTERM; the main loop drains and stops the server
+volatile sig_atomic_t stop_requested = 0;
+
+// Wakes the stats thread so main can join it before stopping the server
+mutex stats_mutex;
+condition_variable stats_wake;
+bool stats_stop = false;
+
+// Built-in local names; their reply templates are built by the compiler
+static constexpr StaticLocalDomain builtin_local_domains[] = {
+    make_local_domain("localhost", 127, 0, 0, 1),
+    make_local_domain("router.local", 192, 168, 1, 1),
+    make_local_domain("dns.local", 192, 168, 1, 1),
+    make_local_domain("server.local", 192, 168, 1, 100),
+    
+    // Performance test domains
+    make_local_domain("test1.local", 192, 168, 1, 101),
+    make_local_domain("test2.local", 192, 168, 1, 102),
+    make_local_domain("test3.local", 192, 168, 1, 103),
+    make_local_domain("test4.local", 192, 168, 1, 104),
+    make_local_domain("test5.local", 192, 168, 1, 105),
+    make_local_domain("test6.local", 192, 168, 1, 106),
+    make_local_domain("test7.local", 192, 168, 1, 107),
+    make_local_domain("test8.local", 192, 168, 1, 108),
+    make_local_domain("test9.local", 192, 168, 1, 109),
+    make_local_domain("test10.local", 192, 168, 1, 110),
+};
+
+void signal_handler(int) {
+    if (stop_requested) {
+        _exit(1);  // a second signal skips the drain
+    }
+    stop_requested = 1;
+}
+
+void reload_handler(int) {
+    reload_requested = 1;
+}
+
+void print_latency(const char* path, const DNSServer::LatencySummary& summary) {
+    if (summary.count == 0) {
+        return;
     }
-    exit(0);
+    cout << path << " latency (" << summary.count << " replies): p50 " << summary.p50_ms
+         << "ms, p95 " << summary.p95_ms << "ms, p99 " << summary.p99_ms
+         << "ms, max " << summary.max_ms << "ms" << endl;
 }
 
 void print_stats_periodically() {
     while (true) {
-        this_thread::sleep_for(chrono::seconds(30));
+        {
+            unique_lock<mutex> lock(stats_mutex);
+            if (stats_wake.wait_for(lock, chrono::seconds(30), [] { return stats_stop; })) {
+                return;
+            }
+        }
         
         if (server) {
             auto stats = server->get_performance_stats();
@@ -27,10 +78,18 @@ void print_stats_periodically() {
             cout << "Total queries: " << stats.total_queries << endl;
             cout << "Cache hits: " << stats.cache_hits << endl;
             cout << "Local domain hits: " << stats.local_domain_hits << endl;
+            cout << "Coalesced upstream queries: " << stats.coalesced_queries << endl;
+            cout << "Refresh-ahead prefetches: " << stats.prefetches << endl;
             cout << "Cache hit ratio: " << (stats.cache_hit_ratio * 100) << "%" << endl;
+            auto cache_stats = server->get_cache_stats();
+            cout << "Cache entries: " << cache_stats.size << " / " << cache_stats.capacity
+                 << " (" << cache_stats.evictions << " evictions)" << endl;
             cout << "Average response time: " << stats.avg_response_time_ms << "ms" << endl;
             cout << "95th percentile: " << stats.p95_response_time_ms << "ms" << endl;
             cout << "99th percentile: " << stats.p99_response_time_ms << "ms" << endl;
+            print_latency("Local", stats.local);
+            print_latency("Cached", stats.cached);
+            print_latency("Upstream", stats.upstream);
             cout << "====================================\n" << endl;
         }
     }
@@ -41,33 +100,126 @@ int main(int argc, char* argv[]) {
         // Set up signal handlers
         signal(SIGINT, signal_handler);
         signal(SIGTERM, signal_handler);
+        signal(SIGHUP, reload_handler);
         
         // Parse command line arguments
-        uint16_t port = 5353;  // Default to 5353 to avoid needing root privileges
-        if (argc > 1) {
-            port = static_cast<uint16_t>(std::stoi(argv[1]));
+        ServerConfig config;
+        config.port = 5353;  // Default to 5353 to avoid needing root privileges
+        std::vector<std::pair<std::string, uint16_t>> upstreams;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--upstream" && i + 1 < argc) {
+                std::string spec = argv[++i];  // ip[:port]
+                auto colon = spec.find(':');
+                if (colon == std::string::npos) {
+                    upstreams.emplace_back(spec, 53);
+                } else {
+                    upstreams.emplace_back(spec.substr(0, colon),
+                                           static_cast<uint16_t>(std::stoi(spec.substr(colon + 1))));
+                }
+            } else if (arg == "--zone" && i + 1 < argc) {
+                config.zone_files.push_back(argv[++i]);
+            } else if (arg == "--max-ttl" && i + 1 < argc) {
+                config.cache_max_ttl = std::stoul(argv[++i]);
+            } else if (arg == "--negative-max-ttl" && i + 1 < argc) {
+                config.negative_max_ttl = std::stoul(argv[++i]);
+            } else if (arg == "--serve-stale" && i + 1 < argc) {
+                config.serve_stale_s = std::stoul(argv[++i]);
+            } else if (arg == "--prefetch" && i + 1 < argc) {
+                config.prefetch_fraction = std::stod(argv[++i]);
+            } else if (arg == "--prefetch-min-hits" && i + 1 < argc) {
+                config.prefetch_min_hits = std::stoul(argv[++i]);
+            } else if (arg == "--metrics" && i + 1 < argc) {
+                std::string spec = argv[++i];  // [ip:]port
+                auto colon = spec.rfind(':');
+                if (colon != std::string::npos) {
+                    config.metrics_address = spec.substr(0, colon);
+                    spec = spec.substr(colon + 1);
+                }
+                config.metrics_port = static_cast<uint16_t>(std::stoi(spec));
+            } else if (arg == "--cache-snapshot" && i + 1 < argc) {
+                config.cache_snapshot = argv[++i];
+            } else if (arg == "--snapshot-interval" && i + 1 < argc) {
+                config.snapshot_interval_s = std::stoul(argv[++i]);
+            } else if (arg == "--upstream-timeout" && i + 1 < argc) {
+                config.upstream_timeout_ms = std::stoul(argv[++i]);
+            } else if (arg == "--hedge") {
+                config.upstream_hedging = true;
+            } else if (arg == "--workers" && i + 1 < argc) {
+                config.num_workers = std::stoul(argv[++i]);
+            } else if (arg == "--cache-size" && i + 1 < argc) {
+                config.cache_capacity = std::stoul(argv[++i]);
+            } else if (arg == "--cache-shards" && i + 1 < argc) {
+                config.cache_shards = std::stoul(argv[++i]);
+            } else if (arg == "--cache-memory-mb" && i + 1 < argc) {
+                config.cache_memory_bytes = std::stoul(argv[++i]) * 1024 * 1024;
+            } else if (arg == "--cache-locked-reads") {
+                config.cache_lock_free_reads = false;
+            } else if (arg == "--no-cache-admission") {
+                config.cache_admission = false;
+            } else if (arg == "--batch" && i + 1 < argc) {
+                config.batch_size = std::stoul(argv[++i]);
+            } else if (arg == "--io-uring") {
+                config.io_engine = IOEngine::IoUring;
+            } else if (arg == "--no-reuseport") {
+                config.reuseport = false;
+            } else if (arg == "--no-cpu-steering") {
+                config.cpu_steering = false;
+            } else if (arg == "--no-pin-workers") {
+                config.pin_workers = false;
+            } else if (arg == "--cache-per-node") {
+                config.cache_per_node = true;
+            } else if (arg == "--client-rate" && i + 1 < argc) {
+                config.client_rate = std::stoul(argv[++i]);
+            } else if (arg == "--client-burst" && i + 1 < argc) {
+                config.client_burst = std::stoul(argv[++i]);
+            } else if (arg == "--rrl" && i + 1 < argc) {
+                config.rrl_rate = std::stoul(argv[++i]);
+            } else if (arg == "--rate-slip" && i + 1 < argc) {
+                config.rate_slip = std::stoul(argv[++i]);
+            } else if (arg == "--rate-prefix" && i + 1 < argc) {
+                config.rate_prefix = std::stoul(argv[++i]);
+            } else if (arg == "--edns-size" && i + 1 < argc) {
+                config.edns_udp_size = static_cast<uint16_t>(std::stoul(argv[++i]));
+            } else if (arg == "--no-tcp") {
+                config.tcp = false;
+            } else if (arg == "--tcp-max-connections" && i + 1 < argc) {
+                config.tcp_max_connections = std::stoul(argv[++i]);
+            } else if (arg == "--tcp-max-pipelined" && i + 1 < argc) {
+                config.tcp_max_pipelined = std::max<size_t>(1, std::stoul(argv[++i]));  // 0 would never read
+            } else if (arg == "--trace-file" && i + 1 < argc) {
+                config.trace_file = argv[++i];
+            } else if (arg == "--trace-sample" && i + 1 < argc) {
+                config.trace_sample = std::stoul(argv[++i]);
+            } else if (arg == "--slow-query-us" && i + 1 < argc) {
+                config.slow_query_us = std::stoul(argv[++i]);
+            } else if (arg == "--drain-timeout" && i + 1 < argc) {
+                config.drain_timeout_ms = std::stoul(argv[++i]);
+            } else if (arg == "--tcp-idle-timeout" && i + 1 < argc) {
+                config.tcp_idle_timeout_ms = std::stoul(argv[++i]);
+            } else {
+                config.port = static_cast<uint16_t>(std::stoi(arg));
+            }
         }
         
-        std::cout << "Starting Ultra-Fast C++ DNS Server on port " << port << std::endl;
+        std::cout << "Starting Ultra-Fast C++ DNS Server on port " << config.port << std::endl;
         
         // Create and configure server
-        server = std::make_unique<DNSServer>(port);
-        
-        // Add some common upstream resolvers
-        server->add_upstream_resolver("8.8.8.8", 53);     // Google DNS
-        server->add_upstream_resolver("1.1.1.1", 53);     // Cloudflare DNS
-        server->add_upstream_resolver("208.67.222.222", 53); // OpenDNS
+        server = std::make_unique<DNSServer>(config);
         
-        // Add local domain examples for ultra-fast responses
-        server->add_local_domain("localhost", "127.0.0.1");
-        server->add_local_domain("router.local", "192.168.1.1");
-        server->add_local_domain("dns.local", "192.168.1.1");
-        server->add_local_domain("server.local", "192.168.1.100");
+        // Add some common upstream resolvers unless overridden with --upstream
+        if (upstreams.empty()) {
+            server->add_upstream_resolver("8.8.8.8", 53);     // Google DNS
+            server->add_upstream_resolver("1.1.1.1", 53);     // Cloudflare DNS
+            server->add_upstream_resolver("208.67.222.222", 53); // OpenDNS
+        }
+        for (const auto& upstream : upstreams) {
+            server->add_upstream_resolver(upstream.first, upstream.second);
+        }
         
-        // Performance test domains
-        for (int i = 1; i <= 10; ++i) {
-            server->add_local_domain("test" + std::to_string(i) + ".local", 
-                                   "192.168.1." + std::to_string(100 + i));
+        // Local domain examples for ultra-fast responses, encoded at compile time
+        for (const auto& domain : builtin_local_domains) {
+            server->add_local_domain(domain);
         }
         
         // Start the server
@@ -78,30 +230,34 @@ int main(int argc, char* argv[]) {
         
         // Start stats thread
         std::thread stats_thread(print_stats_periodically);
-        stats_thread.detach();
         
         std::cout << "DNS Server is running. Performance targets:" << std::endl;
         std::cout << "  - Local domains: < 50μs response time" << std::endl;
         std::cout << "  - Cached domains: < 200μs response time" << std::endl;
-        std::cout << "  - Cache size: 8192 entries with 16 shards" << std::endl;
-        std::cout << "  - Worker threads: " << std::thread::hardware_concurrency() << std::endl;
-        std::cout << "\nPress Ctrl+C to stop the server\n" << std::endl;
+        auto cache_stats = server->get_cache_stats();
+        std::cout << "  - Cache size: " << cache_stats.capacity << " entries with "
+                  << cache_stats.shards << " shards" << std::endl;
+        std::cout << "  - Worker threads: " << server->worker_count() << std::endl;
+        std::cout << "\nPress Ctrl+C to stop the server, send SIGHUP to reload zone files\n" << std::endl;
         
-        // Performance benchmark
-        std::cout << "Running initial performance benchmark..." << std::endl;
-        
-        auto start = std::chrono::high_resolution_clock::now();
-        for (int i = 0; i < 1000; ++i) {
+        while (!stop_requested) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (reload_requested) {
+                reload_requested = 0;
+                server->reload_local_zones();
+            }
         }
-        auto end = std::chrono::high_resolution_clock::now();
-        
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-        std::cout << "Benchmark complete. Average operation time: " 
-                  << (duration.count() / 1000.0) << "μs" << std::endl;
         
-        while (true) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+        // The stats thread reads members stop() tears down
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            stats_stop = true;
         }
+        stats_wake.notify_one();
+        stats_thread.join();
+        
+        std::cout << "\nShutting down, draining upstream lookups..." << std::endl;
+        server->stop();
         
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
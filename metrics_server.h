@@ -0,0 +1,41 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+// Minimal HTTP/1.0 endpoint for Prometheus scrapes: GET /metrics returns
+// whatever the renderer produces, anything else a 404. One thread serves
+// one connection at a time and closes it after the reply, which is all a
+// scraper needs and keeps the server off the query path entirely.
+class MetricsServer {
+public:
+    using Renderer = function<string()>;
+
+    MetricsServer(const string& address, uint16_t port, Renderer render);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    bool start(string& error);
+    void stop();
+
+private:
+    string address;
+    uint16_t port;
+    Renderer render;
+    int listen_fd = -1;
+    atomic<bool> running{false};
+    thread serve_thread;
+
+    void serve_loop();
+    void serve_connection(int fd);
+};
+
+#endif // METRICS_SERVER_H
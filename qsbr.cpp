@@ -0,0 +1,44 @@
+#include "qsbr.h"
+#include <thread>
+#include <chrono>
+
+using namespace std;
+
+QsbrDomain::QsbrDomain(size_t count)
+    : readers(new ReaderState[count > 0 ? count : 1]), num_readers(count) {}
+
+void QsbrDomain::online(size_t reader) {
+    // The fence orders this store before the reader's next pointer load, so
+    // a writer that misses the store is sure this reader sees its swap
+    readers[reader].epoch.store(global_epoch.load(memory_order_acquire), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void QsbrDomain::offline(size_t reader) {
+    atomic_thread_fence(memory_order_seq_cst);
+    readers[reader].epoch.store(OFFLINE, memory_order_release);
+}
+
+void QsbrDomain::quiescent(size_t reader) {
+    atomic_thread_fence(memory_order_seq_cst);
+    readers[reader].epoch.store(global_epoch.load(memory_order_acquire), memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void QsbrDomain::synchronize() {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t target = global_epoch.fetch_add(1, memory_order_acq_rel) + 1;
+
+    // Grace periods are rare (reloads) and short (one receive batch), so
+    // polling with a sleep beats any wakeup machinery on the read side
+    for (size_t i = 0; i < num_readers; ++i) {
+        for (;;) {
+            uint64_t epoch = readers[i].epoch.load(memory_order_acquire);
+            if (epoch == OFFLINE || epoch >= target) {
+                break;
+            }
+            this_thread::sleep_for(chrono::microseconds(200));
+        }
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+}
@@ -0,0 +1,50 @@
+#ifndef QSBR_H
+#define QSBR_H
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Quiescent-state-based reclamation for data that workers read without
+// locks. A writer publishes a replacement with an atomic pointer swap, then
+// synchronize() waits out a grace period: until every reader has either
+// passed a quiescent state (holding no references) or gone offline. Only
+// then may the old version be freed.
+//
+// Readers pay a store and a fence per state change (once per receive batch
+// in the workers) and nothing per access.
+// A reader that blocks in a syscall must go offline first, or it would
+// stall every grace period until its next packet arrives.
+class QsbrDomain {
+public:
+    explicit QsbrDomain(size_t num_readers);
+
+    QsbrDomain(const QsbrDomain&) = delete;
+    QsbrDomain& operator=(const QsbrDomain&) = delete;
+
+    // Reader side; each reader index is used by exactly one thread.
+    // Readers start offline.
+    void online(size_t reader);
+    void offline(size_t reader);
+    void quiescent(size_t reader);
+
+    // Writer side: returns once every reference taken before the call has
+    // been dropped. Must not be called from a reader that is online.
+    void synchronize();
+
+private:
+    static constexpr uint64_t OFFLINE = 0;
+
+    struct alignas(64) ReaderState {
+        atomic<uint64_t> epoch{OFFLINE};  // last global epoch observed, or OFFLINE
+    };
+
+    unique_ptr<ReaderState[]> readers;
+    size_t num_readers;
+    alignas(64) atomic<uint64_t> global_epoch{1};
+};
+
+#endif // QSBR_H
@@ -0,0 +1,168 @@
+#include "query_trace.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cerrno>
+#include <cstring>
+
+using namespace std;
+
+static atomic<uint64_t> next_generation{1};
+
+QueryTracer::QueryTracer(const Options& tracer_options)
+    : options(tracer_options), generation(next_generation.fetch_add(1, memory_order_relaxed)) {
+    if (options.sample == 0) {
+        options.sample = 1;
+    }
+}
+
+QueryTracer::~QueryTracer() {
+    stop();
+}
+
+bool QueryTracer::start(string& error) {
+    if (running) {
+        return false;
+    }
+    if (!options.file.empty()) {
+        out = fopen(options.file.c_str(), "wb");
+        if (!out) {
+            error = options.file + ": " + strerror(errno);
+            return false;
+        }
+        char header[32] = "UFDNSTRC";
+        uint32_t version = 1;
+        uint32_t record_size = sizeof(TraceRecord);
+        int64_t realtime_ns =
+            chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        int64_t steady_ns = static_cast<int64_t>(to_ns(chrono::steady_clock::now()));
+        memcpy(header + 8, &version, 4);
+        memcpy(header + 12, &record_size, 4);
+        memcpy(header + 16, &realtime_ns, 8);
+        memcpy(header + 24, &steady_ns, 8);
+        fwrite(header, 1, sizeof(header), out);
+    }
+    running = true;
+    drain_thread = thread(&QueryTracer::drain_loop, this);
+    return true;
+}
+
+void QueryTracer::stop() {
+    running = false;
+    if (drain_thread.joinable()) {
+        drain_thread.join();
+    }
+    drain();
+    if (out) {
+        fclose(out);
+        out = nullptr;
+    }
+}
+
+QueryTracer::Ring* QueryTracer::ring_for_thread() {
+    struct Cached {
+        uint64_t generation = 0;
+        Ring* ring = nullptr;
+    };
+    static thread_local Cached cached;
+    if (cached.generation != generation) {
+        lock_guard<mutex> lock(rings_mutex);
+        rings.push_back(make_unique<Ring>());
+        rings.back()->index = static_cast<uint32_t>(rings.size() - 1);
+        cached.generation = generation;
+        cached.ring = rings.back().get();
+    }
+    return cached.ring;
+}
+
+void QueryTracer::record(const TraceRecord& record) {
+    Ring* ring = ring_for_thread();
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) >= RING_SIZE) {
+        ring->dropped.store(ring->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+    TraceRecord& slot = ring->slots[head & (RING_SIZE - 1)];
+    slot = record;
+    slot.thread = ring->index;
+    ring->head.store(head + 1, memory_order_release);
+}
+
+QueryTracer::Stats QueryTracer::get_stats() const {
+    Stats stats;
+    {
+        lock_guard<mutex> lock(rings_mutex);
+        for (const auto& ring : rings) {
+            stats.recorded += ring->head.load(memory_order_relaxed);
+            stats.dropped += ring->dropped.load(memory_order_relaxed);
+        }
+    }
+    stats.written = written.load(memory_order_relaxed);
+    stats.slow = slow_count.load(memory_order_relaxed);
+    return stats;
+}
+
+void QueryTracer::drain_loop() {
+    while (running) {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        drain();
+    }
+}
+
+void QueryTracer::drain() {
+    vector<Ring*> snapshot;
+    {
+        lock_guard<mutex> lock(rings_mutex);
+        for (const auto& ring : rings) {
+            snapshot.push_back(ring.get());
+        }
+    }
+
+    uint32_t slow_ns = static_cast<uint32_t>(min<int64_t>(
+        chrono::duration_cast<chrono::nanoseconds>(options.slow).count(), UINT32_MAX));
+    size_t slow_lines = 0;
+    uint64_t slow_unlogged = 0;
+    for (Ring* ring : snapshot) {
+        uint64_t tail = ring->tail.load(memory_order_relaxed);
+        uint64_t head = ring->head.load(memory_order_acquire);
+        for (; tail != head; ++tail) {
+            const TraceRecord& record = ring->slots[tail & (RING_SIZE - 1)];
+            if (out && ++sample_count % options.sample == 0) {
+                fwrite(&record, sizeof(record), 1, out);
+                written.fetch_add(1, memory_order_relaxed);
+            }
+            if (slow_ns && record.reply_ns >= slow_ns) {
+                slow_count.fetch_add(1, memory_order_relaxed);
+                if (slow_lines++ < MAX_SLOW_LINES) {
+                    log_slow(record);
+                } else {
+                    slow_unlogged++;
+                }
+            }
+        }
+        // Hands the slots back to the producer only once they are read
+        ring->tail.store(tail, memory_order_release);
+    }
+
+    if (slow_unlogged) {
+        cout << "... and " << slow_unlogged << " more slow queries" << endl;
+    }
+    if (out) {
+        fflush(out);
+    }
+}
+
+void QueryTracer::log_slow(const TraceRecord& record) {
+    static const char* const path_names[] = {"local", "cache", "upstream", "servfail", "limited", "error"};
+    auto us = [](uint32_t ns) { return ns / 1000; };
+
+    ostringstream line;
+    line << "Slow query " << hex << setw(16) << setfill('0') << record.qname_hash << dec << " type " << record.qtype
+         << " via " << path_names[static_cast<size_t>(record.path)] << " rcode " << int(record.rcode) << ": parse "
+         << us(record.parse_ns) << "μs, lookup " << us(record.lookup_ns) << "μs";
+    if (record.upstream_ns) {
+        line << ", upstream " << us(record.upstream_ns) << "μs";
+    }
+    line << ", reply " << us(record.reply_ns) << "μs";
+    cout << line.str() << endl;
+}
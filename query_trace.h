@@ -0,0 +1,134 @@
+#ifndef QUERY_TRACE_H
+#define QUERY_TRACE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// USDT probes (provider "ufdns") at the same points a trace record takes its
+// timestamps, for bpftrace and perf. Each is a single nop until something
+// attaches, so they are built in whenever systemtap's <sys/sdt.h> is around,
+// whether or not tracing is switched on.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define QUERY_PROBE(name, ...) STAP_PROBEV(ufdns, name, __VA_ARGS__)
+#endif
+#endif
+#ifndef QUERY_PROBE
+#define QUERY_PROBE(name, ...) ((void)0)
+#endif
+
+enum class TracePath : uint8_t {
+    Local,
+    Cache,
+    Upstream,
+    Servfail,   // no upstream could answer
+    Limited,    // dropped or slipped by a rate limit
+    Error       // malformed, or answered with an error before any lookup
+};
+
+// One query as written to the trace file: 40 bytes, host byte order. Stage
+// times are nanoseconds after start_ns, 0 for stages the query never reached.
+struct TraceRecord {
+    uint64_t start_ns;          // steady clock, when the query was read
+    uint64_t qname_hash;        // the lookup hash, 0 if unparsed
+    uint32_t parse_ns;
+    uint32_t lookup_ns;         // local names and cache probed
+    uint32_t upstream_ns;       // upstream reply matched
+    uint32_t reply_ns;          // reply queued for sending
+    uint16_t qtype;
+    TracePath path;
+    uint8_t rcode;
+    uint32_t thread;            // ring the record came through, one per thread
+};
+static_assert(sizeof(TraceRecord) == 40, "trace file layout");
+
+// Per-query tracing off the hot path. Each thread that records gets its own
+// single-producer ring, found through a thread_local on first use; record()
+// is a bounds check, a 40-byte copy and a release store, with no locks or
+// shared writes. A background thread drains every ring ten times a second
+// into a binary file (optionally 1 in N records) and a slow-query log on
+// stdout. A record that finds its ring full is dropped and counted.
+//
+// The file starts with a 32-byte header: "UFDNSTRC", a version and the
+// record size (uint32 each), then the realtime and steady clocks (int64 ns)
+// read together at start, to turn start_ns into wall-clock time.
+class QueryTracer {
+public:
+    struct Options {
+        string file;                    // binary trace; empty for none
+        uint32_t sample = 1;            // 1 in sample records go to the file
+        chrono::microseconds slow{0};   // log replies this slow or slower; 0 = no log
+    };
+
+    explicit QueryTracer(const Options& options);
+    ~QueryTracer();
+
+    QueryTracer(const QueryTracer&) = delete;
+    QueryTracer& operator=(const QueryTracer&) = delete;
+
+    bool start(string& error);
+    // Drains what is left; call once nothing records any more
+    void stop();
+
+    void record(const TraceRecord& record);
+
+    static uint64_t to_ns(chrono::steady_clock::time_point t) {
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch()).count());
+    }
+    // Stage time for a record, saturating at about 4.3 s
+    static uint32_t since(chrono::steady_clock::time_point start) {
+        uint64_t ns = to_ns(chrono::steady_clock::now()) - to_ns(start);
+        return ns > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(ns);
+    }
+
+    struct Stats {
+        uint64_t recorded = 0;
+        uint64_t dropped = 0;
+        uint64_t written = 0;       // to the file, after sampling
+        uint64_t slow = 0;          // over the slow-query threshold
+    };
+    Stats get_stats() const;
+
+private:
+    static constexpr size_t RING_SIZE = 4096;  // records per thread, a power of two
+    static constexpr size_t MAX_SLOW_LINES = 20;  // per drain pass; the rest are counted
+
+    struct Ring {
+        TraceRecord slots[RING_SIZE];
+        uint32_t index;
+        alignas(64) atomic<uint64_t> head{0};     // written by the owning thread only
+        atomic<uint64_t> dropped{0};
+        alignas(64) atomic<uint64_t> tail{0};     // written by the drain thread only
+    };
+
+    Options options;
+    uint64_t generation;            // tells this tracer's thread_local rings from an earlier one's
+    FILE* out = nullptr;
+    uint64_t sample_count = 0;
+
+    mutable mutex rings_mutex;
+    vector<unique_ptr<Ring>> rings;
+
+    atomic<bool> running{false};
+    thread drain_thread;
+    atomic<uint64_t> written{0};
+    atomic<uint64_t> slow_count{0};
+
+    Ring* ring_for_thread();
+    void drain_loop();
+    void drain();
+    void log_slow(const TraceRecord& record);
+};
+
+#endif // QUERY_TRACE_H
@@ -0,0 +1,65 @@
+#include "rate_limiter.h"
+#include <random>
+
+using namespace std;
+
+atomic<uint64_t> RateLimiter::next_instance_id{0};
+
+RateLimiter::RateLimiter(size_t bucket_count, uint32_t rate, uint32_t burst, uint32_t slip_every)
+    : slip(slip_every), instance_id(next_instance_id.fetch_add(1, memory_order_relaxed)) {
+    size_t size = 64;
+    while (size < bucket_count) {
+        size <<= 1;
+    }
+    mask = size - 1;
+    buckets.reset(new atomic<uint64_t>[size]());
+
+    random_device rd;
+    seed = (uint64_t(rd()) << 32) | rd();
+
+    interval_ns = 1000000000ull / (rate ? rate : 1);
+    tolerance_ns = interval_ns * ((burst ? burst : (rate ? rate : 1)) - 1);
+}
+
+RateLimiter::Verdict RateLimiter::check(uint64_t key, chrono::steady_clock::time_point now) {
+    uint64_t h = (key ^ seed) * 0x9E3779B97F4A7C15ull;
+    atomic<uint64_t>& bucket = buckets[(h >> 32) & mask];
+
+    uint64_t t = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count());
+    uint64_t tat = bucket.load(memory_order_relaxed);
+    for (;;) {
+        uint64_t start = tat > t ? tat : t;
+        if (start - t > tolerance_ns) {
+            break;
+        }
+        if (bucket.compare_exchange_weak(tat, start + interval_ns, memory_order_relaxed)) {
+            return Verdict::Allow;
+        }
+    }
+
+    // Counted per thread and per limiter, so the decision itself never
+    // contends and each limiter keeps its own cadence. Instance IDs are
+    // sequential, so limiters alive together get distinct counters.
+    struct SlipCounter {
+        uint64_t instance = UINT64_MAX;
+        uint32_t over_limit = 0;
+    };
+    static thread_local SlipCounter counters[8];
+    SlipCounter& counter = counters[instance_id % 8];
+    if (counter.instance != instance_id) {
+        counter = {instance_id, 0};
+    }
+    if (slip && ++counter.over_limit % slip == 0) {
+        slipped.fetch_add(1, memory_order_relaxed);
+        return Verdict::Slip;
+    }
+    dropped.fetch_add(1, memory_order_relaxed);
+    return Verdict::Drop;
+}
+
+RateLimiter::Stats RateLimiter::get_stats() const {
+    Stats stats;
+    stats.dropped = dropped.load(memory_order_relaxed);
+    stats.slipped = slipped.load(memory_order_relaxed);
+    return stats;
+}
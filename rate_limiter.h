@@ -0,0 +1,68 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <netinet/in.h>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Token buckets in a fixed table, one 64-bit word each, checked and charged
+// with a single compare-and-swap and no locks. Each bucket holds the GCRA
+// "theoretical arrival time": a key is within its rate while that time
+// runs no more than burst intervals ahead of now, and each allowed event
+// pushes it one interval further. Denied events leave it alone, so a flood
+// cannot starve its key of the tokens it earns back.
+//
+// Keys hash into the table with a per-instance seed, so a key cannot be
+// aimed at a known victim's bucket. Keys that do share a bucket share its
+// budget, which only ever limits them sooner.
+class RateLimiter {
+public:
+    enum class Verdict {
+        Allow,
+        Drop,
+        Slip    // over the limit, but answer with a cheap truncated reply
+    };
+
+    // rate events per second with bursts of up to burst; every slip-th
+    // event over the limit (counted per thread) is Slip rather than Drop,
+    // 0 drops them all
+    RateLimiter(size_t buckets, uint32_t rate, uint32_t burst, uint32_t slip);
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    Verdict check(uint64_t key, chrono::steady_clock::time_point now);
+
+    // Source address grouped by its leading prefix_len bits, as a key
+    static uint64_t client_key(const sockaddr_in& addr, unsigned prefix_len) {
+        uint32_t ip = ntohl(addr.sin_addr.s_addr);
+        return prefix_len == 0 ? 0 : ip >> (32 - (prefix_len > 32 ? 32 : prefix_len));
+    }
+
+    struct Stats {
+        uint64_t dropped = 0;
+        uint64_t slipped = 0;
+    };
+    Stats get_stats() const;
+
+private:
+    unique_ptr<atomic<uint64_t>[]> buckets;
+    size_t mask;
+    uint64_t seed;
+    uint64_t interval_ns;   // between events at the sustained rate
+    uint64_t tolerance_ns;  // how far ahead of now a bucket may run
+    uint32_t slip;
+    uint64_t instance_id;   // keys this limiter's per-thread slip counter
+
+    static atomic<uint64_t> next_instance_id;
+
+    atomic<uint64_t> dropped{0};
+    atomic<uint64_t> slipped{0};
+};
+
+#endif // RATE_LIMITER_H
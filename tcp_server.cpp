@@ -0,0 +1,382 @@
+#include "tcp_server.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+using namespace std;
+
+TcpServer::TcpServer(uint16_t listen_port, const Limits& connection_limits, QsbrDomain& domain, size_t reader_index,
+                     QueryHandler query_handler)
+    : port(listen_port), limits(connection_limits), qsbr(domain), reader(reader_index),
+      handler(move(query_handler)) {}
+
+TcpServer::~TcpServer() {
+    stop();
+}
+
+bool TcpServer::start(string& error) {
+    if (running) {
+        return false;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (listen_fd < 0 || epoll_fd < 0 || wake_fd < 0) {
+        error = strerror(errno);
+        stop();
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        error = "port " + to_string(port) + ": " + strerror(errno);
+        stop();
+        return false;
+    }
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTENER;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.u64 = WAKEUP;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    running = true;
+    reading = true;
+    loop_thread = thread(&TcpServer::loop, this);
+    return true;
+}
+
+void TcpServer::stop() {
+    {
+        lock_guard<mutex> lock(delivered_mutex);
+        running = false;
+    }
+    if (loop_thread.joinable()) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+        loop_thread.join();
+    }
+    for (auto& entry : connections) {
+        close(entry.second.fd);
+    }
+    connections.clear();
+    open_connections = 0;
+    for (int* fd : {&listen_fd, &epoll_fd, &wake_fd}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void TcpServer::deliver(uint64_t conn, const uint8_t* data, size_t len) {
+    // Checked and written under the lock stop() clears running with, so
+    // wake_fd cannot be closed (or reused) in between
+    lock_guard<mutex> lock(delivered_mutex);
+    if (!running) {
+        return;
+    }
+    bool wake = delivered.empty();  // otherwise a wakeup is already on its way
+    delivered.emplace_back(conn, vector<uint8_t>(data, data + len));
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void TcpServer::stop_reading() {
+    lock_guard<mutex> lock(delivered_mutex);
+    if (!running) {
+        return;
+    }
+    reading = false;
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+TcpServer::Stats TcpServer::get_stats() const {
+    Stats stats;
+    stats.accepted = accepted.load(memory_order_relaxed);
+    stats.rejected = rejected.load(memory_order_relaxed);
+    stats.idle_closed = idle_closed.load(memory_order_relaxed);
+    stats.queries = queries.load(memory_order_relaxed);
+    stats.open = open_connections.load(memory_order_relaxed);
+    return stats;
+}
+
+void TcpServer::loop() {
+    epoll_event events[64];
+    auto next_sweep = chrono::steady_clock::now() + chrono::seconds(1);
+
+    while (running) {
+        qsbr.offline(reader);
+        int n = epoll_wait(epoll_fd, events, 64, 100);
+        qsbr.online(reader);
+
+        for (int i = 0; i < n; ++i) {
+            uint64_t id = events[i].data.u64;
+            if (id == LISTENER) {
+                accept_connections();
+                continue;
+            }
+            if (id == WAKEUP) {
+                uint64_t count;
+                ssize_t ignored = read(wake_fd, &count, sizeof(count));
+                (void)ignored;
+                if (!reading && listen_fd >= 0) {
+                    end_reading();
+                }
+                take_delivered();
+                continue;
+            }
+
+            auto it = connections.find(id);
+            if (it == connections.end()) {
+                continue;  // Closed earlier in this batch
+            }
+            Connection& conn = it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(id);
+                continue;
+            }
+            if (reading && (events[i].events & (EPOLLIN | EPOLLRDHUP)) && !read_from(id, conn)) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_output(conn);
+            }
+            settle(id, conn);
+        }
+
+        auto now = chrono::steady_clock::now();
+        if (now >= next_sweep) {
+            close_idle();
+            next_sweep = now + chrono::seconds(1);
+        }
+    }
+    qsbr.offline(reader);
+}
+
+void TcpServer::accept_connections() {
+    for (;;) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        if (connections.size() >= limits.max_connections) {
+            close(fd);
+            rejected.fetch_add(1, memory_order_relaxed);
+            continue;
+        }
+
+        // Replies are written whole; Nagle would only hold them back
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        uint64_t id = next_id++;
+        Connection conn;
+        conn.fd = fd;
+        conn.events = EPOLLIN | EPOLLRDHUP;
+        conn.last_active = chrono::steady_clock::now();
+        epoll_event ev;
+        ev.events = conn.events;
+        ev.data.u64 = id;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        connections.emplace(id, move(conn));
+        accepted.fetch_add(1, memory_order_relaxed);
+        open_connections.store(connections.size(), memory_order_relaxed);
+    }
+}
+
+bool TcpServer::read_from(uint64_t id, Connection& conn) {
+    // Stops early once the connection has as many lookups in flight as it
+    // may; the rest waits in the socket buffer, which pushes back on the
+    // client through TCP flow control
+    uint8_t chunk[16384];
+    while (conn.awaiting < limits.max_pipelined) {
+        ssize_t n = recv(conn.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (n == 0) {
+            conn.peer_closed = true;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            close_connection(id);
+            return false;
+        }
+        conn.in.insert(conn.in.end(), chunk, chunk + n);
+        conn.last_active = chrono::steady_clock::now();
+        if (!process(id, conn)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TcpServer::process(uint64_t id, Connection& conn) {
+    uint8_t reply[ResponseBatch::MAX_RESPONSE];
+    size_t pos = 0;
+    while (reading && conn.awaiting < limits.max_pipelined && conn.in.size() - pos >= 2) {
+        size_t len = (conn.in[pos] << 8) | conn.in[pos + 1];
+        if (conn.in.size() - pos - 2 < len) {
+            break;
+        }
+        queries.fetch_add(1, memory_order_relaxed);
+        if (!handler(conn.in.data() + pos + 2, len, id, batch)) {
+            batch.clear();
+            close_connection(id);
+            return false;
+        }
+        pos += 2 + len;
+
+        if (batch.size() == 0) {
+            conn.awaiting++;
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            write_reply(conn, reply, batch.copy_out(i, reply));
+        }
+        batch.clear();
+    }
+    conn.in.erase(conn.in.begin(), conn.in.begin() + pos);
+    flush_output(conn);
+    return true;
+}
+
+void TcpServer::write_reply(Connection& conn, const uint8_t* data, size_t len) {
+    if (conn.out.size() - conn.out_sent + len > MAX_OUTPUT) {
+        conn.failed = true;
+        return;
+    }
+    conn.out.push_back(static_cast<uint8_t>(len >> 8));
+    conn.out.push_back(static_cast<uint8_t>(len));
+    conn.out.insert(conn.out.end(), data, data + len);
+}
+
+void TcpServer::flush_output(Connection& conn) {
+    while (conn.out_sent < conn.out.size()) {
+        ssize_t n = send(conn.fd, conn.out.data() + conn.out_sent, conn.out.size() - conn.out_sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                conn.failed = true;
+            }
+            break;
+        }
+        conn.out_sent += static_cast<size_t>(n);
+        conn.last_active = chrono::steady_clock::now();
+    }
+    if (conn.out_sent == conn.out.size()) {
+        conn.out.clear();
+        conn.out_sent = 0;
+    }
+}
+
+bool TcpServer::settle(uint64_t id, Connection& conn) {
+    bool unsent = conn.out_sent < conn.out.size();
+    if (conn.failed || ((conn.peer_closed || !reading) && conn.awaiting == 0 && !unsent)) {
+        close_connection(id);
+        return false;
+    }
+
+    uint32_t wanted = unsent ? static_cast<uint32_t>(EPOLLOUT) : 0;
+    if (reading && !conn.peer_closed && conn.awaiting < limits.max_pipelined) {
+        wanted |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (wanted != conn.events) {
+        epoll_event ev;
+        ev.events = wanted;
+        ev.data.u64 = id;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.events = wanted;
+    }
+    return true;
+}
+
+void TcpServer::take_delivered() {
+    vector<pair<uint64_t, vector<uint8_t>>> replies;
+    {
+        lock_guard<mutex> lock(delivered_mutex);
+        replies.swap(delivered);
+    }
+
+    for (auto& [id, reply] : replies) {
+        auto it = connections.find(id);
+        if (it == connections.end()) {
+            continue;  // The client went away while its lookup was upstream
+        }
+        Connection& conn = it->second;
+        if (conn.awaiting > 0) {
+            conn.awaiting--;
+        }
+        write_reply(conn, reply.data(), reply.size());
+
+        // Queries that arrived while the connection was at its pipelining
+        // limit are already buffered
+        if (process(id, conn)) {
+            settle(id, conn);
+        }
+    }
+}
+
+void TcpServer::end_reading() {
+    close(listen_fd);  // also drops it from the epoll set
+    listen_fd = -1;
+
+    // Connections stop asking for input; those with nothing in flight or
+    // unsent are done now, the rest as their replies go out
+    vector<uint64_t> ids;
+    for (const auto& entry : connections) {
+        ids.push_back(entry.first);
+    }
+    for (uint64_t id : ids) {
+        settle(id, connections.at(id));
+    }
+}
+
+void TcpServer::close_idle() {
+    // RFC 7766 6.2.3: idle connections are closed so they do not pin
+    // server resources; one waiting on an upstream answer is not idle
+    auto cutoff = chrono::steady_clock::now() - limits.idle_timeout;
+    for (auto it = connections.begin(); it != connections.end();) {
+        const Connection& conn = it->second;
+        if (conn.awaiting == 0 && conn.out_sent == conn.out.size() && conn.last_active < cutoff) {
+            close(conn.fd);
+            it = connections.erase(it);
+            idle_closed.fetch_add(1, memory_order_relaxed);
+        } else {
+            ++it;
+        }
+    }
+    open_connections.store(connections.size(), memory_order_relaxed);
+}
+
+void TcpServer::close_connection(uint64_t id) {
+    auto it = connections.find(id);
+    if (it == connections.end()) {
+        return;
+    }
+    close(it->second.fd);  // also drops it from the epoll set
+    connections.erase(it);
+    open_connections.store(connections.size(), memory_order_relaxed);
+}
@@ -0,0 +1,118 @@
+#ifndef TCP_SERVER_H
+#define TCP_SERVER_H
+
+#include "dns_server.h"
+#include <functional>
+#include <unordered_map>
+
+using namespace std;
+
+// DNS over TCP (RFC 7766) on one epoll thread, sharing the workers' local
+// table and cache. A connection may carry any number of length-prefixed
+// queries back to back: local and cached answers are written as soon as
+// each query is read, and misses whenever their upstream reply arrives, so
+// replies leave out of order and one slow lookup never holds up the rest.
+//
+// Replies produced on other threads come in through deliver(), which
+// queues them and wakes the loop with an eventfd. Connection IDs are never
+// reused, so a late reply for a closed connection is simply dropped rather
+// than reaching a newer client on a recycled descriptor.
+class TcpServer {
+public:
+    // Handles one message read from connection conn, queuing an immediate
+    // reply in out or none if the query went upstream; false closes the
+    // connection (the message was not a query)
+    using QueryHandler = function<bool(const uint8_t* data, size_t len, uint64_t conn, ResponseBatch& out)>;
+
+    struct Limits {
+        size_t max_connections = 1024;
+        size_t max_pipelined = 64;      // upstream lookups in flight per connection before reads pause
+        chrono::milliseconds idle_timeout{10000};
+    };
+
+    // The loop is QSBR reader `reader` of qsbr, online while it handles
+    // queries, since replies may point into the local table until copied
+    TcpServer(uint16_t port, const Limits& limits, QsbrDomain& qsbr, size_t reader, QueryHandler handler);
+    ~TcpServer();
+
+    TcpServer(const TcpServer&) = delete;
+    TcpServer& operator=(const TcpServer&) = delete;
+
+    bool start(string& error);
+    void stop();
+    // Drain mode: closes the listener and reads no more queries, but still
+    // delivers replies to lookups in flight; each connection is closed once
+    // it has nothing left to send
+    void stop_reading();
+
+    // Queues a complete reply for conn from any thread
+    void deliver(uint64_t conn, const uint8_t* data, size_t len);
+
+    struct Stats {
+        uint64_t accepted = 0;
+        uint64_t rejected = 0;          // over max_connections
+        uint64_t idle_closed = 0;
+        uint64_t queries = 0;
+        size_t open = 0;
+    };
+    Stats get_stats() const;
+
+private:
+    static constexpr size_t MAX_OUTPUT = 256 * 1024;  // unread replies before a client is dropped
+    static constexpr uint64_t LISTENER = 0;
+    static constexpr uint64_t WAKEUP = 1;
+
+    struct Connection {
+        int fd = -1;
+        vector<uint8_t> in;             // bytes read but not yet a whole message
+        vector<uint8_t> out;            // framed replies, written from out_sent on
+        size_t out_sent = 0;
+        size_t awaiting = 0;            // queries handed upstream
+        bool peer_closed = false;       // the client shut down its side
+        bool failed = false;            // write error, or the client stopped reading replies
+        uint32_t events = 0;            // epoll interest currently registered
+        chrono::steady_clock::time_point last_active;
+    };
+
+    uint16_t port;
+    Limits limits;
+    QsbrDomain& qsbr;
+    size_t reader;
+    QueryHandler handler;
+
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    atomic<bool> running{false};    // cleared under delivered_mutex, so wake_fd outlives every write to it
+    atomic<bool> reading{true};
+    thread loop_thread;
+
+    unordered_map<uint64_t, Connection> connections;  // loop thread only
+    uint64_t next_id = WAKEUP + 1;
+    ResponseBatch batch{-1, 1};         // one query's reply at a time, copied out at once
+
+    mutex delivered_mutex;
+    vector<pair<uint64_t, vector<uint8_t>>> delivered;
+
+    atomic<uint64_t> accepted{0};
+    atomic<uint64_t> rejected{0};
+    atomic<uint64_t> idle_closed{0};
+    atomic<uint64_t> queries{0};
+    atomic<size_t> open_connections{0};
+
+    void loop();
+    void accept_connections();
+    // Each of these returns false once it has closed the connection
+    bool read_from(uint64_t id, Connection& conn);
+    bool process(uint64_t id, Connection& conn);
+    // Closes conn if it is finished, else updates its epoll interest
+    bool settle(uint64_t id, Connection& conn);
+    void write_reply(Connection& conn, const uint8_t* data, size_t len);
+    void flush_output(Connection& conn);
+    void take_delivered();
+    void end_reading();
+    void close_idle();
+    void close_connection(uint64_t id);
+};
+
+#endif // TCP_SERVER_H
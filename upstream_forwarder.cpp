@@ -0,0 +1,487 @@
+#include "upstream_forwarder.h"
+#include "dns_wire.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <iostream>
+
+using namespace std;
+
+UpstreamForwarder::UpstreamForwarder(const vector<pair<string, uint16_t>>& resolvers,
+                                     chrono::milliseconds query_timeout, Completion completion)
+    : timeout(query_timeout), on_complete(move(completion)) {
+    random_device rd;
+    id_state = rd() | 1;
+
+    for (const auto& resolver : resolvers) {
+        if (upstream_fds.size() == MAX_UPSTREAMS) {
+            cerr << "Ignoring upstream resolvers past the first " << MAX_UPSTREAMS << endl;
+            break;
+        }
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(resolver.second);
+        if (inet_pton(AF_INET, resolver.first.c_str(), &addr.sin_addr) != 1) {
+            cerr << "Ignoring invalid upstream resolver " << resolver.first << endl;
+            continue;
+        }
+
+        // Connected socket: the kernel drops datagrams from anyone but this upstream
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            close(fd);
+            continue;
+        }
+
+        int buffer_size = 1024 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        upstream_fds.push_back(fd);
+        upstream_names.push_back(resolver.first + ":" + to_string(resolver.second));
+    }
+
+    counters.reset(new UpstreamCounters[max<size_t>(upstream_fds.size(), 1)]);
+    rtt = make_unique<LatencyRecorder>(max<size_t>(upstream_fds.size(), 1));
+    health.resize(upstream_fds.size());
+}
+
+UpstreamForwarder::~UpstreamForwarder() {
+    stop();
+    for (int fd : upstream_fds) {
+        close(fd);
+    }
+}
+
+bool UpstreamForwarder::start() {
+    if (running || upstream_fds.empty()) {
+        return false;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < upstream_fds.size(); ++i) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upstream_fds[i], &ev);
+    }
+
+    running = true;
+    io_thread = thread(&UpstreamForwarder::io_loop, this);
+    return true;
+}
+
+void UpstreamForwarder::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+
+    if (io_thread.joinable()) {
+        io_thread.join();
+    }
+    close(epoll_fd);
+    epoll_fd = -1;
+}
+
+size_t UpstreamForwarder::pending() const {
+    lock_guard<mutex> lock(pending_mutex);
+    return pending_queries.size();
+}
+
+bool UpstreamForwarder::drain(chrono::milliseconds limit) {
+    unique_lock<mutex> lock(pending_mutex);
+    return drained.wait_for(lock, limit, [this] { return pending_queries.empty(); });
+}
+
+vector<UpstreamForwarder::UpstreamStats> UpstreamForwarder::upstream_stats() const {
+    vector<UpstreamStats> stats(upstream_fds.size());
+    int64_t now_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    for (size_t i = 0; i < upstream_fds.size(); ++i) {
+        stats[i].address = upstream_names[i];
+        stats[i].queries = counters[i].queries.load(memory_order_relaxed);
+        stats[i].replies = counters[i].replies.load(memory_order_relaxed);
+        stats[i].timeouts = counters[i].timeouts.load(memory_order_relaxed);
+        stats[i].send_errors = counters[i].send_errors.load(memory_order_relaxed);
+        stats[i].srtt_seconds = counters[i].srtt_us.load(memory_order_relaxed) / 1e6;
+        stats[i].failure_rate = counters[i].failure_ppm.load(memory_order_relaxed) / 1e6;
+        stats[i].backed_off = now_ns < counters[i].backoff_until_ns.load(memory_order_relaxed);
+        stats[i].rtt = rtt->snapshot(i);
+    }
+    return stats;
+}
+
+uint16_t UpstreamForwarder::next_id_locked() {
+    // xorshift32; IDs only need to be unpredictable enough on top of the
+    // kernel's random source port, and unique among in-flight queries
+    for (;;) {
+        id_state ^= id_state << 13;
+        id_state ^= id_state >> 17;
+        id_state ^= id_state << 5;
+        uint16_t id = static_cast<uint16_t>(id_state);
+        if (pending_queries.find(id) == pending_queries.end()) {
+            return id;
+        }
+    }
+}
+
+size_t UpstreamForwarder::pick_locked(uint64_t exclude, chrono::steady_clock::time_point now) const {
+    size_t best = MAX_UPSTREAMS;
+    bool best_benched = true;
+    double best_score = 0;
+    double timeout_ms = static_cast<double>(timeout.count());
+    for (size_t i = 0; i < health.size(); ++i) {
+        if (exclude & (uint64_t(1) << i)) {
+            continue;
+        }
+        const Health& h = health[i];
+        
+        // Benched upstreams only when nothing else is left, soonest back first
+        bool benched = now < h.backoff_until;
+        double score;
+        if (benched) {
+            score = chrono::duration<double, milli>(h.backoff_until - now).count();
+        } else {
+            double idle = chrono::duration<double>(now - h.last_sample).count();
+            double decay = h.samples ? exp2(-idle / chrono::duration<double>(PROBE_HALF_LIFE).count()) : 1.0;
+            score = (h.srtt_ms + h.failure_rate * timeout_ms) * decay;
+        }
+        if (best == MAX_UPSTREAMS || benched < best_benched || (benched == best_benched && score < best_score)) {
+            best = i;
+            best_benched = benched;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+void UpstreamForwarder::record_reply_locked(size_t upstream, chrono::steady_clock::duration elapsed,
+                                            chrono::steady_clock::time_point now) {
+    Health& h = health[upstream];
+    double ms = chrono::duration<double, milli>(elapsed).count();
+    if (h.samples == 0) {
+        h.srtt_ms = ms;
+        h.p95_ms = ms;
+    } else {
+        h.srtt_ms += (ms - h.srtt_ms) / 8;
+        // Stochastic quantile tracking: stepping up 19 times as far as down
+        // settles where one sample in twenty lies above the estimate
+        double step = max(h.srtt_ms, 0.01) / 4;
+        h.p95_ms = max(0.0, h.p95_ms + (ms > h.p95_ms ? 0.95 : -0.05) * step);
+    }
+    h.samples++;
+    h.failure_rate *= 0.9;
+    h.consecutive_failures = 0;
+    h.backoff_until = {};
+    h.last_sample = now;
+    
+    counters[upstream].srtt_us.store(static_cast<uint64_t>(h.srtt_ms * 1000), memory_order_relaxed);
+    counters[upstream].failure_ppm.store(static_cast<uint32_t>(h.failure_rate * 1e6), memory_order_relaxed);
+    counters[upstream].backoff_until_ns.store(0, memory_order_relaxed);
+}
+
+void UpstreamForwarder::record_failure_locked(size_t upstream, chrono::steady_clock::time_point now) {
+    Health& h = health[upstream];
+    h.failure_rate = h.failure_rate * 0.9 + 0.1;
+    h.consecutive_failures++;
+    h.last_sample = now;
+    
+    // One loss is noise; from the second in a row the upstream sits out
+    // one timeout, then twice as long per further failure
+    if (h.consecutive_failures >= 2) {
+        unsigned doublings = min(h.consecutive_failures - 2, 16u);
+        auto backoff = min<chrono::steady_clock::duration>(timeout * (1u << doublings), MAX_BACKOFF);
+        h.backoff_until = now + backoff;
+        counters[upstream].backoff_until_ns.store(
+            chrono::duration_cast<chrono::nanoseconds>(h.backoff_until.time_since_epoch()).count(),
+            memory_order_relaxed);
+    }
+    counters[upstream].failure_ppm.store(static_cast<uint32_t>(h.failure_rate * 1e6), memory_order_relaxed);
+}
+
+void UpstreamForwarder::schedule_locked(uint16_t id, const Pending& entry, chrono::steady_clock::time_point now) {
+    timers.push({now + timeout, id, entry.seq, false});
+    
+    // Hedge once the first upstream is slower than it is 95% of the time,
+    // if that is enough samples in and still short of the timeout
+    if (hedging && health.size() > 1 && !entry.asked.empty()) {
+        const Health& h = health[entry.asked.back().upstream];
+        auto delay = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, milli>(h.p95_ms));
+        if (h.samples >= 20 && delay < timeout) {
+            timers.push({now + delay, id, entry.seq, true});
+        }
+    }
+}
+
+bool UpstreamForwarder::send_locked(uint16_t id, Pending& entry, size_t upstream, chrono::steady_clock::time_point now) {
+    uint8_t packet[12 + MAX_WIRE_NAME + 4 + OPT_RR_SIZE];  // forward() refuses longer questions
+    const auto& question = entry.waiters.front().question;
+
+    uint16_t* header = reinterpret_cast<uint16_t*>(packet);
+    header[0] = htons(id);
+    header[1] = htons(0x0100);  // Standard query, recursion desired
+    header[2] = htons(1);
+    header[3] = 0;
+    header[4] = 0;
+    header[5] = htons(1);
+    memcpy(packet + 12, question.data(), question.size());
+    size_t len = 12 + question.size() + write_opt(packet + 12 + question.size(), MAX_REPLY);
+
+    entry.asked.push_back({upstream, now});
+    entry.tried |= uint64_t(1) << upstream;
+    // Chosen means its score starts decaying anew: an upstream picked only
+    // because its score had decayed gets one probe per decay, not every
+    // miss sent while that probe is out
+    health[upstream].last_sample = now;
+    counters[upstream].queries.fetch_add(1, memory_order_relaxed);
+    ssize_t sent = send(upstream_fds[upstream], packet, len, MSG_DONTWAIT);
+    if (sent != static_cast<ssize_t>(len)) {
+        counters[upstream].send_errors.fetch_add(1, memory_order_relaxed);
+        record_failure_locked(upstream, now);
+        return false;
+    }
+    return true;
+}
+
+bool UpstreamForwarder::forward(UpstreamQuery&& query) {
+    // send_locked() could never put it on the wire, and nothing would end
+    // the lookup
+    if (!running || query.question.size() > MAX_WIRE_NAME + 4) {
+        return false;
+    }
+    
+    // Name, type and class: the class is the question's last two bytes
+    string key = query.domain;
+    key.push_back('\0');
+    key.push_back(static_cast<char>(query.qtype >> 8));
+    key.push_back(static_cast<char>(query.qtype & 0xFF));
+    if (query.question.size() >= 2) {
+        key.append(query.question.end() - 2, query.question.end());
+    }
+
+    lock_guard<mutex> lock(pending_mutex);
+    
+    auto existing = inflight.find(key);
+    if (existing != inflight.end()) {
+        auto& waiters = pending_queries[existing->second].waiters;
+        if (waiters.size() >= MAX_WAITERS) {
+            return false;
+        }
+        waiters.push_back(move(query));
+        coalesced_queries.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+    
+    if (pending_queries.size() >= 60000) {
+        return false;  // Keep slack in the 16-bit ID space
+    }
+
+    uint16_t id = next_id_locked();
+    uint64_t seq = next_seq++;
+    Pending entry;
+    entry.waiters.push_back(move(query));
+    entry.key = key;
+    entry.seq = seq;
+
+    // A failed send is treated like a lost packet; the timeout moves it on
+    auto now = chrono::steady_clock::now();
+    send_locked(id, entry, pick_locked(0, now), now);
+    schedule_locked(id, entry, now);
+    pending_queries.emplace(id, move(entry));
+    inflight.emplace(move(key), id);
+    return true;
+}
+
+void UpstreamForwarder::io_loop() {
+    epoll_event events[16];
+    uint8_t buffer[MAX_REPLY];
+
+    while (running) {
+        // Wake for the next hedge or timeout, but at least every 10ms
+        int wait_ms = 10;
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            if (!timers.empty()) {
+                auto until = chrono::ceil<chrono::milliseconds>(timers.top().deadline - chrono::steady_clock::now());
+                wait_ms = static_cast<int>(clamp<chrono::milliseconds::rep>(until.count(), 0, 10));
+            }
+        }
+        int n = epoll_wait(epoll_fd, events, 16, wait_ms);
+        for (int i = 0; i < n; ++i) {
+            size_t upstream = events[i].data.u64;
+            // Drain the socket: replies arrive in bursts under load
+            for (;;) {
+                ssize_t len = recv(upstream_fds[upstream], buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (len < 0) {
+                    break;
+                }
+                handle_reply(upstream, buffer, static_cast<size_t>(len));
+            }
+        }
+        expire_timers();
+    }
+
+    // Nobody will answer the rest; fail them so every client hears back
+    unordered_map<uint16_t, Pending> abandoned;
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        abandoned.swap(pending_queries);
+        inflight.clear();
+        timers = {};
+        drained.notify_all();
+    }
+    for (auto& entry : abandoned) {
+        on_complete(entry.second.waiters, nullptr, 0);
+    }
+}
+
+static bool question_matches(const vector<uint8_t>& question, const uint8_t* data, size_t len) {
+    if (12 + question.size() > len || question.size() < 4) {
+        return false;
+    }
+
+    // Names compare case-insensitively; QTYPE/QCLASS must match exactly
+    const uint8_t* reply_question = data + 12;
+    size_t name_len = question.size() - 4;
+    for (size_t i = 0; i < name_len; ++i) {
+        if (tolower(question[i]) != tolower(reply_question[i])) {
+            return false;
+        }
+    }
+    return memcmp(question.data() + name_len, reply_question + name_len, 4) == 0;
+}
+
+void UpstreamForwarder::handle_reply(size_t upstream, const uint8_t* data, size_t len) {
+    if (len < 12) {
+        return;
+    }
+
+    uint16_t id = ntohs(*reinterpret_cast<const uint16_t*>(data));
+    uint16_t qdcount = ntohs(*reinterpret_cast<const uint16_t*>(data + 4));
+
+    Pending entry;
+    chrono::steady_clock::duration elapsed;
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        auto it = pending_queries.find(id);
+        if (it == pending_queries.end()) {
+            return;  // Late reply to a retried query, or spoofed
+        }
+        auto& asked = it->second.asked;
+        auto attempt = find_if(asked.begin(), asked.end(), [upstream](const Attempt& a) { return a.upstream == upstream; });
+        if (attempt == asked.end()) {
+            return;
+        }
+        if (qdcount != 1 || !question_matches(it->second.waiters.front().question, data, len)) {
+            return;
+        }
+        auto now = chrono::steady_clock::now();
+        elapsed = now - attempt->sent_at;
+        record_reply_locked(upstream, elapsed, now);
+        if (attempt != asked.begin()) {
+            hedge_win_count.fetch_add(1, memory_order_relaxed);
+        }
+        
+        // The losers took at least this long; without it an upstream that
+        // only ever loses to its hedge would keep its score forever
+        for (const Attempt& other : asked) {
+            Health& h = health[other.upstream];
+            double waited = chrono::duration<double, milli>(now - other.sent_at).count();
+            if (other.upstream != upstream && waited > h.srtt_ms) {
+                h.srtt_ms += (waited - h.srtt_ms) / 8;
+                counters[other.upstream].srtt_us.store(static_cast<uint64_t>(h.srtt_ms * 1000), memory_order_relaxed);
+            }
+        }
+        entry = move(it->second);
+        pending_queries.erase(it);
+        inflight.erase(entry.key);
+        if (pending_queries.empty()) {
+            drained.notify_all();
+        }
+    }
+
+    counters[upstream].replies.fetch_add(1, memory_order_relaxed);
+    rtt->record(upstream, elapsed);
+    on_complete(entry.waiters, data, len);
+}
+
+void UpstreamForwarder::expire_timers() {
+    auto now = chrono::steady_clock::now();
+    vector<vector<UpstreamQuery>> failed;
+
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        while (!timers.empty() && timers.top().deadline <= now) {
+            Timer timer = timers.top();
+            timers.pop();
+
+            auto it = pending_queries.find(timer.id);
+            if (it == pending_queries.end() || it->second.seq != timer.seq) {
+                continue;  // Already answered or retried
+            }
+            Pending& entry = it->second;
+
+            if (timer.hedge) {
+                size_t other = pick_locked(entry.tried, now);
+                if (entry.asked.size() == 1 && other != MAX_UPSTREAMS && now >= health[other].backoff_until) {
+                    hedged_queries.fetch_add(1, memory_order_relaxed);
+                    send_locked(timer.id, entry, other, now);
+                }
+                continue;
+            }
+
+            // Upstreams that had their full timeout failed; a hedge sent
+            // later keeps waiting out its own
+            vector<Attempt> waiting;
+            for (const Attempt& attempt : entry.asked) {
+                if (now - attempt.sent_at >= timeout) {
+                    counters[attempt.upstream].timeouts.fetch_add(1, memory_order_relaxed);
+                    record_failure_locked(attempt.upstream, now);
+                } else {
+                    waiting.push_back(attempt);
+                }
+            }
+            entry.asked.swap(waiting);
+            if (!entry.asked.empty()) {
+                timers.push({entry.asked.front().sent_at + timeout, timer.id, entry.seq, false});
+                continue;
+            }
+
+            size_t next = pick_locked(entry.tried, now);
+            Pending retry = move(entry);
+            pending_queries.erase(it);
+            if (next == MAX_UPSTREAMS) {
+                inflight.erase(retry.key);
+                failed.push_back(move(retry.waiters));
+                continue;
+            }
+
+            // Retry on an upstream not yet asked, under a fresh ID
+            retry.seq = next_seq++;
+            uint16_t id = next_id_locked();
+            send_locked(id, retry, next, now);
+            schedule_locked(id, retry, now);
+            inflight[retry.key] = id;
+            pending_queries.emplace(id, move(retry));
+        }
+        if (pending_queries.empty()) {
+            drained.notify_all();
+        }
+    }
+
+    for (const auto& waiters : failed) {
+        on_complete(waiters, nullptr, 0);
+    }
+}
@@ -0,0 +1,191 @@
+#ifndef UPSTREAM_FORWARDER_H
+#define UPSTREAM_FORWARDER_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <netinet/in.h>
+#include "latency_histogram.h"
+
+using namespace std;
+
+// A client query waiting on an upstream answer
+struct UpstreamQuery {
+    int client_fd = -1;             // UDP socket the reply goes out on
+    uint64_t tcp_conn = 0;          // or the TCP connection it goes back on
+    sockaddr_in client_addr{};
+    uint16_t client_id = 0;         // transaction ID as sent by the client (network order)
+    vector<uint8_t> question;       // wire-format question section copied from the query
+    string domain;                  // lowercased wire-format name, used as the cache key
+    uint16_t qtype = 0;
+    bool edns = false;              // the reply carries an OPT record back
+    uint32_t reply_limit = 512;     // longer replies are truncated for the client
+    size_t cache_node = 0;          // NUMA node whose cache the answer goes into
+    chrono::steady_clock::time_point start;
+    uint32_t parse_ns = 0;          // trace stage times, carried to the reply
+    uint32_t lookup_ns = 0;
+};
+
+// Non-blocking forwarder to the configured upstream resolvers. Workers hand
+// off cache misses with forward() and return immediately; a single I/O thread
+// owns one connected UDP socket per upstream, matches replies back to pending
+// queries by transaction ID and question, retries another upstream on
+// timeout, and reports every query exactly once through the completion.
+//
+// Concurrent misses for the same (name, type, class) are coalesced: only the
+// first goes upstream and later ones wait on it, so they all complete together.
+//
+// Each query goes to the upstream with the lowest expected time to an
+// answer: its smoothed RTT plus its recent failure rate times the timeout.
+// An upstream that times out repeatedly is benched for an exponentially
+// growing backoff, and the score of one not chosen for a while decays, so a
+// recovered upstream is probed again now and then. With hedging on, a
+// query still unanswered at its upstream's tracked p95 RTT is also sent to
+// the next best upstream, and whichever answers first wins.
+class UpstreamForwarder {
+public:
+    // Receive buffer and the EDNS size queries advertise, so upstreams can
+    // send large answers over UDP
+    static constexpr size_t MAX_REPLY = 4096;
+
+    // waiters holds every client attached to one upstream lookup, the
+    // original first; reply is nullptr when every upstream timed out
+    using Completion = function<void(const vector<UpstreamQuery>& waiters, const uint8_t* reply, size_t len)>;
+
+    UpstreamForwarder(const vector<pair<string, uint16_t>>& resolvers,
+                      chrono::milliseconds timeout, Completion on_complete);
+    ~UpstreamForwarder();
+
+    UpstreamForwarder(const UpstreamForwarder&) = delete;
+    UpstreamForwarder& operator=(const UpstreamForwarder&) = delete;
+
+    // Call before start()
+    void set_hedging(bool enabled) { hedging = enabled; }
+
+    bool start();
+    void stop();
+
+    // False if there are no usable upstreams, the ID space is exhausted or
+    // the question is too long to send; the caller still owns the client
+    // and should answer it
+    bool forward(UpstreamQuery&& query);
+
+    size_t pending() const;
+    // Waits until no lookup is in flight, or limit has passed; forward()
+    // keeps working meanwhile. False if lookups were still pending.
+    bool drain(chrono::milliseconds limit);
+    uint64_t coalesced() const { return coalesced_queries.load(memory_order_relaxed); }
+    uint64_t hedges() const { return hedged_queries.load(memory_order_relaxed); }
+    uint64_t hedge_wins() const { return hedge_win_count.load(memory_order_relaxed); }
+
+    struct UpstreamStats {
+        string address;             // ip:port
+        uint64_t queries = 0;       // attempts sent, retries included
+        uint64_t replies = 0;       // matched replies
+        uint64_t timeouts = 0;
+        uint64_t send_errors = 0;
+        double srtt_seconds = 0;    // smoothed RTT the selection uses
+        double failure_rate = 0;    // recent share of attempts that failed
+        bool backed_off = false;    // benched after consecutive timeouts
+        LatencyHistogram rtt;       // send to matched reply
+    };
+
+    // Read from relaxed counters; never takes the pending lock
+    vector<UpstreamStats> upstream_stats() const;
+
+private:
+    static constexpr size_t MAX_WAITERS = 1024;
+    static constexpr size_t MAX_UPSTREAMS = 64;  // tried sets are bitmasks
+    static constexpr chrono::seconds MAX_BACKOFF{30};
+    static constexpr chrono::seconds PROBE_HALF_LIFE{5};  // unsampled scores halve this often
+
+    struct Attempt {
+        size_t upstream;
+        chrono::steady_clock::time_point sent_at;
+    };
+
+    struct Pending {
+        vector<UpstreamQuery> waiters;
+        string key;                 // coalescing key: name + qtype + qclass
+        vector<Attempt> asked;      // upstreams whose reply is accepted: the attempt and its hedge
+        uint64_t tried = 0;         // every upstream asked, across retries
+        uint64_t seq;               // guards against stale timers after ID reuse
+    };
+
+    // Attempt timeouts and hedge deadlines, earliest first
+    struct Timer {
+        chrono::steady_clock::time_point deadline;
+        uint16_t id;
+        uint64_t seq;
+        bool hedge;
+        bool operator>(const Timer& other) const { return deadline > other.deadline; }
+    };
+
+    // Selection state, guarded by pending_mutex
+    struct Health {
+        double srtt_ms = 0;         // 0 until the first reply, so new upstreams are tried first
+        double p95_ms = 0;          // streaming quantile estimate, the hedge deadline
+        double failure_rate = 0;    // EWMA: 1 per timeout or send error, 0 per reply
+        uint32_t samples = 0;
+        uint32_t consecutive_failures = 0;
+        chrono::steady_clock::time_point last_sample;  // last reply, failure or send; the score decays from here
+        chrono::steady_clock::time_point backoff_until;
+    };
+
+    vector<int> upstream_fds;
+    vector<string> upstream_names;
+
+    struct UpstreamCounters {
+        atomic<uint64_t> queries{0};
+        atomic<uint64_t> replies{0};
+        atomic<uint64_t> timeouts{0};
+        atomic<uint64_t> send_errors{0};
+        // Mirrors of Health for upstream_stats()
+        atomic<uint64_t> srtt_us{0};
+        atomic<uint32_t> failure_ppm{0};
+        atomic<int64_t> backoff_until_ns{0};
+    };
+    unique_ptr<UpstreamCounters[]> counters;  // indexed like upstream_fds
+    unique_ptr<LatencyRecorder> rtt;          // one series per upstream
+    chrono::milliseconds timeout;
+    Completion on_complete;
+    bool hedging = false;
+
+    int epoll_fd = -1;
+    atomic<bool> running{false};
+    thread io_thread;
+
+    mutable mutex pending_mutex;
+    condition_variable drained;     // notified whenever pending_queries empties
+    unordered_map<uint16_t, Pending> pending_queries;
+    unordered_map<string, uint16_t> inflight;  // coalescing key -> transaction ID
+    priority_queue<Timer, vector<Timer>, greater<Timer>> timers;
+    vector<Health> health;          // indexed like upstream_fds
+    uint64_t next_seq = 0;
+    uint32_t id_state;
+    atomic<uint64_t> coalesced_queries{0};
+    atomic<uint64_t> hedged_queries{0};
+    atomic<uint64_t> hedge_win_count{0};  // answered by the hedge rather than the first upstream
+
+    void io_loop();
+    void handle_reply(size_t upstream, const uint8_t* data, size_t len);
+    void expire_timers();
+    bool send_locked(uint16_t id, Pending& entry, size_t upstream, chrono::steady_clock::time_point now);
+    // Best upstream not in exclude, preferring those not backed off;
+    // MAX_UPSTREAMS once every upstream is excluded
+    size_t pick_locked(uint64_t exclude, chrono::steady_clock::time_point now) const;
+    void schedule_locked(uint16_t id, const Pending& entry, chrono::steady_clock::time_point now);
+    void record_reply_locked(size_t upstream, chrono::steady_clock::duration rtt, chrono::steady_clock::time_point now);
+    void record_failure_locked(size_t upstream, chrono::steady_clock::time_point now);
+    uint16_t next_id_locked();
+};
+
+#endif // UPSTREAM_FORWARDER_H
@@ -0,0 +1,363 @@
+#include "uring_engine.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+namespace {
+
+constexpr uint64_t TAG_RECV = 1ull << 32;
+constexpr uint64_t TAG_SEND = 2ull << 32;
+
+int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+// Returns -errno on failure, like the raw kernel interface
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz) {
+    long ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+    return ret < 0 ? -errno : static_cast<int>(ret);
+}
+
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+unsigned round_up_pow2(unsigned v) {
+    unsigned p = 1;
+    while (p < v && p < 32768) p <<= 1;
+    return p;
+}
+
+}  // namespace
+
+UringEngine::UringEngine(int fd, unsigned ring_entries, unsigned buffers, size_t payload_size,
+                         atomic<uint64_t>* oversized_count)
+    : socket_fd(fd), entries(round_up_pow2(ring_entries)), num_buffers(round_up_pow2(buffers)),
+      buffer_size(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + payload_size), oversized(oversized_count) {
+    memset(&recv_msg, 0, sizeof(recv_msg));
+}
+
+UringEngine::~UringEngine() {
+    teardown();
+}
+
+bool UringEngine::setup() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd < 0) {
+        // Pre-6.1 kernels reject DEFER_TASKRUN; retry with a plain ring
+        memset(&params, 0, sizeof(params));
+        ring_fd = io_uring_setup(entries, &params);
+    }
+    if (ring_fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        teardown();
+        return false;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = max(sq_size, cq_size);
+    }
+
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        sq_ptr = nullptr;
+        teardown();
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            cq_ptr = nullptr;
+            teardown();
+            return false;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqe_mem = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqe_mem == MAP_FAILED) {
+        teardown();
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe*>(sqe_mem);
+
+    auto* sq = static_cast<uint8_t*>(sq_ptr);
+    auto* cq = static_cast<uint8_t*>(cq_ptr);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // The socket is used by every submission, so register it once
+    int fds[1] = { socket_fd };
+    if (io_uring_register(ring_fd, IORING_REGISTER_FILES, fds, 1) < 0) {
+        teardown();
+        return false;
+    }
+
+    // Provided buffer ring: the kernel picks a buffer per received datagram
+    buf_ring_size = num_buffers * sizeof(io_uring_buf);
+    void* ring_mem = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_mem == MAP_FAILED) {
+        teardown();
+        return false;
+    }
+    buf_ring = static_cast<io_uring_buf*>(ring_mem);
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+    reg.ring_entries = num_buffers;
+    reg.bgid = BUFFER_GROUP;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        teardown();
+        return false;
+    }
+
+    buffer_pool.resize(static_cast<size_t>(num_buffers) * buffer_size);
+    for (unsigned i = 0; i < num_buffers; ++i) {
+        recycle_buffer(static_cast<uint16_t>(i));
+    }
+    __atomic_store_n(&buf_ring[0].resv, buf_ring_tail, __ATOMIC_RELEASE);
+
+    recv_msg.msg_namelen = sizeof(sockaddr_in);
+
+    send_slots.resize(entries);
+    free_send_slots.reserve(entries);
+    for (uint32_t i = entries; i > 0; --i) {
+        free_send_slots.push_back(i - 1);
+    }
+
+    // Multishot recvmsg needs 6.0+; an unsupported opcode shows up as the
+    // first completion, so probe it before committing to this engine
+    arm_recv();
+    submit_and_wait(0);
+    unsigned head = *cq_head;
+    if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe* cqe = &cqes[head & *cq_mask];
+        if (cqe->user_data == TAG_RECV && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)) {
+            teardown();
+            return false;
+        }
+    }
+    return true;
+}
+
+void UringEngine::teardown() {
+    if (ring_fd >= 0) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    if (buf_ring) {
+        munmap(buf_ring, buf_ring_size);
+        buf_ring = nullptr;
+    }
+    if (sqes) {
+        munmap(sqes, sqes_size);
+        sqes = nullptr;
+    }
+    if (cq_ptr && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    cq_ptr = nullptr;
+    if (sq_ptr) {
+        munmap(sq_ptr, sq_size);
+        sq_ptr = nullptr;
+    }
+}
+
+io_uring_sqe* UringEngine::get_sqe() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail;
+    if (tail - head >= entries) {
+        // SQ full: hand what we have to the kernel without waiting
+        submit_and_wait(0);
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= entries) {
+            return nullptr;
+        }
+    }
+
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pending_submissions++;
+    return sqe;
+}
+
+int UringEngine::submit_and_wait(unsigned wait_nr) {
+    // Bounded wait so the worker notices running == false
+    __kernel_timespec ts = { 0, 100 * 1000 * 1000 };
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (wait_nr > 0) flags |= IORING_ENTER_GETEVENTS;
+    int ret = io_uring_enter(ring_fd, pending_submissions, wait_nr, flags, &arg, sizeof(arg));
+    if (ret >= 0) {
+        pending_submissions -= min<unsigned>(static_cast<unsigned>(ret), pending_submissions);
+    }
+    return ret;
+}
+
+void UringEngine::arm_recv() {
+    io_uring_sqe* sqe = get_sqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = 0;  // Index into the registered file table
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->addr = reinterpret_cast<uint64_t>(&recv_msg);
+    sqe->len = 1;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = TAG_RECV;
+    recv_armed = true;
+}
+
+void UringEngine::recycle_buffer(uint16_t bid) {
+    io_uring_buf* buf = &buf_ring[buf_ring_tail & (num_buffers - 1)];
+    buf->addr = reinterpret_cast<uint64_t>(buffer_pool.data() + static_cast<size_t>(bid) * buffer_size);
+    buf->len = static_cast<uint32_t>(buffer_size);
+    buf->bid = bid;
+    buf_ring_tail++;
+}
+
+void UringEngine::queue_sends(ResponseBatch& responses) {
+    for (size_t i = 0; i < responses.size(); ++i) {
+        const sockaddr_in& addr = responses.addr(i);
+
+        io_uring_sqe* sqe = free_send_slots.empty() || responses.length(i) > SLOT_PAYLOAD ? nullptr : get_sqe();
+        if (!sqe) {
+            // Every send slot is in flight, or the reply is too big for one:
+            // send synchronously rather than drop
+            uint8_t payload[ResponseBatch::MAX_RESPONSE];
+            size_t len = responses.copy_out(i, payload);
+            if (sendto(socket_fd, payload, len, 0, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
+                responses.count_dropped(1);
+            }
+            continue;
+        }
+
+        uint32_t slot_index = free_send_slots.back();
+        free_send_slots.pop_back();
+        SendSlot& slot = send_slots[slot_index];
+        slot.addr = addr;
+        slot.iov.iov_base = slot.payload;
+        slot.iov.iov_len = responses.copy_out(i, slot.payload);
+        memset(&slot.msg, 0, sizeof(slot.msg));
+        slot.msg.msg_name = &slot.addr;
+        slot.msg.msg_namelen = sizeof(slot.addr);
+        slot.msg.msg_iov = &slot.iov;
+        slot.msg.msg_iovlen = 1;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = reinterpret_cast<uint64_t>(&slot.msg);
+        sqe->len = 1;
+        sqe->user_data = TAG_SEND | slot_index;
+    }
+    responses.clear();
+}
+
+void UringEngine::run(const atomic<bool>& running, ResponseBatch& responses, QsbrDomain& qsbr, size_t reader,
+                      const QueryHandler& handler) {
+    while (running) {
+        // Every reply queued so far was copied into a send slot, so nothing
+        // from the previous pass still references handler-owned data
+        qsbr.offline(reader);
+        int ret = submit_and_wait(1);
+        qsbr.online(reader);
+        if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+            if (running) {
+                cerr << "io_uring_enter failed: " << strerror(-ret) << endl;
+            }
+            break;
+        }
+
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        bool recycled = false;
+
+        for (; head != tail; ++head) {
+            io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            uint64_t tag = cqe->user_data & ~0xFFFFFFFFull;
+
+            if (tag == TAG_SEND) {
+                if (cqe->res < 0) {
+                    responses.count_dropped(1);
+                }
+                free_send_slots.push_back(static_cast<uint32_t>(cqe->user_data & 0xFFFFFFFFull));
+                continue;
+            }
+
+            if (tag != TAG_RECV) {
+                continue;
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                recv_armed = false;  // Multishot ended (e.g. -ENOBUFS); re-arm below
+            }
+            if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+                continue;
+            }
+
+            uint16_t bid = static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            const uint8_t* buf = buffer_pool.data() + static_cast<size_t>(bid) * buffer_size;
+            const auto* out = reinterpret_cast<const io_uring_recvmsg_out*>(buf);
+
+            if (out->flags & MSG_TRUNC) {
+                if (oversized) {
+                    oversized->fetch_add(1, memory_order_relaxed);
+                }
+            } else if (out->namelen >= sizeof(sockaddr_in)) {
+                const uint8_t* name = buf + sizeof(io_uring_recvmsg_out);
+                const uint8_t* payload = name + recv_msg.msg_namelen + recv_msg.msg_controllen;
+                sockaddr_in client_addr;
+                memcpy(&client_addr, name, sizeof(client_addr));
+                handler(payload, out->payloadlen, client_addr, responses);
+                if (responses.full()) {
+                    queue_sends(responses);
+                }
+            }
+
+            recycle_buffer(bid);
+            recycled = true;
+        }
+
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        if (recycled) {
+            __atomic_store_n(&buf_ring[0].resv, buf_ring_tail, __ATOMIC_RELEASE);
+        }
+
+        queue_sends(responses);
+        if (!recv_armed) {
+            arm_recv();
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#include "dns_server.h"
+#include <functional>
+#include <linux/io_uring.h>
+
+using namespace std;
+
+// io_uring network engine for one worker socket. A single multishot RECVMSG
+// stays armed against a provided buffer ring, so the kernel keeps filling
+// receive buffers without a new submission per packet, and replies go out as
+// SENDMSG submissions batched into the same io_uring_enter call that reaps
+// completions. Must be constructed and run on the worker thread that owns it.
+class UringEngine {
+public:
+    using QueryHandler = function<void(const uint8_t*, size_t, const sockaddr_in&, ResponseBatch&)>;
+
+    // Datagrams longer than payload_size are dropped and counted in oversized
+    UringEngine(int socket_fd, unsigned entries, unsigned num_buffers, size_t payload_size,
+                atomic<uint64_t>* oversized = nullptr);
+    ~UringEngine();
+
+    UringEngine(const UringEngine&) = delete;
+    UringEngine& operator=(const UringEngine&) = delete;
+
+    // False when the kernel lacks io_uring, provided buffer rings or
+    // multishot recvmsg; the caller should fall back to the blocking loop
+    bool setup();
+    // The worker is QSBR reader `reader`: offline while waiting in the
+    // kernel, online while handling completions
+    void run(const atomic<bool>& running, ResponseBatch& responses, QsbrDomain& qsbr, size_t reader,
+             const QueryHandler& handler);
+
+private:
+    static constexpr uint16_t BUFFER_GROUP = 0;
+
+    // Replies are copied out of the batch arena, which is reused as soon as
+    // the handler moves on, into a slot that lives until the CQE arrives.
+    // Slots hold a reply of the default EDNS size; the rare larger one is
+    // sent synchronously instead of sizing every slot for 4 KB.
+    static constexpr size_t SLOT_PAYLOAD = 1232;
+    struct SendSlot {
+        uint8_t payload[SLOT_PAYLOAD];
+        sockaddr_in addr;
+        iovec iov;
+        msghdr msg;
+    };
+
+    int socket_fd;
+    int ring_fd = -1;
+    unsigned entries;
+    unsigned num_buffers;
+    size_t buffer_size;             // recvmsg header, source address and payload
+    atomic<uint64_t>* oversized;
+
+    // Submission / completion rings shared with the kernel
+    void* sq_ptr = nullptr;
+    size_t sq_size = 0;
+    void* cq_ptr = nullptr;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned pending_submissions = 0;
+
+    // Provided receive buffers
+    // Indexed as a plain io_uring_buf array: the header's flexible-array
+    // union lays out differently under C++. The ring tail aliases bufs[0].resv.
+    io_uring_buf* buf_ring = nullptr;
+    size_t buf_ring_size = 0;
+    vector<uint8_t> buffer_pool;
+    uint16_t buf_ring_tail = 0;
+    msghdr recv_msg;
+    bool recv_armed = false;
+
+    vector<SendSlot> send_slots;
+    vector<uint32_t> free_send_slots;
+
+    io_uring_sqe* get_sqe();
+    int submit_and_wait(unsigned wait_nr);
+    void arm_recv();
+    void recycle_buffer(uint16_t bid);
+    void queue_sends(ResponseBatch& responses);
+    void teardown();
+};
+
+#endif // URING_ENGINE_H
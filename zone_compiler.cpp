@@ -0,0 +1,404 @@
+#include "zone_file.h"
+#include <arpa/inet.h>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+
+using namespace std;
+
+// Compiles hosts files and simple zone text into the binary zone format the
+// server maps with --zone. Accepted lines, '#' or ';' starting a comment:
+//
+//   192.168.1.10  nas.home nas.local     hosts style, any number of names
+//   fd00::10      nas.home               IPv6 entries become AAAA records
+//   0.0.0.0       ads.example.com        blocklists are just hosts files
+//   printer.home. 3600 IN A 192.168.1.20 zone style; TTL and class optional
+//   www.home.     CNAME nas.home.        A, AAAA, CNAME, NS, PTR, MX, TXT, SRV
+//
+// Names are taken as fully qualified; there is no $ORIGIN. Records with the
+// same name and type form one RRset, answered together. CNAME chains are
+// followed through the compiled data at compile time, so a query for an
+// alias gets the whole chain and the target's records in one template.
+
+struct Stats {
+    size_t lines = 0;
+    size_t records = 0;
+    size_t duplicates = 0;
+    size_t skipped = 0;
+    size_t invalid = 0;
+    size_t truncated = 0;       // answers over MAX_TEMPLATE, served with TC set
+    size_t bad_chains = 0;      // CNAME loops, overlong chains or CNAMEs beside other data
+};
+
+static constexpr size_t MAX_CHAIN = 8;
+
+static bool is_number(const string& text) {
+    return !text.empty() && text.find_first_not_of("0123456789") == string::npos;
+}
+
+static bool parse_u16(const string& text, uint16_t& value) {
+    if (!is_number(text) || text.size() > 5 || stoul(text) > 65535) {
+        return false;
+    }
+    value = static_cast<uint16_t>(stoul(text));
+    return true;
+}
+
+static void put16(string& out, uint16_t value) {
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value));
+}
+
+static bool name_to_wire(string name, string& wire) {
+    if (!name.empty() && name.back() == '.') {
+        name.pop_back();
+    }
+    return text_to_wire(name, wire);
+}
+
+// Splits a line into fields, dropping any comment. A quoted field (TXT
+// data) may hold spaces, comment characters and backslash escapes, and
+// keeps its quotes so the TXT parser can tell it apart.
+static vector<string> split_fields(const string& line) {
+    vector<string> fields;
+    size_t i = 0;
+    while (i < line.size()) {
+        char c = line[i];
+        if (c == '#' || c == ';') {
+            break;
+        }
+        if (isspace(static_cast<unsigned char>(c))) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        if (c == '"') {
+            for (i++; i < line.size() && line[i] != '"'; ++i) {
+                i += line[i] == '\\';
+            }
+            i = min(i + 1, line.size());
+        } else {
+            while (i < line.size() && !isspace(static_cast<unsigned char>(line[i])) && line[i] != ';') {
+                i++;
+            }
+        }
+        fields.push_back(line.substr(start, i - start));
+    }
+    return fields;
+}
+
+// One TXT character-string from a field, unquoted and unescaped
+static bool parse_character_string(const string& field, string& out) {
+    string text = field;
+    if (text.size() >= 2 && text.front() == '"' && text.back() == '"') {
+        text = text.substr(1, text.size() - 2);
+    }
+    string value;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] != '\\' || i + 1 == text.size()) {
+            value.push_back(text[i]);
+        } else if (i + 3 < text.size() && isdigit(static_cast<unsigned char>(text[i + 1])) &&
+                   isdigit(static_cast<unsigned char>(text[i + 2])) && isdigit(static_cast<unsigned char>(text[i + 3]))) {
+            unsigned code = stoul(text.substr(i + 1, 3));
+            if (code > 255) {
+                return false;
+            }
+            value.push_back(static_cast<char>(code));
+            i += 3;
+        } else {
+            value.push_back(text[++i]);
+        }
+    }
+    if (value.size() > 255) {
+        return false;
+    }
+    out.push_back(static_cast<char>(value.size()));
+    out += value;
+    return true;
+}
+
+// Wire-format RDATA for the fields from pos on; names inside it are left
+// uncompressed
+static bool parse_rdata(uint16_t type, const vector<string>& fields, size_t pos, string& rdata) {
+    size_t count = fields.size() - pos;
+    string wire;
+    uint16_t a, b, c;
+    switch (type) {
+    case TYPE_A: {
+        in_addr addr;
+        if (count != 1 || inet_pton(AF_INET, fields[pos].c_str(), &addr) != 1) {
+            return false;
+        }
+        rdata.assign(reinterpret_cast<const char*>(&addr), sizeof(addr));
+        return true;
+    }
+    case TYPE_AAAA: {
+        in6_addr addr;
+        if (count != 1 || inet_pton(AF_INET6, fields[pos].c_str(), &addr) != 1) {
+            return false;
+        }
+        rdata.assign(reinterpret_cast<const char*>(&addr), sizeof(addr));
+        return true;
+    }
+    case TYPE_NS:
+    case TYPE_CNAME:
+    case TYPE_PTR:
+        return count == 1 && name_to_wire(fields[pos], rdata);
+    case TYPE_MX:
+        if (count != 2 || !parse_u16(fields[pos], a) || !name_to_wire(fields[pos + 1], wire)) {
+            return false;
+        }
+        put16(rdata, a);
+        rdata += wire;
+        return true;
+    case TYPE_SRV:
+        if (count != 4 || !parse_u16(fields[pos], a) || !parse_u16(fields[pos + 1], b) ||
+            !parse_u16(fields[pos + 2], c) || !name_to_wire(fields[pos + 3], wire)) {
+            return false;
+        }
+        put16(rdata, a);
+        put16(rdata, b);
+        put16(rdata, c);
+        rdata += wire;
+        return true;
+    case TYPE_TXT:
+        if (count == 0) {
+            return false;
+        }
+        for (size_t i = pos; i < fields.size(); ++i) {
+            if (!parse_character_string(fields[i], rdata)) {
+                return false;
+            }
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_supported(uint16_t type) {
+    switch (type) {
+    case TYPE_A: case TYPE_AAAA: case TYPE_NS: case TYPE_CNAME:
+    case TYPE_PTR: case TYPE_MX: case TYPE_TXT: case TYPE_SRV:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// RRsets by wire-format owner name, then type
+using ZoneData = unordered_map<string, map<uint16_t, vector<LocalRecord>>>;
+
+static void add_record(ZoneData& zone, const string& name, uint16_t type, uint32_t ttl, string&& rdata, Stats& stats) {
+    string owner;
+    if (!name_to_wire(name, owner)) {
+        stats.invalid++;
+        return;
+    }
+    auto& rrset = zone[owner][type];
+    for (const auto& existing : rrset) {
+        if (existing.rdata == rdata) {
+            stats.duplicates++;
+            return;
+        }
+    }
+    rrset.push_back({owner, type, ttl, move(rdata)});
+    stats.records++;
+}
+
+static void compile_line(const string& line, uint32_t default_ttl, ZoneData& zone, Stats& stats) {
+    vector<string> tokens = split_fields(line);
+    if (tokens.empty()) {
+        return;
+    }
+
+    // Hosts style: an address, then the names it belongs to
+    in_addr addr4;
+    in6_addr addr6;
+    bool v4 = inet_pton(AF_INET, tokens[0].c_str(), &addr4) == 1;
+    if (v4 || inet_pton(AF_INET6, tokens[0].c_str(), &addr6) == 1) {
+        if (tokens.size() < 2) {
+            stats.invalid++;
+        }
+        string rdata = v4 ? string(reinterpret_cast<const char*>(&addr4), sizeof(addr4))
+                          : string(reinterpret_cast<const char*>(&addr6), sizeof(addr6));
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            add_record(zone, tokens[i], v4 ? TYPE_A : TYPE_AAAA, default_ttl, string(rdata), stats);
+        }
+        return;
+    }
+
+    // name [ttl] [class] type rdata, TTL and class in either order
+    size_t pos = 1;
+    uint32_t ttl = default_ttl;
+    for (int i = 0; i < 2 && pos < tokens.size(); ++i) {
+        if (is_number(tokens[pos]) && tokens[pos].size() <= 10) {
+            ttl = static_cast<uint32_t>(min<unsigned long>(stoul(tokens[pos++]), INT32_MAX));
+        } else if (tokens[pos] == "IN" || tokens[pos] == "in") {
+            pos++;
+        }
+    }
+    uint16_t type;
+    if (pos >= tokens.size() || !text_to_rr_type(tokens[pos], type)) {
+        stats.invalid++;
+        return;
+    }
+    if (!is_supported(type)) {
+        stats.skipped++;
+        return;
+    }
+    string rdata;
+    if (!parse_rdata(type, tokens, pos + 1, rdata)) {
+        stats.invalid++;
+        return;
+    }
+    add_record(zone, tokens[0], type, ttl, move(rdata), stats);
+}
+
+struct Compiled {
+    vector<vector<uint8_t>> replies;
+    vector<uint64_t> hashes;
+};
+
+static void emit(Compiled& out, const string& owner, uint16_t qtype, const vector<LocalRecord>& answers, Stats& stats) {
+    vector<uint8_t> reply;
+    if (!build_local_template(owner, qtype, answers, reply)) {
+        // Too long for any reply the server builds: no records and TC set
+        build_local_template(owner, qtype, {}, reply);
+        reply[2] |= 0x02;
+        stats.truncated++;
+    }
+    out.hashes.push_back(question_hash(hash_wire_name(owner), qtype));
+    out.replies.push_back(move(reply));
+}
+
+// One template per (name, type) and a catch-all per name: NODATA for a
+// plain name, the CNAME chain for an alias. An alias's chain is followed
+// through local data until it leaves the zone or reaches a name with
+// records, whose RRsets each get the chain in front of them.
+static void compile_zone(const ZoneData& zone, Compiled& out, Stats& stats) {
+    for (const auto& [owner, rrsets] : zone) {
+        auto cname = rrsets.find(TYPE_CNAME);
+        if (cname == rrsets.end()) {
+            for (const auto& [type, records] : rrsets) {
+                emit(out, owner, type, records, stats);
+            }
+            emit(out, owner, 0, {}, stats);
+            continue;
+        }
+
+        // RFC 1034 3.6.2: an alias has no other data, so only the CNAME is kept
+        if (rrsets.size() > 1 || cname->second.size() > 1) {
+            stats.bad_chains++;
+        }
+        vector<LocalRecord> chain = {cname->second.front()};
+        const map<uint16_t, vector<LocalRecord>>* target = nullptr;
+        for (;;) {
+            auto next = zone.find(chain.back().rdata);
+            if (next == zone.end()) {
+                break;  // leaves the zone; the client's resolver chases it
+            }
+            auto next_cname = next->second.find(TYPE_CNAME);
+            if (next_cname == next->second.end()) {
+                target = &next->second;
+                break;
+            }
+            bool loop = any_of(chain.begin(), chain.end(), [&](const LocalRecord& rr) { return rr.owner == next->first; });
+            if (loop || chain.size() == MAX_CHAIN) {
+                stats.bad_chains++;
+                break;
+            }
+            chain.push_back(next_cname->second.front());
+        }
+
+        emit(out, owner, TYPE_CNAME, {chain.front()}, stats);
+        emit(out, owner, 0, chain, stats);
+        if (target) {
+            for (const auto& [type, records] : *target) {
+                vector<LocalRecord> answers = chain;
+                answers.insert(answers.end(), records.begin(), records.end());
+                emit(out, owner, type, answers, stats);
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t default_ttl = 300;
+    vector<string> inputs;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--ttl" && i + 1 < argc) {
+            default_ttl = static_cast<uint32_t>(stoul(argv[++i]));
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if (inputs.size() < 2) {
+        cerr << "Usage: " << argv[0] << " [--ttl seconds] input... output.dnsz" << endl;
+        cerr << "  Inputs are hosts files or zone text ('-' reads stdin); TTL defaults to 300" << endl;
+        return 1;
+    }
+    string output = inputs.back();
+    inputs.pop_back();
+
+    auto start = chrono::steady_clock::now();
+    ZoneData data;
+    Stats stats;
+    for (const auto& input : inputs) {
+        ifstream file;
+        if (input != "-") {
+            file.open(input);
+            if (!file) {
+                cerr << "Cannot open " << input << endl;
+                return 1;
+            }
+        }
+        istream& in = input == "-" ? cin : file;
+        for (string line; getline(in, line);) {
+            stats.lines++;
+            compile_line(line, default_ttl, data, stats);
+        }
+    }
+
+    Compiled compiled;
+    compile_zone(data, compiled, stats);
+    vector<ZoneTemplate> templates;
+    templates.reserve(compiled.replies.size());
+    for (size_t i = 0; i < compiled.replies.size(); ++i) {
+        templates.push_back({compiled.hashes[i], compiled.replies[i].data(), compiled.replies[i].size()});
+    }
+
+    FrozenZone zone;
+    string error;
+    if (!zone.build(templates)) {
+        cerr << "Two questions in the input share a 64-bit hash; cannot build the table" << endl;
+        return 1;
+    }
+    if (!zone.write(output, error)) {
+        cerr << "Write failed: " << error << endl;
+        return 1;
+    }
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+    cout << "Compiled " << zone.names() << " names (" << stats.records << " records, " << zone.size()
+         << " answers) from " << stats.lines << " lines into " << output << " in " << elapsed.count() << "ms";
+    if (stats.duplicates) {
+        cout << "; " << stats.duplicates << " duplicates";
+    }
+    if (stats.skipped || stats.invalid) {
+        cout << "; skipped " << stats.skipped << " unsupported, " << stats.invalid << " invalid";
+    }
+    if (stats.truncated) {
+        cout << "; " << stats.truncated << " answers over " << MAX_TEMPLATE << " bytes sent truncated";
+    }
+    if (stats.bad_chains) {
+        cout << "; " << stats.bad_chains << " CNAME conflicts, loops or chains over " << MAX_CHAIN << " hops";
+    }
+    cout << endl;
+    return 0;
+}
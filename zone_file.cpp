@@ -0,0 +1,304 @@
+#include "zone_file.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+using namespace std;
+
+constexpr char FrozenZone::MAGIC[8];
+
+static void put16(vector<uint8_t>& out, uint32_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+bool build_local_template(const string& name, uint16_t qtype, const vector<LocalRecord>& answers,
+                          vector<uint8_t>& out) {
+    vector<uint8_t> reply;
+    reply.reserve(MAX_TEMPLATE);
+
+    // Header as in make_local_domain: ID patched per query, 1 question
+    const uint8_t header[6] = {0, 0, 0x81, 0x80, 0, 1};
+    reply.insert(reply.end(), header, header + 6);
+    put16(reply, static_cast<uint32_t>(answers.size()));
+    put16(reply, 0);
+    put16(reply, 0);
+    reply.insert(reply.end(), name.begin(), name.end());
+    put16(reply, qtype);
+    put16(reply, 1);
+
+    // Names already written that a later owner can point back at: the
+    // question, then each CNAME target as the chain unfolds
+    vector<pair<string, size_t>> written = {{name, 12}};
+    for (const LocalRecord& rr : answers) {
+        auto known = find_if(written.begin(), written.end(), [&](const auto& w) { return w.first == rr.owner; });
+        if (known != written.end()) {
+            put16(reply, 0xC000 | static_cast<uint32_t>(known->second));
+        } else {
+            if (reply.size() < 0x4000) {
+                written.emplace_back(rr.owner, reply.size());
+            }
+            reply.insert(reply.end(), rr.owner.begin(), rr.owner.end());
+        }
+        put16(reply, rr.type);
+        put16(reply, 1);
+        put16(reply, rr.ttl >> 16);
+        put16(reply, rr.ttl & 0xFFFF);
+        put16(reply, static_cast<uint32_t>(rr.rdata.size()));
+        if (rr.type == TYPE_CNAME && reply.size() < 0x4000) {
+            written.emplace_back(rr.rdata, reply.size());
+        }
+        reply.insert(reply.end(), rr.rdata.begin(), rr.rdata.end());
+        if (reply.size() > MAX_TEMPLATE) {
+            return false;
+        }
+    }
+    if (reply.size() > MAX_TEMPLATE) {
+        return false;
+    }
+    out = move(reply);
+    return true;
+}
+
+// The QTYPE a template answers, found by walking its question name
+static bool template_qtype(const ZoneTemplate& t, uint16_t& qtype) {
+    size_t pos = 12;
+    while (pos < t.len && t.data[pos] != 0) {
+        pos += 1 + t.data[pos];
+    }
+    if (pos + 3 > t.len) {
+        return false;
+    }
+    qtype = static_cast<uint16_t>((t.data[pos + 1] << 8) | t.data[pos + 2]);
+    return true;
+}
+
+FrozenZone::~FrozenZone() {
+    unmap();
+}
+
+void FrozenZone::unmap() {
+    if (mapping) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+}
+
+bool FrozenZone::build(const vector<ZoneTemplate>& templates) {
+    size_t n = templates.size();
+    vector<uint64_t> hashes(n);
+    for (size_t i = 0; i < n; ++i) {
+        hashes[i] = templates[i].hash;
+    }
+    sort(hashes.begin(), hashes.end());
+    if (adjacent_find(hashes.begin(), hashes.end()) != hashes.end()) {
+        return false;  // Keys with one hash cannot be separated by any seed
+    }
+
+    unmap();
+    num_seeds = max<size_t>(1, (n + 3) / 4);  // ~4 keys per bucket
+    own_seeds.assign(num_seeds, 0);
+
+    // Place the largest buckets first, while the table is still empty, and
+    // give each the first seed that lands all its keys on free slots. If a
+    // bucket finds none, grow the table slightly and start over.
+    vector<vector<uint32_t>> buckets(num_seeds);
+    for (size_t i = 0; i < n; ++i) {
+        buckets[bucket_of(templates[i].hash)].push_back(static_cast<uint32_t>(i));
+    }
+    vector<size_t> order(num_seeds);
+    for (size_t i = 0; i < num_seeds; ++i) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) { return buckets[x].size() > buckets[y].size(); });
+
+    constexpr uint32_t MAX_SEED = 1u << 20;
+    size_t table_size = n;
+    vector<size_t> placement(n);
+    vector<size_t> candidate;
+    for (;;) {
+        vector<bool> taken(table_size);
+        bool placed_all = true;
+
+        for (size_t b : order) {
+            const auto& members = buckets[b];
+            if (members.empty()) {
+                break;
+            }
+
+            bool placed = false;
+            for (uint32_t seed = 0; seed < MAX_SEED && !placed; ++seed) {
+                candidate.clear();
+                for (uint32_t key : members) {
+                    size_t slot = slot_of(templates[key].hash, seed, table_size);
+                    if (taken[slot] || std::find(candidate.begin(), candidate.end(), slot) != candidate.end()) {
+                        break;
+                    }
+                    candidate.push_back(slot);
+                }
+                if (candidate.size() == members.size()) {
+                    for (size_t i = 0; i < members.size(); ++i) {
+                        taken[candidate[i]] = true;
+                        placement[members[i]] = candidate[i];
+                    }
+                    own_seeds[b] = seed;
+                    placed = true;
+                }
+            }
+            if (!placed) {
+                placed_all = false;
+                break;
+            }
+        }
+
+        if (placed_all) {
+            break;
+        }
+        table_size += n / 16 + 1;
+    }
+
+    vector<const ZoneTemplate*> by_slot(table_size, nullptr);
+    for (size_t i = 0; i < n; ++i) {
+        by_slot[placement[i]] = &templates[i];
+    }
+
+    own_slots.assign(table_size, {0, 0, 0});
+    own_blob.clear();
+    for (size_t slot = 0; slot < table_size; ++slot) {
+        if (const ZoneTemplate* t = by_slot[slot]) {
+            if (own_blob.size() + t->len > UINT32_MAX) {
+                return false;
+            }
+            own_slots[slot] = {t->hash, static_cast<uint32_t>(own_blob.size()), static_cast<uint32_t>(t->len)};
+            own_blob.insert(own_blob.end(), t->data, t->data + t->len);
+        }
+    }
+
+    seeds = own_seeds.data();
+    slots = own_slots.data();
+    num_slots = table_size;
+    blob = own_blob.data();
+    blob_size = own_blob.size();
+    records = n;
+    name_count = 0;
+    for (const ZoneTemplate& t : templates) {
+        uint16_t qtype = 0;
+        name_count += template_qtype(t, qtype) && qtype == 0;
+    }
+    return true;
+}
+
+static size_t align8(size_t offset) {
+    return (offset + 7) & ~static_cast<size_t>(7);
+}
+
+bool FrozenZone::write(const string& path, string& error) const {
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.hash_kind = WIRE_HASH_KIND;
+    header.records = records;
+    header.names = name_count;
+    header.num_seeds = num_seeds;
+    header.num_slots = num_slots;
+    header.blob_size = blob_size;
+    header.seeds_offset = align8(sizeof(header));
+    header.slots_offset = align8(header.seeds_offset + num_seeds * sizeof(uint32_t));
+    header.blob_offset = header.slots_offset + num_slots * sizeof(Slot);
+
+    // Written beside the target and renamed over it, so a server mapping
+    // the old file never sees a half-written one
+    string tmp = path + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (!out) {
+        error = tmp + ": " + strerror(errno);
+        return false;
+    }
+
+    static const uint8_t padding[8] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(padding, header.seeds_offset - sizeof(header), 1, out) <= 1 &&
+              fwrite(seeds, sizeof(uint32_t), num_seeds, out) == num_seeds &&
+              fwrite(padding, header.slots_offset - header.seeds_offset - num_seeds * sizeof(uint32_t), 1, out) <= 1 &&
+              fwrite(slots, sizeof(Slot), num_slots, out) == num_slots &&
+              fwrite(blob, 1, blob_size, out) == blob_size;
+    ok = (fclose(out) == 0) && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        error = path + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FrozenZone::map(const string& path, string& error) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+        error = path + ": not a compiled zone file";
+        close(fd);
+        return false;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    // Only the header and section bounds are checked here; slots are
+    // bounds-checked as they are probed, so loading never walks the file
+    const FileHeader* header = static_cast<const FileHeader*>(addr);
+    const char* problem = nullptr;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION) {
+        problem = "not a compiled zone file, or from another version; recompile it with zone_compiler";
+    } else if (header->hash_kind != WIRE_HASH_KIND) {
+        problem = "compiled with a different name hash (SSE4.2 mismatch); recompile it here";
+    } else if (header->num_seeds == 0 || header->num_slots < header->records ||
+               header->seeds_offset + header->num_seeds * sizeof(uint32_t) > size ||
+               header->slots_offset + header->num_slots * sizeof(Slot) > size ||
+               header->blob_offset + header->blob_size > size ||
+               header->seeds_offset % 8 || header->slots_offset % 8) {
+        problem = "truncated or corrupt";
+    }
+    if (problem) {
+        error = path + ": " + problem;
+        munmap(addr, size);
+        return false;
+    }
+
+    // Lookups land anywhere in the file; readahead would only waste page cache
+    madvise(addr, size, MADV_RANDOM);
+
+    unmap();
+    own_seeds.clear();
+    own_slots.clear();
+    own_blob.clear();
+    mapping = addr;
+    mapping_size = size;
+
+    const uint8_t* base = static_cast<const uint8_t*>(addr);
+    seeds = reinterpret_cast<const uint32_t*>(base + header->seeds_offset);
+    num_seeds = header->num_seeds;
+    slots = reinterpret_cast<const Slot*>(base + header->slots_offset);
+    num_slots = header->num_slots;
+    blob = base + header->blob_offset;
+    blob_size = header->blob_size;
+    records = header->records;
+    name_count = header->names;
+    return true;
+}
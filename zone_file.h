@@ -0,0 +1,204 @@
+#ifndef ZONE_FILE_H
+#define ZONE_FILE_H
+
+#include "dns_wire.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+
+using namespace std;
+
+// Largest local answer; UDP clients get one over their EDNS size (or 512
+// bytes without EDNS) truncated and retry over TCP
+constexpr size_t MAX_TEMPLATE = 4096;
+
+// A local A record whose reply template is encoded by the compiler, for
+// names built into the binary. make_local_domain is also what
+// add_local_domain runs at load time, and build_local_template lays out
+// the same bytes for a lone A record, so compiled zones agree with both.
+struct StaticLocalDomain {
+    static constexpr size_t MAX_SIZE = 12 + MAX_WIRE_NAME + 4 + 16;
+
+    uint8_t response[MAX_SIZE] = {};
+    size_t len = 0;
+    size_t name_len = 0;          // wire-format name at response + 12
+    uint64_t name_hash = 0;       // hash_wire_name of that name
+    uint64_t hash = 0;            // question_hash of the name and type A
+};
+
+constexpr StaticLocalDomain make_local_domain(string_view name, uint8_t a, uint8_t b, uint8_t c, uint8_t d,
+                                              uint32_t ttl = 300) {
+    StaticLocalDomain domain;
+    uint8_t* out = domain.response;
+
+    // Header: ID 0 (patched per query), standard response, 1 question, 1 answer
+    const uint8_t header[12] = {0, 0, 0x81, 0x80, 0, 1, 0, 1, 0, 0, 0, 0};
+    size_t pos = 0;
+    for (uint8_t byte : header) {
+        out[pos++] = byte;
+    }
+
+    // Lowercased wire-format name; a bad name fails compilation when
+    // evaluated at compile time
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t dot = name.find('.', start);
+        if (dot == string_view::npos) {
+            dot = name.size();
+        }
+        if (dot == start || dot - start > 63 || pos + 1 + (dot - start) + 1 > 12 + MAX_WIRE_NAME) {
+            throw invalid_argument("invalid local domain name");
+        }
+        out[pos++] = static_cast<uint8_t>(dot - start);
+        for (size_t i = start; i < dot; ++i) {
+            char ch = name[i];
+            out[pos++] = static_cast<uint8_t>(ch >= 'A' && ch <= 'Z' ? ch | 0x20 : ch);
+        }
+        start = dot + 1;
+    }
+    out[pos++] = 0;
+    domain.name_len = pos - 12;
+
+    // QTYPE A, QCLASS IN, then the answer: pointer to the question name,
+    // A IN, TTL, RDLENGTH 4, address
+    const uint8_t tail[] = {0, 1, 0, 1, 0xC0, 0x0C, 0, 1, 0, 1,
+                            static_cast<uint8_t>(ttl >> 24), static_cast<uint8_t>(ttl >> 16),
+                            static_cast<uint8_t>(ttl >> 8), static_cast<uint8_t>(ttl),
+                            0, 4, a, b, c, d};
+    for (uint8_t byte : tail) {
+        out[pos++] = byte;
+    }
+
+    domain.len = pos;
+    domain.name_hash = hash_wire_name_constexpr(out + 12, domain.name_len);
+    domain.hash = question_hash(domain.name_hash, TYPE_A);
+    return domain;
+}
+
+// A record of a local answer. owner and any names inside rdata are
+// lowercased, uncompressed wire format.
+struct LocalRecord {
+    string owner;
+    uint16_t type;
+    uint32_t ttl;
+    string rdata;
+};
+
+// Lays out the reply template for (name, qtype) answering with records in
+// order. Owners equal to the question name or to an earlier CNAME target
+// become compression pointers. Under qtype 0 it builds a name's catch-all
+// template (see PrecompiledResponses::get_response). False, with out
+// untouched, if the reply would exceed MAX_TEMPLATE.
+bool build_local_template(const string& name, uint16_t qtype, const vector<LocalRecord>& answers,
+                          vector<uint8_t>& out);
+
+// A reply template to freeze: the wire-format name sits at data + 12 and
+// is followed by the QTYPE this template answers
+struct ZoneTemplate {
+    uint64_t hash;
+    const uint8_t* data;
+    size_t len;
+};
+
+// An immutable CHD minimal perfect hash over reply templates: the name hash
+// picks a bucket, the bucket's seed picks exactly one slot, and the slot
+// locates the template in one contiguous blob laid out in slot order.
+//
+// The table is either built in memory or mapped read-only from a compiled
+// zone file (see zone_compiler), whose layout is the table itself: a header,
+// the seeds, the slots and the blob. A mapped table is served in place, so
+// startup cost and private memory do not grow with the zone, and every
+// process mapping the same file shares one page-cache copy.
+class FrozenZone {
+public:
+    struct Slot {
+        uint64_t hash;
+        uint32_t offset;            // into the blob
+        uint32_t len;               // 0 marks an unused slot
+    };
+
+    FrozenZone() = default;
+    ~FrozenZone();
+
+    FrozenZone(const FrozenZone&) = delete;
+    FrozenZone& operator=(const FrozenZone&) = delete;
+
+    // False only if two distinct questions share a 64-bit hash
+    bool build(const vector<ZoneTemplate>& templates);
+
+    bool write(const string& path, string& error) const;
+    bool map(const string& path, string& error);
+
+    // The template for this lowercased wire name and type, or nullptr;
+    // hash is question_hash of the two
+    const uint8_t* find(uint64_t hash, const uint8_t* name, size_t name_len, uint16_t qtype, size_t& len) const {
+        if (num_slots == 0) {
+            return nullptr;
+        }
+        const Slot& slot = slots[slot_of(hash, seeds[bucket_of(hash)], num_slots)];
+        if (slot.hash != hash || slot.len < 12 + name_len + 2 ||
+            static_cast<size_t>(slot.offset) + slot.len > blob_size) {
+            return nullptr;
+        }
+        const uint8_t* tmpl = blob + slot.offset;
+        if (memcmp(tmpl + 12, name, name_len) != 0 || tmpl[12 + name_len] != (qtype >> 8) ||
+            tmpl[12 + name_len + 1] != (qtype & 0xFF)) {
+            return nullptr;
+        }
+        len = slot.len;
+        return tmpl;
+    }
+
+    size_t size() const { return records; }
+    size_t names() const { return name_count; }     // one catch-all template each
+
+private:
+    // Compiled zone files are rejected unless built with this layout and
+    // the same name hash the parser uses
+    static constexpr char MAGIC[8] = {'D', 'N', 'S', 'Z', 'O', 'N', 'E', '1'};
+    static constexpr uint32_t VERSION = 2;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t hash_kind;         // WIRE_HASH_KIND of the compiler
+        uint64_t records;
+        uint64_t names;
+        uint64_t num_seeds;
+        uint64_t num_slots;
+        uint64_t blob_size;
+        uint64_t seeds_offset;      // sections are 8-byte aligned
+        uint64_t slots_offset;
+        uint64_t blob_offset;
+    };
+
+    vector<uint32_t> own_seeds;
+    vector<Slot> own_slots;
+    vector<uint8_t> own_blob;
+
+    const uint32_t* seeds = nullptr;
+    size_t num_seeds = 0;
+    const Slot* slots = nullptr;
+    size_t num_slots = 0;
+    const uint8_t* blob = nullptr;
+    size_t blob_size = 0;
+    size_t records = 0;
+    size_t name_count = 0;
+
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+    size_t bucket_of(uint64_t hash) const {
+        return static_cast<size_t>(((hash >> 32) * num_seeds) >> 32);
+    }
+    static size_t slot_of(uint64_t hash, uint32_t seed, size_t table_size) {
+        uint64_t x = wire_hash_finish(hash ^ (seed * 0x9E3779B97F4A7C15ull), 0);
+        return static_cast<size_t>(((x & 0xFFFFFFFFull) * table_size) >> 32);
+    }
+
+    void unmap();
+};
+
+#endif // ZONE_FILE_H